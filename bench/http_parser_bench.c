@@ -0,0 +1,213 @@
+#include "http_parser.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * HTTP parser correctness corpus and microbenchmark
+ *
+ * Usage: http-parser-bench [--check] [ITERATIONS]
+ *   --check   Run the corpus only (exit status 1 on any mismatch)
+ */
+
+typedef struct {
+    const char* name;
+    const char* data;
+    size_t len;
+    int expect;                                     // HTTP_PARSE_* or 1 for success
+} corpus_entry_t;
+
+#define OK 1
+#define RAW(s) s, sizeof(s) - 1
+
+static const corpus_entry_t corpus[] = {
+    // Well formed
+    { "simple get", RAW("GET / HTTP/1.1\r\n\r\n"), OK },
+    { "bare lf", RAW("GET / HTTP/1.0\nHost: a\n\n"), OK },
+    { "query", RAW("GET /list?limit=10&cursor=20 HTTP/1.1\r\nHost: pi\r\n\r\n"), OK },
+    { "leading crlf", RAW("\r\nGET / HTTP/1.1\r\n\r\n"), OK },
+    { "empty value", RAW("GET / HTTP/1.1\r\nX-Empty:\r\n\r\n"), OK },
+    { "tab in value", RAW("GET / HTTP/1.1\r\nX-Tab: a\tb\r\n\r\n"), OK },
+    { "obs-text value", RAW("GET / HTTP/1.1\r\nX-Utf8: \xc3\xa9t\xc3\xa9\r\n\r\n"), OK },
+    { "content length", RAW("POST /upload HTTP/1.1\r\nContent-Length: 1024\r\n\r\n"), OK },
+    { "duplicate equal length", RAW("POST / HTTP/1.1\r\nContent-Length: 5\r\ncontent-length: 5\r\n\r\n"), OK },
+
+    // Incomplete
+    { "empty", RAW(""), HTTP_PARSE_INCOMPLETE },
+    { "partial method", RAW("GE"), HTTP_PARSE_INCOMPLETE },
+    { "partial target", RAW("GET /sta"), HTTP_PARSE_INCOMPLETE },
+    { "partial version", RAW("GET / HTTP/1"), HTTP_PARSE_INCOMPLETE },
+    { "no blank line", RAW("GET / HTTP/1.1\r\nHost: a\r\n"), HTTP_PARSE_INCOMPLETE },
+    { "cr only", RAW("GET / HTTP/1.1\r\nHost: a\r\n\r"), HTTP_PARSE_INCOMPLETE },
+
+    // Malformed
+    { "no target", RAW("GET  HTTP/1.1\r\n\r\n"), HTTP_PARSE_ERROR },
+    { "lowercase version", RAW("GET / http/1.1\r\n\r\n"), HTTP_PARSE_ERROR },
+    { "http2 version", RAW("GET / HTTP/2.0\r\n\r\n"), HTTP_PARSE_ERROR },
+    { "bad version digit", RAW("GET / HTTP/1.x\r\n\r\n"), HTTP_PARSE_ERROR },
+    { "bad method char", RAW("G(T / HTTP/1.1\r\n\r\n"), HTTP_PARSE_ERROR },
+    { "tab separator", RAW("GET\t/ HTTP/1.1\r\n\r\n"), HTTP_PARSE_ERROR },
+    { "nul in target", RAW("GET /\0x HTTP/1.1\r\n\r\n"), HTTP_PARSE_ERROR },
+    { "del in target", RAW("GET /\x7f HTTP/1.1\r\n\r\n"), HTTP_PARSE_ERROR },
+    { "cr without lf", RAW("GET / HTTP/1.1\rHost: a\r\n\r\n"), HTTP_PARSE_ERROR },
+    { "header without colon", RAW("GET / HTTP/1.1\r\nBad Header\r\n\r\n"), HTTP_PARSE_ERROR },
+    { "empty header name", RAW("GET / HTTP/1.1\r\n: value\r\n\r\n"), HTTP_PARSE_ERROR },
+    { "space before colon", RAW("GET / HTTP/1.1\r\nHost : a\r\n\r\n"), HTTP_PARSE_ERROR },
+    { "obs fold", RAW("GET / HTTP/1.1\r\nX-A: 1\r\n  continued\r\n\r\n"), HTTP_PARSE_ERROR },
+    { "nul in value", RAW("GET / HTTP/1.1\r\nX-A: a\0b\r\n\r\n"), HTTP_PARSE_ERROR },
+    { "negative length", RAW("POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n"), HTTP_PARSE_ERROR },
+    { "hex length", RAW("POST / HTTP/1.1\r\nContent-Length: 0x10\r\n\r\n"), HTTP_PARSE_ERROR },
+    { "huge length", RAW("POST / HTTP/1.1\r\nContent-Length: 99999999999999999999\r\n\r\n"), HTTP_PARSE_ERROR },
+    { "conflicting lengths", RAW("POST / HTTP/1.1\r\nContent-Length: 10\r\nContent-Length: 11\r\n\r\n"), HTTP_PARSE_ERROR },
+    { "body lookalike", RAW("GET / HTTP/1.1\r\nX: 1\r\n\r\nContent-Length: 5\r\n"), OK },
+};
+
+// Typical browser request used for timing
+static const char bench_request[] =
+    "POST /load?file=Spyro%20Dark.bin&slot=1 HTTP/1.1\r\n"
+    "Host: raspberrypi.local:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://raspberrypi.local:8080/\r\n"
+    "Origin: http://raspberrypi.local:8080\r\n"
+    "Connection: keep-alive\r\n"
+    "Content-Length: 0\r\n"
+    "Priority: u=4\r\n"
+    "\r\n";
+
+/**
+ * Run the correctness corpus
+ * Returns number of failures
+ */
+static int run_corpus(void) {
+    int failures = 0;
+    size_t n = sizeof(corpus) / sizeof(corpus[0]);
+    http_request_t req;
+
+    for (size_t i = 0; i < n; i++) {
+        const corpus_entry_t* c = &corpus[i];
+        size_t len = c->len;
+
+        int rc = http_parse_request(c->data, len, 0, &req);
+        int got = rc >= 0 ? OK : rc;
+        if (got != c->expect) {
+            printf("FAIL %-24s expected %d got %d\n", c->name, c->expect, rc);
+            failures++;
+            continue;
+        }
+
+        // Complete requests must parse identically when fed byte by byte
+        if (rc >= 0) {
+            size_t last_len = 0;
+            int partial = HTTP_PARSE_INCOMPLETE;
+            for (size_t k = 1; k <= len && partial == HTTP_PARSE_INCOMPLETE; k++) {
+                partial = http_parse_request(c->data, k, last_len, &req);
+                last_len = k;
+            }
+            if (partial != rc) {
+                printf("FAIL %-24s incremental parse returned %d, expected %d\n",
+                       c->name, partial, rc);
+                failures++;
+            }
+        }
+    }
+
+    // Oversized headers must be rejected rather than waited on
+    char* big = malloc(HTTP_MAX_HEADER_SIZE + 64);
+    if (big) {
+        int len = snprintf(big, 64, "GET / HTTP/1.1\r\nX-Big: ");
+        memset(big + len, 'a', HTTP_MAX_HEADER_SIZE + 64 - len);
+        if (http_parse_request(big, HTTP_MAX_HEADER_SIZE + 64, 0, &req) != HTTP_PARSE_ERROR) {
+            printf("FAIL %-24s oversized headers accepted\n", "oversized");
+            failures++;
+        }
+        free(big);
+    }
+
+    // Slices and query parameters
+    const char* q = "GET /load?profile=x&file=Spyro%20Dark.bin&slot=1 HTTP/1.1\r\n\r\n";
+    if (http_parse_request(q, strlen(q), 0, &req) > 0) {
+        char* file = http_query_param(req.query, "file");
+        char* slot = http_query_param(req.query, "slot");
+        if (!http_slice_eq(req.path, "/load") || !file || strcmp(file, "Spyro Dark.bin") != 0 ||
+            !slot || strcmp(slot, "1") != 0) {
+            printf("FAIL %-24s path/query slices\n", "query");
+            failures++;
+        }
+        free(file);
+        free(slot);
+    } else {
+        failures++;
+    }
+
+    printf("Corpus: %zu cases, %d failures\n", n + 2, failures);
+    return failures;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Time full parses of a typical request
+ */
+static void run_bench(long iterations) {
+    http_request_t req;
+    size_t len = sizeof(bench_request) - 1;
+    volatile int sink = 0;
+
+    // Warmup
+    for (long i = 0; i < iterations / 10; i++) {
+        sink += http_parse_request(bench_request, len, 0, &req);
+    }
+
+    double start = now_sec();
+    for (long i = 0; i < iterations; i++) {
+        sink += http_parse_request(bench_request, len, 0, &req);
+    }
+    double elapsed = now_sec() - start;
+
+#if defined(__SSE2__)
+    const char* impl = "sse2";
+#elif defined(__ARM_NEON)
+    const char* impl = "neon";
+#else
+    const char* impl = "scalar";
+#endif
+
+    printf("Parse (%s): %zu-byte request, %ld iterations\n", impl, len, iterations);
+    printf("  %.1f ns/request, %.1f MB/s\n",
+           elapsed * 1e9 / iterations, (double)len * iterations / elapsed / 1e6);
+    (void)sink;
+}
+
+int main(int argc, char* argv[]) {
+    long iterations = 1000000;
+    int check_only = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--check") == 0) {
+            check_only = 1;
+        } else {
+            iterations = atol(argv[i]);
+            if (iterations <= 0) {
+                fprintf(stderr, "Usage: %s [--check] [ITERATIONS]\n", argv[0]);
+                return 1;
+            }
+        }
+    }
+
+    int failures = run_corpus();
+    if (failures > 0) return 1;
+
+    if (!check_only) {
+        run_bench(iterations);
+    }
+
+    return 0;
+}
@@ -0,0 +1,631 @@
+#define _GNU_SOURCE
+#include "portal.h"
+#include "http_parser.h"
+#include "json_writer.h"
+#include "usb_gadget.h"
+#include "crypto/rijndael.h"
+#include "crypto/skylander_crypt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/**
+ * kaos-bench: microbenchmarks for the hot paths of kaos-pi
+ *
+ * Each case is calibrated so one repetition takes at least the minimum
+ * time, warmed up once, then repeated. Results are written as JSON so
+ * builds and Pi models can be compared.
+ *
+ * Usage: kaos-bench [-r REPS] [-t MIN_MS] [-f FILTER] [-p] [-m MHZ] [-o FILE]
+ */
+
+#define BENCH_MAX_REPS      50
+#define BENCH_MAX_CASES     64
+
+// Case: run the operation `iterations` times
+typedef void (*bench_fn_t)(void* ctx, long iterations);
+
+typedef struct {
+    char name[48];
+    bench_fn_t fn;
+    void* ctx;
+} bench_case_t;
+
+// Options
+static int opt_reps = 5;
+static double opt_min_ms = 50;
+static const char* opt_filter = NULL;
+static bool opt_perf = false;
+static double opt_mhz = 0;
+static const char* opt_output = NULL;
+
+static bench_case_t cases[BENCH_MAX_CASES];
+static int num_cases = 0;
+
+// Keeps results observable so the compiler cannot drop the work
+static volatile uint64_t sink;
+
+static void add_case(const char* name, bench_fn_t fn, void* ctx) {
+    if (num_cases >= BENCH_MAX_CASES) return;
+    bench_case_t* c = &cases[num_cases++];
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    c->fn = fn;
+    c->ctx = ctx;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// ---------------------------------------------------------------------------
+// Hardware counters (optional)
+
+static int perf_fds[2] = { -1, -1 };              // cycles, instructions
+
+static int perf_open(uint64_t config, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = group_fd < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+static bool perf_init(void) {
+    perf_fds[0] = perf_open(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (perf_fds[0] < 0) return false;
+    perf_fds[1] = perf_open(PERF_COUNT_HW_INSTRUCTIONS, perf_fds[0]);
+    return true;
+}
+
+static void perf_start(void) {
+    if (perf_fds[0] < 0) return;
+    ioctl(perf_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perf_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static void perf_stop(uint64_t* cycles, uint64_t* instructions) {
+    *cycles = 0;
+    *instructions = 0;
+    if (perf_fds[0] < 0) return;
+    ioctl(perf_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    if (read(perf_fds[0], cycles, sizeof(*cycles)) != sizeof(*cycles)) *cycles = 0;
+    if (perf_fds[1] >= 0 &&
+        read(perf_fds[1], instructions, sizeof(*instructions)) != sizeof(*instructions)) {
+        *instructions = 0;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Harness
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Calibrate, warm up and time one case, appending its result
+ */
+static void run_case(const bench_case_t* c, json_writer_t* w) {
+    // Double the iteration count until one repetition takes long enough
+    long iterations = 1;
+    for (;;) {
+        uint64_t t0 = now_ns();
+        c->fn(c->ctx, iterations);
+        double ms = (now_ns() - t0) / 1e6;
+        if (ms >= opt_min_ms || iterations >= (1L << 30)) break;
+        iterations *= ms < opt_min_ms / 8 ? 8 : 2;
+    }
+
+    // Warmup
+    c->fn(c->ctx, iterations);
+
+    double ns_per_op[BENCH_MAX_REPS];
+    double best_cycles = 0, best_instructions = 0;
+    for (int r = 0; r < opt_reps; r++) {
+        uint64_t cycles, instructions;
+        perf_start();
+        uint64_t t0 = now_ns();
+        c->fn(c->ctx, iterations);
+        uint64_t elapsed = now_ns() - t0;
+        perf_stop(&cycles, &instructions);
+
+        ns_per_op[r] = (double)elapsed / iterations;
+        if (cycles && (best_cycles == 0 || (double)cycles / iterations < best_cycles)) {
+            best_cycles = (double)cycles / iterations;
+            best_instructions = (double)instructions / iterations;
+        }
+    }
+    qsort(ns_per_op, opt_reps, sizeof(double), compare_double);
+    double median = ns_per_op[opt_reps / 2];
+
+    fprintf(stderr, "%-28s %12ld iters %12.1f ns/op\n", c->name, iterations, median);
+
+    json_begin_object(w);
+    json_key(w, "name");
+    json_string(w, c->name);
+    json_key(w, "iterations");
+    json_int(w, iterations);
+    json_key(w, "ns_per_op");
+    json_begin_object(w);
+    json_key(w, "min");
+    json_double(w, ns_per_op[0]);
+    json_key(w, "median");
+    json_double(w, median);
+    json_key(w, "max");
+    json_double(w, ns_per_op[opt_reps - 1]);
+    json_end_object(w);
+
+    // Hardware counters when available, else estimated from the clock rate
+    json_key(w, "cycles_per_op");
+    if (best_cycles > 0) json_double(w, best_cycles);
+    else if (opt_mhz > 0) json_double(w, ns_per_op[0] * opt_mhz / 1000);
+    else json_null(w);
+    json_key(w, "instructions_per_op");
+    if (best_instructions > 0) json_double(w, best_instructions);
+    else json_null(w);
+    json_end_object(w);
+}
+
+// ---------------------------------------------------------------------------
+// Crypto
+
+static unsigned long aes_enc_rk[MAXNR + 1][4];
+static unsigned long aes_dec_rk[MAXNR + 1][4];
+static int aes_rounds;
+static uint8_t figure[SKYLANDER_DATA_SIZE];
+
+static void bench_aes_encrypt(void* ctx, long n) {
+    (void)ctx;
+    uint8_t block[16] = {0};
+    for (long i = 0; i < n; i++) {
+        rijndaelEncrypt(aes_enc_rk[0], aes_rounds, block, block);
+    }
+    sink += block[0];
+}
+
+static void bench_aes_decrypt(void* ctx, long n) {
+    (void)ctx;
+    uint8_t block[16] = {0};
+    for (long i = 0; i < n; i++) {
+        rijndaelDecrypt(aes_dec_rk[0], aes_rounds, block, block);
+    }
+    sink += block[0];
+}
+
+static void bench_decrypt_full(void* ctx, long n) {
+    (void)ctx;
+    for (long i = 0; i < n; i++) {
+        skylander_decrypt_full(figure, sizeof(figure));
+    }
+    sink += figure[0];
+}
+
+static void bench_checksum(void* ctx, long n) {
+    size_t len = (size_t)(intptr_t)ctx;
+    uint32_t sum = 0;
+    for (long i = 0; i < n; i++) {
+        sum += skylander_checksum(figure, len);
+    }
+    sink += sum;
+}
+
+// ---------------------------------------------------------------------------
+// Portal commands
+
+typedef struct {
+    portal_t* portal;
+    uint8_t report[USB_EP_SIZE];
+} command_ctx_t;
+
+static portal_t bench_portal;
+static command_ctx_t command_ctx[8];
+
+static void bench_command(void* ctx, long n) {
+    command_ctx_t* c = ctx;
+    uint8_t response[PORTAL_BUFFER_SIZE];
+    size_t response_len = 0;
+    for (long i = 0; i < n; i++) {
+        portal_process_command(c->portal, c->report, sizeof(c->report), response, &response_len);
+    }
+    sink += response_len;
+}
+
+static void add_command_case(int index, const char* name, const uint8_t* cmd, size_t len) {
+    command_ctx_t* c = &command_ctx[index];
+    c->portal = &bench_portal;
+    memset(c->report, 0, sizeof(c->report));
+    memcpy(c->report, cmd, len);
+    add_case(name, bench_command, c);
+}
+
+// Full portal: game polling status and reading blocks across all 16 slots,
+// optionally with the data cache flushed by other work in between
+
+#define BENCH_EVICT_SIZE    (64 * 1024)     // Several times a Pi Zero's 16 KB L1D
+
+static portal_t full_portal;
+static uint8_t evict_buffer[BENCH_EVICT_SIZE];
+
+static void evict_cache(void) {
+    for (size_t i = 0; i < sizeof(evict_buffer); i += 32) {
+        evict_buffer[i]++;
+    }
+}
+
+static void bench_status_scan(void* ctx, long n) {
+    (void)ctx;
+    uint32_t sum = 0;
+    for (long i = 0; i < n; i++) {
+        sum += portal_get_status(&full_portal);
+    }
+    sink += sum;
+}
+
+static void bench_poll_cycle(void* ctx, long n) {
+    bool evict = ctx != NULL;
+    uint8_t cmd[USB_EP_SIZE] = {0};
+    uint8_t response[PORTAL_BUFFER_SIZE];
+    size_t response_len = 0;
+    for (long i = 0; i < n; i++) {
+        if (evict) evict_cache();
+
+        // One status poll, then a block read from the next slot
+        cmd[0] = CMD_STATUS;
+        portal_process_command(&full_portal, cmd, sizeof(cmd), response, &response_len);
+        cmd[0] = CMD_READ;
+        cmd[1] = i % MAX_SKYLANDERS;
+        cmd[2] = (i / MAX_SKYLANDERS) % SKYLANDER_BLOCKS;
+        portal_process_command(&full_portal, cmd, sizeof(cmd), response, &response_len);
+    }
+    sink += response_len;
+}
+
+static void bench_evict(void* ctx, long n) {
+    (void)ctx;
+    for (long i = 0; i < n; i++) {
+        evict_cache();
+    }
+    sink += evict_buffer[0];
+}
+
+// ---------------------------------------------------------------------------
+// Library listing
+
+typedef struct {
+    char dir[64];
+    int files;
+    bool with_stat;
+} list_ctx_t;
+
+static list_ctx_t list_ctx[8];
+static int num_list_dirs = 0;
+
+static void bench_list(void* ctx, long n) {
+    list_ctx_t* c = ctx;
+    for (long i = 0; i < n; i++) {
+        int count = 0;
+        skylander_file_t* files = portal_list_skylander_files(c->dir, c->with_stat, &count);
+        portal_free_skylander_files(files, count);
+        sink += count;
+    }
+}
+
+/**
+ * Create a temporary library with `files` figure files
+ */
+static const char* make_library(int files) {
+    static char dir[64];
+    snprintf(dir, sizeof(dir), "/tmp/kaos-bench-XXXXXX");
+    if (!mkdtemp(dir)) return NULL;
+
+    char path[128];
+    for (int i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "%s/figure-%05d.bin", dir, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) continue;
+        if (write(fd, figure, sizeof(figure)) < 0) perror("write");
+        close(fd);
+    }
+    return dir;
+}
+
+static void remove_library(const char* dir) {
+    DIR* d = opendir(dir);
+    if (!d) return;
+    struct dirent* entry;
+    char path[512];
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int)sizeof(path)) continue;
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+static void add_list_cases(int files) {
+    const char* dir = make_library(files);
+    if (!dir || num_list_dirs + 2 > (int)(sizeof(list_ctx) / sizeof(list_ctx[0]))) return;
+
+    char name[48];
+    for (int with_stat = 0; with_stat <= 1; with_stat++) {
+        list_ctx_t* c = &list_ctx[num_list_dirs++];
+        snprintf(c->dir, sizeof(c->dir), "%s", dir);
+        c->files = files;
+        c->with_stat = with_stat;
+        snprintf(name, sizeof(name), "list.%d%s", files, with_stat ? ".stat" : "");
+        add_case(name, bench_list, c);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// HTTP and JSON
+
+static const char bench_request[] =
+    "POST /load?file=Spyro%20the%20Dragon%20%28Legendary%29.bin&slot=1 HTTP/1.1\r\n"
+    "Host: raspberrypi.local:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Referer: http://raspberrypi.local:8080/\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n";
+
+static const char bench_encoded[] = "Spyro%20the%20Dragon%20%28Legendary%29%20-%20Copy.bin";
+static const char bench_query[] = "profile=default&sort=name&order=asc&file=Spyro%20Dark.bin&slot=1";
+
+static void bench_parse_request(void* ctx, long n) {
+    (void)ctx;
+    http_request_t req;
+    for (long i = 0; i < n; i++) {
+        sink += http_parse_request(bench_request, sizeof(bench_request) - 1, 0, &req);
+    }
+}
+
+static void bench_url_decode(void* ctx, long n) {
+    (void)ctx;
+    char out[sizeof(bench_encoded)];
+    for (long i = 0; i < n; i++) {
+        sink += http_url_decode(out, bench_encoded, sizeof(bench_encoded) - 1);
+    }
+}
+
+static void bench_query_param(void* ctx, long n) {
+    (void)ctx;
+    http_slice_t query = { bench_query, sizeof(bench_query) - 1 };
+    for (long i = 0; i < n; i++) {
+        char* value = http_query_param(query, "slot");
+        sink += value ? value[0] : 0;
+        free(value);
+    }
+}
+
+static void bench_json_list(void* ctx, long n) {
+    int files = (int)(intptr_t)ctx;
+    char name[64];
+    for (long i = 0; i < n; i++) {
+        json_writer_t w;
+        json_writer_init(&w, -1);
+        json_begin_object(&w);
+        json_key(&w, "files");
+        json_begin_array(&w);
+        for (int f = 0; f < files; f++) {
+            snprintf(name, sizeof(name), "Spyro \"Dark\" %d.bin", f);
+            json_begin_object(&w);
+            json_key(&w, "name");
+            json_string(&w, name);
+            json_key(&w, "size");
+            json_int(&w, SKYLANDER_DATA_SIZE);
+            json_end_object(&w);
+        }
+        json_end_array(&w);
+        json_end_object(&w);
+        sink += w.len;
+        json_writer_free(&w);
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+static void write_host_info(json_writer_t* w) {
+    struct utsname uts;
+    json_key(w, "host");
+    json_begin_object(w);
+    if (uname(&uts) == 0) {
+        json_key(w, "machine");
+        json_string(w, uts.machine);
+        json_key(w, "kernel");
+        json_string(w, uts.release);
+    }
+
+    // Raspberry Pi model, e.g. "Raspberry Pi Zero W Rev 1.1"
+    char model[128] = "";
+    FILE* fp = fopen("/proc/device-tree/model", "r");
+    if (fp) {
+        size_t n = fread(model, 1, sizeof(model) - 1, fp);
+        model[n] = '\0';
+        fclose(fp);
+    }
+    json_key(w, "model");
+    if (model[0]) json_string(w, model);
+    else json_null(w);
+
+    json_key(w, "compiler");
+    json_string(w, __VERSION__);
+    json_end_object(w);
+
+    json_key(w, "config");
+    json_begin_object(w);
+    json_key(w, "reps");
+    json_int(w, opt_reps);
+    json_key(w, "min_ms");
+    json_double(w, opt_min_ms);
+    json_key(w, "perf_counters");
+    json_bool(w, perf_fds[0] >= 0);
+    json_end_object(w);
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [OPTIONS]\n", program);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -r REPS     Timed repetitions per case (default: 5)\n");
+    fprintf(stderr, "  -t MS       Minimum time per repetition (default: 50)\n");
+    fprintf(stderr, "  -f FILTER   Only run cases whose name contains FILTER\n");
+    fprintf(stderr, "  -p          Read cycle/instruction counters (perf_event_open)\n");
+    fprintf(stderr, "  -m MHZ      CPU clock for cycle estimates without counters\n");
+    fprintf(stderr, "  -o FILE     Write JSON results to FILE (default: stdout)\n");
+    fprintf(stderr, "  -l          List cases and exit\n");
+    fprintf(stderr, "  -h          Show this help message\n");
+}
+
+int main(int argc, char* argv[]) {
+    bool list_only = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:t:f:pm:o:lh")) != -1) {
+        switch (opt) {
+            case 'r': opt_reps = atoi(optarg); break;
+            case 't': opt_min_ms = atof(optarg); break;
+            case 'f': opt_filter = optarg; break;
+            case 'p': opt_perf = true; break;
+            case 'm': opt_mhz = atof(optarg); break;
+            case 'o': opt_output = optarg; break;
+            case 'l': list_only = true; break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (opt_reps < 1 || opt_reps > BENCH_MAX_REPS || opt_min_ms <= 0) {
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    if (opt_perf && !perf_init()) {
+        perror("perf_event_open (counters disabled)");
+    }
+
+    // The portal logs to stdout; results go to stdout or -o
+    FILE* out = stdout;
+    int saved_stdout = -1;
+    if (opt_output) {
+        out = fopen(opt_output, "w");
+        if (!out) {
+            perror(opt_output);
+            return 2;
+        }
+    } else {
+        saved_stdout = dup(STDOUT_FILENO);
+        out = fdopen(saved_stdout, "w");
+    }
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull >= 0) {
+        fflush(stdout);
+        dup2(devnull, STDOUT_FILENO);
+        close(devnull);
+    }
+
+    // Fixtures
+    for (size_t i = 0; i < sizeof(figure); i++) {
+        figure[i] = (uint8_t)(i * 31 + 7);
+    }
+    aes_rounds = rijndaelSetupEncrypt(aes_enc_rk[0], figure, KEYBITS);
+    rijndaelSetupDecrypt(aes_dec_rk[0], figure, KEYBITS);
+
+    portal_init(&bench_portal);
+    portal_load_skylander_from_buffer(&bench_portal, 0, figure, sizeof(figure), "bench.bin");
+    portal_activate(&bench_portal);
+
+    // Cases
+    add_case("aes.encrypt", bench_aes_encrypt, NULL);
+    add_case("aes.decrypt", bench_aes_decrypt, NULL);
+    add_case("crypt.decrypt_full", bench_decrypt_full, NULL);
+    add_case("crypt.checksum.1024", bench_checksum, (void*)(intptr_t)SKYLANDER_DATA_SIZE);
+
+    static const uint8_t cmd_a[] = { CMD_ACTIVATE, 0x01 };
+    static const uint8_t cmd_s[] = { CMD_STATUS };
+    static const uint8_t cmd_r[] = { CMD_READY };
+    static const uint8_t cmd_q[] = { CMD_READ, 0x00, 0x08 };
+    static const uint8_t cmd_w[] = { CMD_WRITE, 0x00, 0x08, 1, 2, 3, 4, 5, 6, 7, 8,
+                                     9, 10, 11, 12, 13, 14, 15, 16 };
+    static const uint8_t cmd_c[] = { CMD_COLOR, 0x20, 0x40, 0x60, 0x00 };
+    add_command_case(0, "command.A", cmd_a, sizeof(cmd_a));
+    add_command_case(1, "command.S", cmd_s, sizeof(cmd_s));
+    add_command_case(2, "command.R", cmd_r, sizeof(cmd_r));
+    add_command_case(3, "command.Q", cmd_q, sizeof(cmd_q));
+    add_command_case(4, "command.W", cmd_w, sizeof(cmd_w));
+    add_command_case(5, "command.C", cmd_c, sizeof(cmd_c));
+
+    portal_init(&full_portal);
+    for (int i = 0; i < MAX_SKYLANDERS; i++) {
+        portal_load_skylander_from_buffer(&full_portal, i, figure, sizeof(figure), "bench.bin");
+    }
+    portal_activate(&full_portal);
+    add_case("portal.status_scan.16", bench_status_scan, NULL);
+    add_case("portal.poll_cycle.16", bench_poll_cycle, NULL);
+    add_case("portal.poll_cycle.16.evicted", bench_poll_cycle, (void*)1);
+    add_case("cache.evict", bench_evict, NULL);
+
+    if (!list_only) {
+        add_list_cases(10);
+        add_list_cases(100);
+        add_list_cases(1000);
+    }
+
+    add_case("http.parse_request", bench_parse_request, NULL);
+    add_case("http.url_decode", bench_url_decode, NULL);
+    add_case("http.query_param", bench_query_param, NULL);
+    add_case("json.list.100", bench_json_list, (void*)(intptr_t)100);
+
+    if (list_only) {
+        for (int i = 0; i < num_cases; i++) fprintf(out, "%s\n", cases[i].name);
+        fprintf(out, "list.{10,100,1000}[.stat]\n");
+        fclose(out);
+        return 0;
+    }
+
+    json_writer_t w;
+    json_writer_init(&w, -1);
+    json_begin_object(&w);
+    write_host_info(&w);
+    json_key(&w, "results");
+    json_begin_array(&w);
+
+    for (int i = 0; i < num_cases; i++) {
+        if (opt_filter && !strstr(cases[i].name, opt_filter)) continue;
+        run_case(&cases[i], &w);
+    }
+
+    json_end_array(&w);
+    json_end_object(&w);
+    fprintf(out, "%s\n", json_writer_data(&w));
+    json_writer_free(&w);
+    fclose(out);
+
+    for (int i = 0; i < num_list_dirs; i += 2) {
+        remove_library(list_ctx[i].dir);
+    }
+
+    return 0;
+}
@@ -132,28 +132,7 @@ if systemctl is-active --quiet kaos-pi; then
     systemctl stop kaos-pi
 fi
 
-# Remove any existing USB gadget
-if [ -d "/sys/kernel/config/usb_gadget/skylander" ]; then
-    print_msg "Cleaning up existing USB gadget..."
-
-    # Unbind UDC if bound
-    if [ -f "/sys/kernel/config/usb_gadget/skylander/UDC" ]; then
-        echo "" > /sys/kernel/config/usb_gadget/skylander/UDC 2>/dev/null || true
-    fi
-
-    # Wait a bit
-    sleep 1
-
-    # Remove symlink
-    rm -f /sys/kernel/config/usb_gadget/skylander/configs/c.1/hid.usb0 2>/dev/null || true
-
-    # Remove directories
-    rmdir /sys/kernel/config/usb_gadget/skylander/configs/c.1/strings/0x409 2>/dev/null || true
-    rmdir /sys/kernel/config/usb_gadget/skylander/configs/c.1 2>/dev/null || true
-    rmdir /sys/kernel/config/usb_gadget/skylander/functions/hid.usb0 2>/dev/null || true
-    rmdir /sys/kernel/config/usb_gadget/skylander/strings/0x409 2>/dev/null || true
-    rmdir /sys/kernel/config/usb_gadget/skylander 2>/dev/null || true
-fi
+# An existing USB gadget is reconciled by kaos-pi itself (only differences are rewritten)
 
 # Run the application
 print_msg "Starting KAOS-Pi..."
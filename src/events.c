@@ -0,0 +1,346 @@
+#include "events.h"
+#include "portal.h"
+#include "json_writer.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Event ring of one portal: written by the portal's owner, drained by the dispatcher
+typedef struct {
+    portal_event_t events[EVENTS_QUEUE_SIZE];
+    _Atomic uint32_t head;                          // Next event to write (producer)
+    _Atomic uint32_t tail;                          // Next event to read (dispatcher)
+} event_ring_t;
+
+static event_ring_t rings[MAX_PORTALS];
+static atomic_bool wakeup_pending;                  // Set by the first publish since the dispatcher woke
+static int wakeup_fd = -1;                          // eventfd the dispatcher sleeps on
+
+// Subscribers
+static int clients[EVENTS_MAX_CLIENTS];
+static int client_portals[EVENTS_MAX_CLIENTS];      // Portal each subscriber follows
+static int client_count = 0;
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t dispatcher_tid;
+static int initialized = 0;
+static atomic_bool running;
+
+static const char SSE_HEADERS[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: text/event-stream\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: keep-alive\r\n"
+    "Access-Control-Allow-Origin: *\r\n"
+    "\r\n"
+    "retry: 2000\n\n";
+
+/**
+ * Send a whole buffer to a subscriber without blocking
+ * Returns 0 on success, -1 if the client is gone or too slow
+ */
+static int send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * Send a buffer to the subscribers of a portal (-1 = all), dropping the ones that fail
+ * Caller must hold clients_lock
+ */
+static void broadcast_locked(int portal, const char* data, size_t len) {
+    int i = 0;
+    while (i < client_count) {
+        if (portal >= 0 && client_portals[i] != portal) {
+            i++;
+            continue;
+        }
+        if (send_all(clients[i], data, len) < 0) {
+            close(clients[i]);
+            client_count--;
+            clients[i] = clients[client_count];
+            client_portals[i] = client_portals[client_count];
+            printf("Event subscriber disconnected (%d remaining)\n", client_count);
+            continue;
+        }
+        i++;
+    }
+}
+
+/**
+ * Format an event as an SSE message
+ * Returns the message length
+ */
+static int format_event(const portal_event_t* ev, int write_count, char* out, size_t out_size) {
+    char name[EVENTS_FILENAME_MAX * 6 + 1];
+
+    switch (ev->type) {
+        case EVENT_PORTAL_ACTIVATE:
+            return snprintf(out, out_size, "event: portal\ndata: {\"state\":\"active\"}\n\n");
+
+        case EVENT_PORTAL_DEACTIVATE:
+            return snprintf(out, out_size, "event: portal\ndata: {\"state\":\"idle\"}\n\n");
+
+        case EVENT_SLOT_LOAD:
+            json_escape(name, sizeof(name), ev->filename);
+            return snprintf(out, out_size,
+                "event: slot\ndata: {\"slot\":%d,\"active\":true,\"filename\":\"%s\"}\n\n",
+                ev->slot, name);
+
+        case EVENT_SLOT_UNLOAD:
+            return snprintf(out, out_size,
+                "event: slot\ndata: {\"slot\":%d,\"active\":false}\n\n", ev->slot);
+
+        case EVENT_LED_COLOR:
+            return snprintf(out, out_size,
+                "event: color\ndata: {\"r\":%d,\"g\":%d,\"b\":%d}\n\n",
+                ev->color[0], ev->color[1], ev->color[2]);
+
+        case EVENT_BLOCK_WRITE:
+            return snprintf(out, out_size,
+                "event: write\ndata: {\"slot\":%d,\"block\":%d,\"count\":%d}\n\n",
+                ev->slot, ev->block, write_count);
+    }
+
+    return 0;
+}
+
+/**
+ * Take everything pending in a ring
+ * Returns the number of events copied into batch
+ */
+static int drain_ring(event_ring_t* ring, portal_event_t* batch) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load(&ring->head);
+    int count = 0;
+    for (; tail != head; tail++) {
+        batch[count++] = ring->events[tail & (EVENTS_QUEUE_SIZE - 1)];
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    return count;
+}
+
+/**
+ * Send a batch of one portal's events to its subscribers
+ * Bursts of block writes to the same slot (a game save) are coalesced into
+ * one event carrying the last block and the number of writes.
+ */
+static void dispatch_batch(const portal_event_t* batch, int count) {
+    char message[1024];
+
+    pthread_mutex_lock(&clients_lock);
+    for (int i = 0; i < count; i++) {
+        int writes = 1;
+        if (batch[i].type == EVENT_BLOCK_WRITE) {
+            while (i + 1 < count && batch[i + 1].type == EVENT_BLOCK_WRITE &&
+                   batch[i + 1].slot == batch[i].slot) {
+                i++;
+                writes++;
+            }
+        }
+
+        if (client_count == 0) continue;
+
+        int len = format_event(&batch[i], writes, message, sizeof(message));
+        if (len > 0 && (size_t)len < sizeof(message)) {
+            broadcast_locked(batch[i].portal, message, len);
+        }
+    }
+    pthread_mutex_unlock(&clients_lock);
+}
+
+/**
+ * Dispatcher thread
+ * Drains the portal rings and fans events out to all subscribers; sleeps
+ * on the wakeup eventfd, sending keep-alives while idle
+ */
+static void* dispatcher_thread(void* arg) {
+    (void)arg;
+    static portal_event_t batch[EVENTS_QUEUE_SIZE];
+    
+    metrics_register_thread("events");
+
+    while (atomic_load(&running)) {
+        // Cleared before draining, so an event published meanwhile signals again
+        atomic_store(&wakeup_pending, false);
+
+        bool drained = false;
+        for (int p = 0; p < MAX_PORTALS; p++) {
+            int count = drain_ring(&rings[p], batch);
+            if (count > 0) {
+                dispatch_batch(batch, count);
+                drained = true;
+            }
+        }
+        if (drained) continue;
+
+        struct pollfd pfd = { .fd = wakeup_fd, .events = POLLIN };
+        int rc = poll(&pfd, 1, EVENTS_HEARTBEAT_SEC * 1000);
+        if (rc > 0) {
+            uint64_t count;
+            if (read(wakeup_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                perror("Event wakeup read");
+            }
+        } else if (rc == 0) {
+            // Idle: keep proxies and browsers from timing out the stream
+            pthread_mutex_lock(&clients_lock);
+            broadcast_locked(-1, ": keep-alive\n\n", 14);
+            pthread_mutex_unlock(&clients_lock);
+        }
+    }
+
+    metrics_unregister_thread();
+    return NULL;
+}
+
+/**
+ * Wake the dispatcher
+ */
+static void wake_dispatcher(void) {
+    uint64_t one = 1;
+    if (write(wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("Event wakeup");
+    }
+}
+
+/**
+ * Initialize the event stream
+ */
+int events_init(void) {
+    if (initialized) return 0;
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0) {
+        perror("Failed to create event wakeup eventfd");
+        return -1;
+    }
+
+    for (int p = 0; p < MAX_PORTALS; p++) {
+        atomic_init(&rings[p].head, 0);
+        atomic_init(&rings[p].tail, 0);
+    }
+    atomic_init(&wakeup_pending, false);
+    client_count = 0;
+    atomic_store(&running, true);
+
+    if (pthread_create(&dispatcher_tid, NULL, dispatcher_thread, NULL) != 0) {
+        perror("Failed to create event dispatcher thread");
+        atomic_store(&running, false);
+        close(wakeup_fd);
+        wakeup_fd = -1;
+        return -1;
+    }
+
+    initialized = 1;
+    printf("Event stream initialized\n");
+    return 0;
+}
+
+/**
+ * Cleanup the event stream
+ */
+void events_cleanup(void) {
+    if (!initialized) return;
+
+    atomic_store(&running, false);
+    wake_dispatcher();
+    pthread_join(dispatcher_tid, NULL);
+
+    pthread_mutex_lock(&clients_lock);
+    for (int i = 0; i < client_count; i++) {
+        close(clients[i]);
+    }
+    client_count = 0;
+    pthread_mutex_unlock(&clients_lock);
+
+    close(wakeup_fd);
+    wakeup_fd = -1;
+    initialized = 0;
+
+    printf("Event stream cleaned up\n");
+}
+
+/**
+ * Queue an event
+ */
+void events_publish(const portal_event_t* event) {
+    if (!initialized || !event || event->portal >= MAX_PORTALS) return;
+
+    event_ring_t* ring = &rings[event->portal];
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= EVENTS_QUEUE_SIZE) {
+        metric_inc(&kaos_metrics.events_dropped);
+        return;
+    }
+    ring->events[head & (EVENTS_QUEUE_SIZE - 1)] = *event;
+    atomic_store(&ring->head, head + 1);
+
+    // Only the first event after the dispatcher woke costs a syscall. The head
+    // store and this exchange are sequentially consistent, like the
+    // dispatcher's clear and drain: an event is either drained or wakes it
+    if (!atomic_exchange(&wakeup_pending, true)) {
+        wake_dispatcher();
+    }
+}
+
+/**
+ * Add a subscriber
+ */
+int events_add_client(int client_fd, const char* snapshot, int portal) {
+    if (!initialized || client_fd < 0) return -1;
+
+    pthread_mutex_lock(&clients_lock);
+
+    if (client_count >= EVENTS_MAX_CLIENTS) {
+        pthread_mutex_unlock(&clients_lock);
+        return -1;
+    }
+
+    // Events are small; push them out immediately
+    int opt = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    if (send_all(client_fd, SSE_HEADERS, sizeof(SSE_HEADERS) - 1) < 0 ||
+        (snapshot && send_all(client_fd, snapshot, strlen(snapshot)) < 0)) {
+        pthread_mutex_unlock(&clients_lock);
+        close(client_fd);
+        return 0;
+    }
+
+    clients[client_count] = client_fd;
+    client_portals[client_count] = portal;
+    client_count++;
+    printf("Event subscriber connected (%d total)\n", client_count);
+
+    pthread_mutex_unlock(&clients_lock);
+    return 0;
+}
+
+/**
+ * Get number of subscribers
+ */
+int events_client_count(void) {
+    pthread_mutex_lock(&clients_lock);
+    int count = client_count;
+    pthread_mutex_unlock(&clients_lock);
+    return count;
+}
@@ -0,0 +1,77 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Portal Event Stream
+ * Lock-free single-producer rings, one per portal, fed by portal.c and
+ * fanned out to Server-Sent Events (SSE) clients of the web server. The
+ * producer of a ring is whichever thread owns that portal's state (its
+ * portal thread), so publishing never waits on the dispatcher or clients.
+ */
+
+// Event stream configuration
+#define EVENTS_QUEUE_SIZE       256     // Pending events per portal (power of two)
+#define EVENTS_MAX_CLIENTS      8       // Concurrent /events subscribers
+#define EVENTS_HEARTBEAT_SEC    15      // Keep-alive comment interval
+#define EVENTS_FILENAME_MAX     128     // Filename bytes carried per event
+
+// Event Types
+typedef enum {
+    EVENT_PORTAL_ACTIVATE,
+    EVENT_PORTAL_DEACTIVATE,
+    EVENT_SLOT_LOAD,
+    EVENT_SLOT_UNLOAD,
+    EVENT_LED_COLOR,
+    EVENT_BLOCK_WRITE
+} event_type_t;
+
+// Portal Event
+typedef struct {
+    event_type_t type;
+    uint8_t portal;                                 // Portal the event happened on
+    uint8_t slot;                                   // Slot (load/unload/write)
+    uint8_t block;                                  // Block (write)
+    uint8_t color[3];                               // RGB (LED color)
+    char filename[EVENTS_FILENAME_MAX];             // Figure file (load)
+} portal_event_t;
+
+// Function Prototypes
+
+/**
+ * Initialize the event queue and start the dispatcher thread
+ * Returns 0 on success, -1 on error
+ */
+int events_init(void);
+
+/**
+ * Stop the dispatcher thread and disconnect all subscribers
+ */
+void events_cleanup(void);
+
+/**
+ * Queue an event for delivery to all subscribers
+ * Lock-free; drops the event if the portal's ring is full (the dispatcher
+ * fell behind). Only the thread owning the portal's state may publish.
+ * Does nothing if the event stream is not initialized.
+ */
+void events_publish(const portal_event_t* event);
+
+/**
+ * Hand a client socket over to the event stream
+ * Sends the SSE response headers followed by the initial snapshot
+ * (a complete "event:/data:" block, may be NULL). The event stream takes
+ * ownership of the socket on success. Only events of the given portal
+ * are delivered.
+ * Returns 0 on success, -1 if the subscriber limit is reached
+ */
+int events_add_client(int client_fd, const char* snapshot, int portal);
+
+/**
+ * Get number of connected subscribers
+ */
+int events_client_count(void);
+
+#endif // EVENTS_H
@@ -0,0 +1,445 @@
+#include "figure_cache.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+#define CACHE_WATCHES   (MAX_PORTALS + 1)   // Library plus every portal data directory
+#define CACHE_EVENTS    (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_ATTRIB)
+
+// One cached figure
+typedef struct {
+    bool used;
+    uint32_t hash;                                  // Of path, checked before comparing it
+    char path[512];
+    struct timespec mtime;                          // Metadata of the file the data came from
+    off_t size;
+    ino_t ino;
+    uint64_t last_used;                             // LRU clock value of the last hit
+    uint8_t data[SKYLANDER_DATA_SIZE];
+} cache_entry_t;
+
+// Watched directory
+typedef struct {
+    int wd;
+    char dir[256];
+} cache_watch_t;
+
+static cache_entry_t entries[FIGURE_CACHE_ENTRIES];
+static uint64_t use_clock = 0;
+static uint64_t generation = 0;                     // Bumped for every change in a watched directory
+static cache_watch_t watches[CACHE_WATCHES];
+static int watch_count = 0;
+static const portal_t* prewarm_pending[MAX_PORTALS];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int inotify_fd = -1;
+static int wake_fd = -1;
+static pthread_t watcher_tid;
+static int initialized = 0;
+static int running = 0;
+
+/**
+ * FNV-1a hash of a path
+ */
+static uint32_t hash_path(const char* path) {
+    uint32_t hash = 2166136261u;
+    for (; *path; path++) {
+        hash = (hash ^ (uint8_t)*path) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Find the entry for path (cache_lock held)
+ */
+static cache_entry_t* find_entry(const char* path, uint32_t hash) {
+    for (int i = 0; i < FIGURE_CACHE_ENTRIES; i++) {
+        if (entries[i].used && entries[i].hash == hash && strcmp(entries[i].path, path) == 0) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Check whether path is in a watched directory (cache_lock held)
+ * Files elsewhere are never cached, since nothing would notice them change
+ */
+static bool is_watched(const char* path) {
+    const char* slash = strrchr(path, '/');
+    if (!slash) return false;
+
+    size_t dir_len = (size_t)(slash - path);
+    for (int i = 0; i < watch_count; i++) {
+        if (strlen(watches[i].dir) == dir_len && strncmp(watches[i].dir, path, dir_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Check whether an entry still matches the file's metadata
+ */
+static bool matches(const cache_entry_t* entry, const struct stat* st) {
+    return entry->size == st->st_size && entry->ino == st->st_ino &&
+           entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+           entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+ * Drop an entry (cache_lock held)
+ */
+static void drop_entry(cache_entry_t* entry) {
+    entry->used = false;
+    metric_gauge_add(&kaos_metrics.cache_entries, -1);
+}
+
+/**
+ * Handle a change of name in the watched directory wd
+ * The entry survives if the file is still the one cached: the write-back
+ * path has usually put the new data already
+ */
+static void handle_change(int wd, const char* name) {
+    char path[512];
+    path[0] = '\0';
+
+    pthread_mutex_lock(&cache_lock);
+    generation++;
+    for (int i = 0; i < watch_count; i++) {
+        if (watches[i].wd == wd) {
+            snprintf(path, sizeof(path), "%s/%s", watches[i].dir, name);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (!path[0]) return;
+
+    struct stat st;
+    bool exists = stat(path, &st) == 0;
+
+    pthread_mutex_lock(&cache_lock);
+    cache_entry_t* entry = find_entry(path, hash_path(path));
+    if (entry && (!exists || !matches(entry, &st))) {
+        drop_entry(entry);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Drop everything (events were lost)
+ */
+static void drop_all(void) {
+    pthread_mutex_lock(&cache_lock);
+    generation++;
+    for (int i = 0; i < FIGURE_CACHE_ENTRIES; i++) {
+        if (entries[i].used) drop_entry(&entries[i]);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Read pending inotify events
+ */
+static void read_events(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t len = read(inotify_fd, buf, sizeof(buf));
+        if (len <= 0) {
+            if (len < 0 && errno != EAGAIN) perror("Figure cache inotify read");
+            return;
+        }
+
+        for (char* p = buf; p < buf + len; ) {
+            const struct inotify_event* ev = (const struct inotify_event*)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                drop_all();
+            } else if (ev->len > 0) {
+                handle_change(ev->wd, ev->name);
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+
+/**
+ * Read the figures of a portal's last session into the cache
+ */
+static void prewarm(const portal_t* portal) {
+    static portal_loadout_t session;
+    uint8_t data[SKYLANDER_DATA_SIZE];
+    int count = 0, warmed = 0;
+
+    if (portal_read_session(portal, &session) != 0) return;
+    for (uint16_t mask = session.mask; mask; mask &= mask - 1) {
+        // Misses read the file and put it; hits only refresh the entry
+        count++;
+        if (portal_read_skylander_file(portal, session.names[__builtin_ctz(mask)], data) == 0) {
+            warmed++;
+        }
+    }
+    if (count > 0) {
+        printf("Figure cache: warmed %d of %d figures from portal %d's last session\n",
+               warmed, count, portal->index);
+    }
+}
+
+/**
+ * Watcher thread: inotify events and pre-warm requests
+ */
+static void* watcher_thread(void* arg) {
+    (void)arg;
+    struct pollfd fds[2] = {
+        { .fd = inotify_fd, .events = POLLIN },
+        { .fd = wake_fd, .events = POLLIN },
+    };
+
+    metrics_register_thread("cache");
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("Figure cache poll");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            read_events();
+        }
+        if (fds[1].revents & POLLIN) {
+            uint64_t count;
+            if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                perror("Figure cache wakeup");
+            }
+        }
+
+        const portal_t* pending[MAX_PORTALS];
+        pthread_mutex_lock(&cache_lock);
+        int stop = !running;
+        memcpy(pending, prewarm_pending, sizeof(pending));
+        memset(prewarm_pending, 0, sizeof(prewarm_pending));
+        pthread_mutex_unlock(&cache_lock);
+        if (stop) break;
+
+        for (int i = 0; i < MAX_PORTALS; i++) {
+            if (pending[i]) prewarm(pending[i]);
+        }
+    }
+
+    metrics_unregister_thread();
+    return NULL;
+}
+
+/**
+ * Start the watcher thread, watching the shared library
+ */
+int figure_cache_init(void) {
+    if (initialized) return 0;
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        perror("Failed to create figure cache inotify");
+        return -1;
+    }
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        perror("Failed to create figure cache eventfd");
+        close(inotify_fd);
+        inotify_fd = -1;
+        return -1;
+    }
+
+    memset(entries, 0, sizeof(entries));
+    memset(prewarm_pending, 0, sizeof(prewarm_pending));
+    watch_count = 0;
+    running = 1;
+
+    if (pthread_create(&watcher_tid, NULL, watcher_thread, NULL) != 0) {
+        perror("Failed to create figure cache thread");
+        close(inotify_fd);
+        close(wake_fd);
+        inotify_fd = wake_fd = -1;
+        running = 0;
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    initialized = 1;
+    pthread_mutex_unlock(&cache_lock);
+
+    return figure_cache_watch(PORTAL_LIBRARY_DIR);
+}
+
+/**
+ * Watch another directory figures are loaded from
+ */
+int figure_cache_watch(const char* dir) {
+    if (!initialized || !dir) return -1;
+
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < watch_count; i++) {
+        if (strcmp(watches[i].dir, dir) == 0) {
+            pthread_mutex_unlock(&cache_lock);
+            return 0;
+        }
+    }
+    if (watch_count == CACHE_WATCHES) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+
+    int wd = inotify_add_watch(inotify_fd, dir, CACHE_EVENTS);
+    if (wd < 0) {
+        pthread_mutex_unlock(&cache_lock);
+        perror("Failed to watch figure directory");
+        fprintf(stderr, "Path: %s\n", dir);
+        return -1;
+    }
+    watches[watch_count].wd = wd;
+    snprintf(watches[watch_count].dir, sizeof(watches[watch_count].dir), "%s", dir);
+    watch_count++;
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+/**
+ * Stop the watcher thread and drop all entries
+ */
+void figure_cache_cleanup(void) {
+    if (!initialized) return;
+
+    pthread_mutex_lock(&cache_lock);
+    running = 0;
+    pthread_mutex_unlock(&cache_lock);
+
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        perror("Figure cache wakeup");
+    }
+    pthread_join(watcher_tid, NULL);
+
+    pthread_mutex_lock(&cache_lock);
+    initialized = 0;
+    pthread_mutex_unlock(&cache_lock);
+    drop_all();
+
+    close(inotify_fd);
+    close(wake_fd);
+    inotify_fd = wake_fd = -1;
+    watch_count = 0;
+}
+
+/**
+ * Copy a cached figure into data
+ */
+int figure_cache_get(const char* path, uint8_t* data) {
+    uint32_t hash = hash_path(path);
+
+    pthread_mutex_lock(&cache_lock);
+    if (!initialized) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    cache_entry_t* entry = find_entry(path, hash);
+    if (entry) {
+        memcpy(data, entry->data, SKYLANDER_DATA_SIZE);
+        entry->last_used = ++use_clock;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    metric_inc(entry ? &kaos_metrics.cache_hits : &kaos_metrics.cache_misses);
+    return entry ? 0 : -1;
+}
+
+/**
+ * Get a token to pass to figure_cache_put()
+ */
+uint64_t figure_cache_token(void) {
+    pthread_mutex_lock(&cache_lock);
+    uint64_t token = generation;
+    pthread_mutex_unlock(&cache_lock);
+    return token;
+}
+
+/**
+ * Store a figure after reading or writing it
+ */
+void figure_cache_put(const char* path, const uint8_t* data, const struct stat* st, uint64_t token) {
+    struct stat now;
+    if (!st) {
+        if (stat(path, &now) != 0) return;
+        st = &now;
+    }
+    uint32_t hash = hash_path(path);
+
+    pthread_mutex_lock(&cache_lock);
+    // A change seen since the token may be newer than data, unless the path
+    // still is the file data came from. Checked under the lock, so the event
+    // of any later change is handled after this put
+    bool current = token == generation;
+    if (!current && st != &now) {
+        struct stat again;
+        current = stat(path, &again) == 0 && again.st_ino == st->st_ino &&
+                  again.st_size == st->st_size &&
+                  again.st_mtim.tv_sec == st->st_mtim.tv_sec &&
+                  again.st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+    }
+    if (!initialized || !current || !is_watched(path)) {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+
+    cache_entry_t* entry = find_entry(path, hash);
+    if (!entry) {
+        // Take a free entry, else evict the least recently used
+        entry = &entries[0];
+        for (int i = 0; i < FIGURE_CACHE_ENTRIES; i++) {
+            if (!entries[i].used) {
+                entry = &entries[i];
+                break;
+            }
+            if (entries[i].last_used < entry->last_used) {
+                entry = &entries[i];
+            }
+        }
+        if (!entry->used) {
+            metric_gauge_add(&kaos_metrics.cache_entries, 1);
+        }
+        entry->used = true;
+        entry->hash = hash;
+        snprintf(entry->path, sizeof(entry->path), "%s", path);
+    }
+
+    memcpy(entry->data, data, SKYLANDER_DATA_SIZE);
+    entry->mtime = st->st_mtim;
+    entry->size = st->st_size;
+    entry->ino = st->st_ino;
+    entry->last_used = ++use_clock;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Load the figures of the portal's last session in the background
+ */
+void figure_cache_prewarm(const portal_t* portal) {
+    if (!portal || portal->index < 0 || portal->index >= MAX_PORTALS) return;
+
+    pthread_mutex_lock(&cache_lock);
+    if (!initialized) {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+    prewarm_pending[portal->index] = portal;
+    pthread_mutex_unlock(&cache_lock);
+
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("Figure cache wakeup");
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef FIGURE_CACHE_H
+#define FIGURE_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "portal.h"
+
+/**
+ * Figure Cache
+ * Size-bounded LRU of figure files keyed by path, so loads of recently
+ * used figures need no SD card access. A watcher thread keeps it coherent:
+ * inotify events on the library and portal data directories drop entries
+ * whose file changed, and saves put the written data back. The same thread
+ * pre-warms the cache with a portal's last session when a host enumerates it.
+ * Without figure_cache_init() every lookup misses and nothing is stored.
+ */
+
+#define FIGURE_CACHE_ENTRIES    32      // Figures kept in memory (1 KB each)
+
+// Function Prototypes
+
+/**
+ * Start the watcher thread, watching the shared library
+ * Returns 0 on success, -1 on error
+ */
+int figure_cache_init(void);
+
+/**
+ * Watch another directory figures are loaded from (a portal's data directory)
+ * Returns 0 on success, -1 on error
+ */
+int figure_cache_watch(const char* dir);
+
+/**
+ * Stop the watcher thread and drop all entries
+ */
+void figure_cache_cleanup(void);
+
+/**
+ * Copy a cached figure (SKYLANDER_DATA_SIZE bytes) into data
+ * Returns 0 on a hit, -1 on a miss
+ */
+int figure_cache_get(const char* path, uint8_t* data);
+
+/**
+ * Get a token to pass to figure_cache_put(), taken before reading the file
+ * A put is discarded if the directory changed since its token was taken
+ */
+uint64_t figure_cache_token(void);
+
+/**
+ * Store a figure after reading or writing it
+ * st is the metadata of the file data was read from or written to (fstat of
+ * its descriptor; NULL = stat path now). With st, a put whose token is stale
+ * is still taken if the path is unchanged since
+ */
+void figure_cache_put(const char* path, const uint8_t* data, const struct stat* st, uint64_t token);
+
+/**
+ * Load the figures of the portal's last session into the cache in the background
+ */
+void figure_cache_prewarm(const portal_t* portal);
+
+#endif // FIGURE_CACHE_H
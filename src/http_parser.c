@@ -0,0 +1,373 @@
+#include "http_parser.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HTTP_PARSER_SSE2 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HTTP_PARSER_NEON 1
+#endif
+
+// RFC 7230 token characters (method, header names)
+static const uint8_t tchar[256] = {
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1,
+    ['*'] = 1, ['+'] = 1, ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1,
+    ['`'] = 1, ['|'] = 1, ['~'] = 1,
+    ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1,
+    ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+    ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1,
+    ['G'] = 1, ['H'] = 1, ['I'] = 1, ['J'] = 1, ['K'] = 1, ['L'] = 1,
+    ['M'] = 1, ['N'] = 1, ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1,
+    ['S'] = 1, ['T'] = 1, ['U'] = 1, ['V'] = 1, ['W'] = 1, ['X'] = 1,
+    ['Y'] = 1, ['Z'] = 1,
+    ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1,
+    ['g'] = 1, ['h'] = 1, ['i'] = 1, ['j'] = 1, ['k'] = 1, ['l'] = 1,
+    ['m'] = 1, ['n'] = 1, ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1,
+    ['s'] = 1, ['t'] = 1, ['u'] = 1, ['v'] = 1, ['w'] = 1, ['x'] = 1,
+    ['y'] = 1, ['z'] = 1,
+};
+
+/**
+ * Find the end of a token (request method or target)
+ * Returns pointer to the first byte <= 0x20 or 0x7F, or end
+ */
+static const char* find_token_end(const char* p, const char* end) {
+#if defined(HTTP_PARSER_SSE2)
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(v, space), v);
+        int mask = _mm_movemask_epi8(_mm_or_si128(ctl, _mm_cmpeq_epi8(v, del)));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#elif defined(HTTP_PARSER_NEON)
+    const uint8x16_t space = vdupq_n_u8(0x20);
+    const uint8x16_t del = vdupq_n_u8(0x7F);
+    while (end - p >= 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)p);
+        uint8x16_t m = vorrq_u8(vcleq_u8(v, space), vceqq_u8(v, del));
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+        if (mask) return p + (__builtin_ctzll(mask) >> 2);
+        p += 16;
+    }
+#endif
+    for (; p < end; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c <= 0x20 || c == 0x7F) break;
+    }
+    return p;
+}
+
+/**
+ * Find the end of a header value
+ * Returns pointer to the first control byte other than HT, or end
+ */
+static const char* find_value_end(const char* p, const char* end) {
+#if defined(HTTP_PARSER_SSE2)
+    const __m128i us = _mm_set1_epi8(0x1F);
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i del = _mm_set1_epi8(0x7F);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i ctl = _mm_andnot_si128(_mm_cmpeq_epi8(v, tab),
+                                       _mm_cmpeq_epi8(_mm_min_epu8(v, us), v));
+        int mask = _mm_movemask_epi8(_mm_or_si128(ctl, _mm_cmpeq_epi8(v, del)));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#elif defined(HTTP_PARSER_NEON)
+    const uint8x16_t us = vdupq_n_u8(0x1F);
+    const uint8x16_t tab = vdupq_n_u8('\t');
+    const uint8x16_t del = vdupq_n_u8(0x7F);
+    while (end - p >= 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)p);
+        uint8x16_t ctl = vbicq_u8(vcleq_u8(v, us), vceqq_u8(v, tab));
+        uint8x16_t m = vorrq_u8(ctl, vceqq_u8(v, del));
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+        if (mask) return p + (__builtin_ctzll(mask) >> 2);
+        p += 16;
+    }
+#endif
+    for (; p < end; p++) {
+        unsigned char c = (unsigned char)*p;
+        if ((c < 0x20 && c != '\t') || c == 0x7F) break;
+    }
+    return p;
+}
+
+/**
+ * Check whether the blank line ending the headers has arrived
+ * Only the bytes added since last_len (plus overlap) are scanned.
+ */
+static bool has_header_end(const char* buf, size_t len, size_t last_len) {
+    size_t start = last_len > 3 ? last_len - 3 : 0;
+    const char* p = buf + start;
+    const char* end = buf + len;
+
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        p++;
+        if (p < end && *p == '\n') return true;
+        if (p + 1 < end && p[0] == '\r' && p[1] == '\n') return true;
+    }
+    return false;
+}
+
+/**
+ * Consume a line ending (CRLF or bare LF)
+ * Returns 0 on success, or a parse result
+ */
+static int parse_eol(const char** pp, const char* end) {
+    const char* p = *pp;
+
+    if (p == end) return HTTP_PARSE_INCOMPLETE;
+    if (*p == '\r') {
+        if (++p == end) return HTTP_PARSE_INCOMPLETE;
+        if (*p != '\n') return HTTP_PARSE_ERROR;
+    } else if (*p != '\n') {
+        return HTTP_PARSE_ERROR;
+    }
+
+    *pp = p + 1;
+    return 0;
+}
+
+/**
+ * Parse a Content-Length value
+ * Returns value, or -1 if invalid
+ */
+static long parse_content_length(http_slice_t value) {
+    if (value.len == 0 || value.len > 18) return -1;
+
+    long n = 0;
+    for (size_t i = 0; i < value.len; i++) {
+        char c = value.ptr[i];
+        if (c < '0' || c > '9') return -1;
+        n = n * 10 + (c - '0');
+    }
+    return n;
+}
+
+/**
+ * Parse request line and headers
+ */
+int http_parse_request(const char* buf, size_t len, size_t last_len, http_request_t* req) {
+    const char* p = buf;
+    const char* end = buf + len;
+    const char* tok;
+    int rc;
+
+    if (len > HTTP_MAX_HEADER_SIZE) {
+        end = buf + HTTP_MAX_HEADER_SIZE;
+    }
+
+    // Partial read: nothing new to parse until the blank line arrives
+    if (last_len > 0 && !has_header_end(buf, end - buf, last_len)) {
+        return len >= HTTP_MAX_HEADER_SIZE ? HTTP_PARSE_ERROR : HTTP_PARSE_INCOMPLETE;
+    }
+
+    memset(req, 0, sizeof(http_request_t));
+    req->content_length = -1;
+
+    // Tolerate empty lines before the request line (RFC 7230 3.5)
+    while (p < end && (*p == '\r' || *p == '\n')) p++;
+
+    // Method
+    tok = find_token_end(p, end);
+    if (tok == end) goto incomplete;
+    if (tok == p || *tok != ' ') return HTTP_PARSE_ERROR;
+    for (const char* c = p; c < tok; c++) {
+        if (!tchar[(unsigned char)*c]) return HTTP_PARSE_ERROR;
+    }
+    req->method.ptr = p;
+    req->method.len = tok - p;
+    p = tok + 1;
+
+    // Request target
+    tok = find_token_end(p, end);
+    if (tok == end) goto incomplete;
+    if (tok == p || *tok != ' ') return HTTP_PARSE_ERROR;
+    req->path.ptr = p;
+    req->path.len = tok - p;
+    const char* q = memchr(p, '?', tok - p);
+    if (q) {
+        req->path.len = q - p;
+        req->query.ptr = q + 1;
+        req->query.len = tok - (q + 1);
+    } else {
+        req->query.ptr = tok;
+    }
+    p = tok + 1;
+
+    // Version
+    static const char prefix[] = "HTTP/1.";
+    size_t avail = end - p;
+    if (avail < 8) {
+        if (memcmp(p, prefix, avail < 7 ? avail : 7) != 0) return HTTP_PARSE_ERROR;
+        goto incomplete;
+    }
+    if (memcmp(p, prefix, 7) != 0 || p[7] < '0' || p[7] > '9') return HTTP_PARSE_ERROR;
+    req->minor_version = p[7] - '0';
+    p += 8;
+    if ((rc = parse_eol(&p, end)) != 0) {
+        if (rc == HTTP_PARSE_INCOMPLETE) goto incomplete;
+        return rc;
+    }
+
+    // Headers
+    for (;;) {
+        if (p == end) goto incomplete;
+        if (*p == '\r' || *p == '\n') {
+            if ((rc = parse_eol(&p, end)) != 0) {
+                if (rc == HTTP_PARSE_INCOMPLETE) goto incomplete;
+                return rc;
+            }
+            break;
+        }
+
+        if (req->num_headers == HTTP_MAX_HEADERS) return HTTP_PARSE_ERROR;
+
+        // Name (obsolete line folding is rejected here too)
+        const char* name = p;
+        while (p < end && tchar[(unsigned char)*p]) p++;
+        if (p == end) goto incomplete;
+        if (p == name || *p != ':') return HTTP_PARSE_ERROR;
+
+        http_header_t* header = &req->headers[req->num_headers];
+        header->name.ptr = name;
+        header->name.len = p - name;
+        p++;
+
+        // Value
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        tok = find_value_end(p, end);
+        if (tok == end) goto incomplete;
+        if (*tok != '\r' && *tok != '\n') return HTTP_PARSE_ERROR;
+
+        const char* value_end = tok;
+        while (value_end > p && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+        header->value.ptr = p;
+        header->value.len = value_end - p;
+
+        p = tok;
+        if ((rc = parse_eol(&p, end)) != 0) {
+            if (rc == HTTP_PARSE_INCOMPLETE) goto incomplete;
+            return rc;
+        }
+
+        // Headers the server acts on
+        if (http_slice_case_eq(header->name, "Content-Length")) {
+            long length = parse_content_length(header->value);
+            if (length < 0) return HTTP_PARSE_ERROR;
+            if (req->content_length >= 0 && req->content_length != length) return HTTP_PARSE_ERROR;
+            req->content_length = length;
+        } else if (http_slice_case_eq(header->name, "Content-Type")) {
+            req->content_type = header->value;
+        }
+
+        req->num_headers++;
+    }
+
+    return (int)(p - buf);
+
+incomplete:
+    // Headers larger than the limit will never complete
+    return len >= HTTP_MAX_HEADER_SIZE ? HTTP_PARSE_ERROR : HTTP_PARSE_INCOMPLETE;
+}
+
+/**
+ * Find a header by name
+ */
+const http_header_t* http_find_header(const http_request_t* req, const char* name) {
+    for (int i = 0; i < req->num_headers; i++) {
+        if (http_slice_case_eq(req->headers[i].name, name)) {
+            return &req->headers[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Compare a slice with a string
+ */
+bool http_slice_eq(http_slice_t slice, const char* str) {
+    size_t len = strlen(str);
+    return slice.len == len && memcmp(slice.ptr, str, len) == 0;
+}
+
+/**
+ * Compare a slice with a string, ignoring ASCII case
+ */
+bool http_slice_case_eq(http_slice_t slice, const char* str) {
+    size_t len = strlen(str);
+    return slice.len == len && strncasecmp(slice.ptr, str, len) == 0;
+}
+
+/**
+ * URL decode helper
+ */
+size_t http_url_decode(char* dst, const char* src, size_t len) {
+    const char* end = src + len;
+    char* out = dst;
+
+    while (src < end) {
+        if (*src == '%' && end - src >= 3 && isxdigit((unsigned char)src[1]) &&
+            isxdigit((unsigned char)src[2])) {
+            char a = src[1], b = src[2];
+            if (a >= 'a') a -= 'a' - 'A';
+            if (a >= 'A') a -= ('A' - 10);
+            else a -= '0';
+            if (b >= 'a') b -= 'a' - 'A';
+            if (b >= 'A') b -= ('A' - 10);
+            else b -= '0';
+            *out++ = 16 * a + b;
+            src += 3;
+        } else if (*src == '+') {
+            *out++ = ' ';
+            src++;
+        } else {
+            *out++ = *src++;
+        }
+    }
+
+    *out = '\0';
+    return out - dst;
+}
+
+/**
+ * Get query parameter value
+ */
+char* http_query_param(http_slice_t query, const char* param) {
+    if (!query.ptr || !param) return NULL;
+
+    size_t param_len = strlen(param);
+    const char* p = query.ptr;
+    const char* end = query.ptr + query.len;
+
+    while (p < end) {
+        const char* pair_end = memchr(p, '&', end - p);
+        if (!pair_end) pair_end = end;
+
+        const char* eq = memchr(p, '=', pair_end - p);
+        const char* key_end = eq ? eq : pair_end;
+
+        if ((size_t)(key_end - p) == param_len && memcmp(p, param, param_len) == 0) {
+            const char* value = eq ? eq + 1 : pair_end;
+            size_t value_len = pair_end - value;
+
+            char* decoded = malloc(value_len + 1);
+            if (!decoded) return NULL;
+            http_url_decode(decoded, value, value_len);
+            return decoded;
+        }
+
+        p = pair_end + 1;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,87 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Zero-copy HTTP/1.x Request Parser
+ * Single pass over the receive buffer; all results are slices pointing
+ * into that buffer. Delimiter scanning uses SSE2 or NEON when available.
+ */
+
+// Parser limits
+#define HTTP_MAX_HEADERS        32
+#define HTTP_MAX_HEADER_SIZE    8192    // Request line + headers
+
+// Parse results (non-negative results are the header length)
+#define HTTP_PARSE_ERROR        -1      // Malformed request
+#define HTTP_PARSE_INCOMPLETE   -2      // Need more data
+
+// Slice of the receive buffer (not NUL terminated)
+typedef struct {
+    const char* ptr;
+    size_t len;
+} http_slice_t;
+
+// Header
+typedef struct {
+    http_slice_t name;
+    http_slice_t value;                             // Leading/trailing whitespace trimmed
+} http_header_t;
+
+// Parsed Request
+typedef struct {
+    http_slice_t method;
+    http_slice_t path;                              // Request target without query
+    http_slice_t query;                             // After '?', empty if none
+    int minor_version;                              // HTTP/1.x
+    http_header_t headers[HTTP_MAX_HEADERS];
+    int num_headers;
+    long content_length;                            // -1 if absent
+    http_slice_t content_type;                      // Empty if absent
+} http_request_t;
+
+// Function Prototypes
+
+/**
+ * Parse request line and headers
+ * last_len is the buffer length at the previous (incomplete) call for the
+ * same request, or 0. It lets partial reads be rejected cheaply without
+ * re-parsing until the end of the headers has arrived.
+ * Returns header length (bytes up to and including the blank line),
+ * HTTP_PARSE_INCOMPLETE or HTTP_PARSE_ERROR
+ */
+int http_parse_request(const char* buf, size_t len, size_t last_len, http_request_t* req);
+
+/**
+ * Find a header by name (case insensitive)
+ * Returns NULL if not present
+ */
+const http_header_t* http_find_header(const http_request_t* req, const char* name);
+
+/**
+ * Compare a slice with a string
+ */
+bool http_slice_eq(http_slice_t slice, const char* str);
+
+/**
+ * Compare a slice with a string, ignoring ASCII case
+ */
+bool http_slice_case_eq(http_slice_t slice, const char* str);
+
+/**
+ * URL decode len bytes of src into dst (which must hold len + 1 bytes)
+ * Returns decoded length
+ */
+size_t http_url_decode(char* dst, const char* src, size_t len);
+
+/**
+ * Get a decoded query parameter value
+ * Keys must match exactly ("file" does not match "profile=").
+ * Returns malloc'd value (caller frees) or NULL if not present
+ */
+char* http_query_param(http_slice_t query, const char* param);
+
+#endif // HTTP_PARSER_H
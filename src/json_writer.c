@@ -0,0 +1,262 @@
+#include "json_writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/socket.h>
+
+/**
+ * Send a whole buffer to the socket
+ */
+static int send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * Send buffered output as one HTTP chunk
+ */
+static void flush_chunk(json_writer_t* w) {
+    if (w->fd < 0 || w->len == 0 || w->error) return;
+
+    char size_line[32];
+    int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", w->len);
+
+    if (send_all(w->fd, size_line, n) < 0 ||
+        send_all(w->fd, w->buf, w->len) < 0 ||
+        send_all(w->fd, "\r\n", 2) < 0) {
+        w->error = true;
+    }
+
+    w->len = 0;
+}
+
+/**
+ * Make room for len more bytes (plus NUL terminator)
+ */
+static bool reserve(json_writer_t* w, size_t len) {
+    if (w->error) return false;
+
+    if (w->fd >= 0 && w->len + len >= JSON_WRITER_CHUNK_SIZE) {
+        flush_chunk(w);
+        if (w->error) return false;
+    }
+
+    if (w->len + len + 1 <= w->cap) return true;
+
+    size_t cap = w->cap ? w->cap : 256;
+    while (cap < w->len + len + 1) cap *= 2;
+
+    char* buf = realloc(w->buf, cap);
+    if (!buf) {
+        w->error = true;
+        return false;
+    }
+
+    w->buf = buf;
+    w->cap = cap;
+    return true;
+}
+
+/**
+ * Append raw bytes
+ */
+static void append(json_writer_t* w, const char* data, size_t len) {
+    if (!reserve(w, len)) return;
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+    w->buf[w->len] = '\0';
+}
+
+/**
+ * Emit a separating comma if this is not the first item at this level
+ */
+static void begin_value(json_writer_t* w) {
+    if (w->after_key) {
+        w->after_key = false;
+        return;
+    }
+
+    uint32_t bit = 1u << w->depth;
+    if (w->has_items & bit) {
+        append(w, ",", 1);
+    }
+    w->has_items |= bit;
+}
+
+static void open_scope(json_writer_t* w, char c) {
+    begin_value(w);
+    append(w, &c, 1);
+    if (w->depth + 1 >= JSON_WRITER_MAX_DEPTH) {
+        w->error = true;
+        return;
+    }
+    w->depth++;
+    w->has_items &= ~(1u << w->depth);
+}
+
+static void close_scope(json_writer_t* w, char c) {
+    if (w->depth > 0) w->depth--;
+    append(w, &c, 1);
+}
+
+/**
+ * Append a quoted, escaped string
+ */
+static void append_string(json_writer_t* w, const char* s) {
+    static const char hex[] = "0123456789abcdef";
+
+    append(w, "\"", 1);
+
+    const char* run = s;
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+        append(w, run, s - run);
+        switch (c) {
+            case '"':  append(w, "\\\"", 2); break;
+            case '\\': append(w, "\\\\", 2); break;
+            case '\n': append(w, "\\n", 2); break;
+            case '\r': append(w, "\\r", 2); break;
+            case '\t': append(w, "\\t", 2); break;
+            default: {
+                char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+                append(w, esc, 6);
+            }
+        }
+        run = s + 1;
+    }
+    append(w, run, s - run);
+
+    append(w, "\"", 1);
+}
+
+/**
+ * Initialize a writer
+ */
+void json_writer_init(json_writer_t* w, int fd) {
+    memset(w, 0, sizeof(json_writer_t));
+    w->fd = fd;
+}
+
+/**
+ * Release writer memory
+ */
+void json_writer_free(json_writer_t* w) {
+    if (!w) return;
+    free(w->buf);
+    w->buf = NULL;
+    w->len = w->cap = 0;
+}
+
+/**
+ * Finish the document
+ */
+int json_writer_finish(json_writer_t* w) {
+    if (w->fd >= 0) {
+        flush_chunk(w);
+        if (!w->error && send_all(w->fd, "0\r\n\r\n", 5) < 0) {
+            w->error = true;
+        }
+    }
+    return w->error ? -1 : 0;
+}
+
+/**
+ * Get the in-memory document
+ */
+const char* json_writer_data(json_writer_t* w) {
+    return w->buf ? w->buf : "";
+}
+
+void json_begin_object(json_writer_t* w) { open_scope(w, '{'); }
+void json_end_object(json_writer_t* w)   { close_scope(w, '}'); }
+void json_begin_array(json_writer_t* w)  { open_scope(w, '['); }
+void json_end_array(json_writer_t* w)    { close_scope(w, ']'); }
+
+void json_key(json_writer_t* w, const char* key) {
+    begin_value(w);
+    append_string(w, key);
+    append(w, ":", 1);
+    w->after_key = true;
+}
+
+void json_string(json_writer_t* w, const char* value) {
+    if (!value) {
+        json_null(w);
+        return;
+    }
+    begin_value(w);
+    append_string(w, value);
+}
+
+void json_int(json_writer_t* w, long long value) {
+    char num[24];
+    int n = snprintf(num, sizeof(num), "%lld", value);
+    begin_value(w);
+    append(w, num, n);
+}
+
+void json_double(json_writer_t* w, double value) {
+    if (!isfinite(value)) {
+        json_null(w);
+        return;
+    }
+    char num[32];
+    int n = snprintf(num, sizeof(num), "%.6g", value);
+    begin_value(w);
+    append(w, num, n);
+}
+
+void json_bool(json_writer_t* w, bool value) {
+    begin_value(w);
+    if (value) append(w, "true", 4);
+    else append(w, "false", 5);
+}
+
+void json_null(json_writer_t* w) {
+    begin_value(w);
+    append(w, "null", 4);
+}
+
+/**
+ * Escape a string for use inside JSON quotes
+ */
+size_t json_escape(char* dst, size_t dst_size, const char* src) {
+    size_t j = 0;
+    if (dst_size == 0) return 0;
+
+    for (size_t i = 0; src[i]; i++) {
+        unsigned char c = (unsigned char)src[i];
+        char esc[8];
+        int n;
+
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = c;
+            n = 2;
+        } else if (c < 0x20) {
+            n = snprintf(esc, sizeof(esc), "\\u%04x", c);
+        } else {
+            esc[0] = c;
+            n = 1;
+        }
+
+        if (j + n >= dst_size) break;
+        memcpy(dst + j, esc, n);
+        j += n;
+    }
+
+    dst[j] = '\0';
+    return j;
+}
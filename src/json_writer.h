@@ -0,0 +1,78 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Streaming JSON Writer
+ * Builds JSON into a growable buffer, or streams it to a socket using
+ * HTTP chunked transfer encoding so large documents never need to be
+ * held in memory at once
+ */
+
+#define JSON_WRITER_CHUNK_SIZE  4096    // Flush threshold when streaming
+#define JSON_WRITER_MAX_DEPTH   32      // Maximum object/array nesting
+
+// Writer State
+typedef struct {
+    char* buf;                                      // Output buffer
+    size_t len;                                     // Bytes used
+    size_t cap;                                     // Bytes allocated
+    int fd;                                         // Chunked output socket (-1 = memory only)
+    int depth;                                      // Current nesting level
+    uint32_t has_items;                             // Per-level "needs comma" bits
+    bool after_key;                                 // Value follows a key
+    bool error;                                     // Allocation or socket error
+} json_writer_t;
+
+// Function Prototypes
+
+/**
+ * Initialize a writer
+ * With fd >= 0 output is sent as HTTP chunks once the buffer fills;
+ * the caller must already have sent headers with
+ * "Transfer-Encoding: chunked". With fd < 0 the document is kept in memory.
+ */
+void json_writer_init(json_writer_t* w, int fd);
+
+/**
+ * Release writer memory
+ */
+void json_writer_free(json_writer_t* w);
+
+/**
+ * Finish the document
+ * When streaming, flushes remaining output and sends the final chunk.
+ * Returns 0 on success, -1 if any write failed
+ */
+int json_writer_finish(json_writer_t* w);
+
+/**
+ * Get the in-memory document (NUL terminated, memory-only writers)
+ */
+const char* json_writer_data(json_writer_t* w);
+
+// Structure
+void json_begin_object(json_writer_t* w);
+void json_end_object(json_writer_t* w);
+void json_begin_array(json_writer_t* w);
+void json_end_array(json_writer_t* w);
+void json_key(json_writer_t* w, const char* key);
+
+// Values
+void json_string(json_writer_t* w, const char* value);
+void json_int(json_writer_t* w, long long value);
+void json_double(json_writer_t* w, double value);      // null if not finite
+void json_bool(json_writer_t* w, bool value);
+void json_null(json_writer_t* w);
+
+/**
+ * Escape a string for use inside JSON quotes
+ * Output is truncated (never mid-escape) to fit dst_size.
+ * Returns the escaped length
+ */
+size_t json_escape(char* dst, size_t dst_size, const char* src);
+
+#endif // JSON_WRITER_H
@@ -0,0 +1,145 @@
+#include "latency.h"
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+// Histogram
+typedef struct {
+    _Atomic uint64_t buckets[LATENCY_BUCKETS];
+    _Atomic uint64_t sum;
+    _Atomic uint64_t min;
+    _Atomic uint64_t max;
+} latency_histogram_t;
+
+static latency_histogram_t histograms[LATENCY_OPCODE_COUNT] = {
+    [0 ... LATENCY_OPCODE_COUNT - 1] = { .min = UINT64_MAX }
+};
+
+/**
+ * Map an opcode to its histogram
+ */
+static latency_histogram_t* histogram_for(uint8_t command) {
+    const char* p = command ? memchr(LATENCY_OPCODES, command, LATENCY_OPCODE_COUNT) : NULL;
+    return p ? &histograms[p - LATENCY_OPCODES] : NULL;
+}
+
+/**
+ * Map a value to its bucket
+ * Values below LATENCY_SUB_BUCKETS get a bucket each; above that the
+ * exponent picks the group and the next LATENCY_SUB_BITS bits the bucket.
+ */
+static int bucket_index(uint64_t value) {
+    if (value < LATENCY_SUB_BUCKETS) return (int)value;
+
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > LATENCY_MAX_EXPONENT) return LATENCY_BUCKETS - 1;
+
+    int sub = (value >> (exponent - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1);
+    return (exponent - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS + sub;
+}
+
+/**
+ * Highest value that maps to a bucket
+ */
+static uint64_t bucket_upper(int index) {
+    if (index < LATENCY_SUB_BUCKETS) return index;
+
+    int shift = index / LATENCY_SUB_BUCKETS - 1;
+    uint64_t lower = (uint64_t)(LATENCY_SUB_BUCKETS + index % LATENCY_SUB_BUCKETS) << shift;
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+/**
+ * Get CLOCK_MONOTONIC time in nanoseconds
+ */
+uint64_t latency_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Record the latency of a command
+ */
+void latency_record(uint8_t command, uint64_t ns) {
+    latency_histogram_t* h = histogram_for(command);
+    if (!h) return;
+
+    atomic_fetch_add_explicit(&h->buckets[bucket_index(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, ns, memory_order_relaxed);
+
+    uint64_t cur = atomic_load_explicit(&h->min, memory_order_relaxed);
+    while (ns < cur && !atomic_compare_exchange_weak_explicit(&h->min, &cur, ns,
+                                                              memory_order_relaxed,
+                                                              memory_order_relaxed));
+
+    cur = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (ns > cur && !atomic_compare_exchange_weak_explicit(&h->max, &cur, ns,
+                                                              memory_order_relaxed,
+                                                              memory_order_relaxed));
+}
+
+/**
+ * Value at quantile q of a bucket snapshot
+ */
+static uint64_t quantile(const uint64_t* counts, uint64_t total, double q) {
+    uint64_t target = (uint64_t)(total * q + 0.999999);
+    if (target == 0) target = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= target) return bucket_upper(i);
+    }
+    return bucket_upper(LATENCY_BUCKETS - 1);
+}
+
+/**
+ * Summarize the histogram for a command
+ */
+int latency_summarize(uint8_t command, latency_summary_t* summary) {
+    latency_histogram_t* h = histogram_for(command);
+    if (!h || !summary) return -1;
+
+    // Snapshot the buckets so the percentiles agree with each other
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        total += counts[i];
+    }
+
+    memset(summary, 0, sizeof(*summary));
+    summary->count = total;
+    if (total == 0) return 0;
+
+    summary->min = atomic_load_explicit(&h->min, memory_order_relaxed);
+    summary->max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    summary->mean = atomic_load_explicit(&h->sum, memory_order_relaxed) / total;
+    summary->p50 = quantile(counts, total, 0.50);
+    summary->p99 = quantile(counts, total, 0.99);
+    summary->p999 = quantile(counts, total, 0.999);
+
+    // Bucket upper bounds can overshoot the largest sample
+    if (summary->p50 > summary->max) summary->p50 = summary->max;
+    if (summary->p99 > summary->max) summary->p99 = summary->max;
+    if (summary->p999 > summary->max) summary->p999 = summary->max;
+
+    return 0;
+}
+
+/**
+ * Clear all histograms
+ * Samples recorded concurrently with a reset may survive it.
+ */
+void latency_reset(void) {
+    for (int op = 0; op < LATENCY_OPCODE_COUNT; op++) {
+        latency_histogram_t* h = &histograms[op];
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            atomic_store_explicit(&h->buckets[i], 0, memory_order_relaxed);
+        }
+        atomic_store_explicit(&h->sum, 0, memory_order_relaxed);
+        atomic_store_explicit(&h->min, UINT64_MAX, memory_order_relaxed);
+        atomic_store_explicit(&h->max, 0, memory_order_relaxed);
+    }
+}
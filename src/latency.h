@@ -0,0 +1,59 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Portal Command Latency
+ * Time from an OUT report arriving to its IN report being written, kept
+ * per opcode in lock-free log-linear (HDR style) histograms. Each power of
+ * two is split into LATENCY_SUB_BUCKETS linear buckets, so percentiles are
+ * accurate to about 1/LATENCY_SUB_BUCKETS of the value at any scale.
+ */
+
+#define LATENCY_SUB_BITS        4
+#define LATENCY_SUB_BUCKETS     (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_EXPONENT    35      // Values up to 2^36 ns (~68 s)
+#define LATENCY_BUCKETS         ((LATENCY_MAX_EXPONENT - LATENCY_SUB_BITS + 2) * LATENCY_SUB_BUCKETS)
+
+// Opcodes with a histogram, in reporting order
+#define LATENCY_OPCODES         "ASQWCR"
+#define LATENCY_OPCODE_COUNT    6
+
+// Summary of one histogram (nanoseconds)
+typedef struct {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+} latency_summary_t;
+
+// Function Prototypes
+
+/**
+ * Get CLOCK_MONOTONIC time in nanoseconds
+ */
+uint64_t latency_now_ns(void);
+
+/**
+ * Record the latency of a command
+ * Ignored for opcodes without a histogram
+ */
+void latency_record(uint8_t command, uint64_t ns);
+
+/**
+ * Summarize the histogram for a command
+ * Returns -1 if the opcode has no histogram
+ */
+int latency_summarize(uint8_t command, latency_summary_t* summary);
+
+/**
+ * Clear all histograms
+ */
+void latency_reset(void);
+
+#endif // LATENCY_H
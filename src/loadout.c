@@ -0,0 +1,203 @@
+#include "loadout.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <unistd.h>
+
+/**
+ * Check a loadout name
+ */
+bool loadout_valid_name(const char* name) {
+    size_t len = name ? strlen(name) : 0;
+    if (len == 0 || len > 64) return false;
+
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '-' && name[i] != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Parse a slot: number or p1, p2, trap
+ * Returns the slot or -1
+ */
+static int parse_slot(const char* word) {
+    if (strcasecmp(word, "p1") == 0) return SLOT_PLAYER_1;
+    if (strcasecmp(word, "p2") == 0) return SLOT_PLAYER_2;
+    if (strcasecmp(word, "trap") == 0) return LOADOUT_TRAP_SLOT;
+
+    char* end;
+    long slot = strtol(word, &end, 10);
+    if (end == word || *end != '\0' || slot < 0 || slot >= MAX_SKYLANDERS) {
+        return -1;
+    }
+    return (int)slot;
+}
+
+/**
+ * Parse loadout text
+ */
+int loadout_parse(const char* text, size_t len, portal_loadout_t* loadout) {
+    loadout->mask = 0;
+    loadout->dirty = 0;
+
+    const char* end = text + len;
+    for (const char* line = text; line < end; ) {
+        const char* eol = memchr(line, '\n', end - line);
+        if (!eol) eol = end;
+
+        char buf[300];
+        size_t line_len = eol - line;
+        if (line_len >= sizeof(buf)) return -1;
+        memcpy(buf, line, line_len);
+        buf[line_len] = '\0';
+        line = eol + 1;
+
+        // Trim, skip blanks and comments
+        while (line_len > 0 && isspace((unsigned char)buf[line_len - 1])) {
+            buf[--line_len] = '\0';
+        }
+        char* word = buf;
+        while (isspace((unsigned char)*word)) word++;
+        if (*word == '\0' || *word == '#') continue;
+
+        char* name = word;
+        while (*name && !isspace((unsigned char)*name)) name++;
+        if (*name == '\0') return -1;
+        *name++ = '\0';
+        while (isspace((unsigned char)*name)) name++;
+
+        // Session files mark slots with unsaved writes as "<slot>*"
+        bool dirty = false;
+        size_t word_len = strlen(word);
+        if (word_len > 1 && word[word_len - 1] == '*') {
+            word[word_len - 1] = '\0';
+            dirty = true;
+        }
+
+        int slot = parse_slot(word);
+        if (slot < 0 || strlen(name) >= sizeof(loadout->names[0]) ||
+            strstr(name, "..") || !portal_is_valid_extension(name)) {
+            return -1;
+        }
+        strcpy(loadout->names[slot], name);
+        loadout->mask |= 1u << slot;
+        if (dirty) loadout->dirty |= 1u << slot;
+    }
+    return 0;
+}
+
+/**
+ * Read a loadout file
+ */
+int loadout_read_file(const char* path, portal_loadout_t* loadout) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) return -1;
+
+    // One line per slot at most, plus comments
+    char text[8192];
+    size_t len = fread(text, 1, sizeof(text), fp);
+    int truncated = !feof(fp);
+    fclose(fp);
+    if (truncated) return -1;
+
+    return loadout_parse(text, len, loadout);
+}
+
+/**
+ * Write a loadout file via a temporary name
+ */
+int loadout_write_file(const char* path, const portal_loadout_t* loadout) {
+    char tmp_path[520];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE* fp = fopen(tmp_path, "w");
+    if (!fp) {
+        perror("Failed to write loadout");
+        return -1;
+    }
+    for (int i = 0; i < MAX_SKYLANDERS; i++) {
+        if (loadout->mask & (1u << i)) {
+            const char* dirty = (loadout->dirty & (1u << i)) ? "*" : "";
+            fprintf(fp, "%d%s %s\n", i, dirty, loadout->names[i]);
+        }
+    }
+    int synced = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0 || !synced || rename(tmp_path, path) != 0) {
+        perror("Failed to write loadout");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Path of a named loadout
+ */
+void loadout_path(const char* name, char* path, size_t size) {
+    snprintf(path, size, "%s/%s%s", LOADOUT_DIR, name, LOADOUT_EXT);
+}
+
+/**
+ * Read every figure of a loadout
+ */
+int loadout_read_figures(const portal_t* portal, portal_loadout_t* loadout, int* failed_slot) {
+    for (uint16_t mask = loadout->mask; mask; mask &= mask - 1) {
+        int i = __builtin_ctz(mask);
+        if (portal_read_skylander_file(portal, loadout->names[i], loadout->data[i]) != 0) {
+            if (failed_slot) *failed_slot = i;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Compare names for qsort
+ */
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * List stored loadout names
+ */
+char** loadout_list(int* count) {
+    if (!count) return NULL;
+    *count = 0;
+
+    DIR* dir = opendir(LOADOUT_DIR);
+    if (!dir) return NULL;
+
+    char** names = NULL;
+    int capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        size_t ext_len = strlen(LOADOUT_EXT);
+        if (entry->d_type != DT_REG || len <= ext_len ||
+            strcmp(entry->d_name + len - ext_len, LOADOUT_EXT) != 0) {
+            continue;
+        }
+
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            char** grown = realloc(names, sizeof(char*) * capacity);
+            if (!grown) break;
+            names = grown;
+        }
+        names[*count] = strndup(entry->d_name, len - ext_len);
+        if (names[*count]) (*count)++;
+    }
+    closedir(dir);
+
+    if (*count > 1) {
+        qsort(names, *count, sizeof(char*), compare_names);
+    }
+    return names;
+}
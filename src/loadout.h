@@ -0,0 +1,65 @@
+#ifndef LOADOUT_H
+#define LOADOUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "portal.h"
+
+/**
+ * Named Loadouts
+ * Sets of figures for a whole portal, stored as text files with one
+ * "<slot> <file>" line per figure. The slot is a number or p1, p2 or trap;
+ * blank lines and lines starting with '#' are ignored. Applying a loadout
+ * reads every figure first, then publishes them in one portal transition
+ * (portal_apply_loadout()). The portal session file uses the same format,
+ * with "<slot>*" marking figures that had unsaved writes.
+ */
+
+#define LOADOUT_DIR         "/var/lib/kaos-pi/loadouts"
+#define LOADOUT_EXT         ".loadout"
+#define LOADOUT_TRAP_SLOT   2                       // Slot of "trap": the first after the players
+
+// Function Prototypes
+
+/**
+ * Check a loadout name (letters, digits, '-' and '_', at most 64 characters)
+ */
+bool loadout_valid_name(const char* name);
+
+/**
+ * Parse loadout text into loadout's mask, dirty and names (data is left alone)
+ * Returns 0 on success, -1 on a malformed line, bad slot or bad file name
+ */
+int loadout_parse(const char* text, size_t len, portal_loadout_t* loadout);
+
+/**
+ * Read a loadout file (names only)
+ * Returns 0 on success, -1 if missing or malformed
+ */
+int loadout_read_file(const char* path, portal_loadout_t* loadout);
+
+/**
+ * Write a loadout file via a temporary name, synced before the rename
+ * Returns 0 on success, -1 on error
+ */
+int loadout_write_file(const char* path, const portal_loadout_t* loadout);
+
+/**
+ * Path of a named loadout in LOADOUT_DIR
+ */
+void loadout_path(const char* name, char* path, size_t size);
+
+/**
+ * Read every figure of a loadout into its data
+ * Returns 0 on success, or -1 with failed_slot set to the slot that failed
+ */
+int loadout_read_figures(const portal_t* portal, portal_loadout_t* loadout, int* failed_slot);
+
+/**
+ * List stored loadout names (sorted)
+ * Returns array of names (caller frees each and the array), NULL if none
+ */
+char** loadout_list(int* count);
+
+#endif // LOADOUT_H
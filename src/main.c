@@ -1,6 +1,14 @@
 #include "usb_gadget.h"
 #include "portal.h"
+#include "portal_queue.h"
 #include "web_server.h"
+#include "events.h"
+#include "persist.h"
+#include "figure_cache.h"
+#include "metrics.h"
+#include "latency.h"
+#include "trace.h"
+#include "realtime.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,6 +16,9 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/timerfd.h>
 
 /**
  * KAOS-Pi: Skylander Portal Emulator for Raspberry Pi
@@ -15,10 +26,26 @@
  * Main application entry point
  */
 
-// Global state
-static portal_t portal;
+// Global state (one portal_t and gadget per emulated portal)
+static portal_t portals[MAX_PORTALS];
+static usb_gadget_t gadgets[MAX_PORTALS];
+static portal_queue_t queues[MAX_PORTALS];          // Web -> portal thread actions
+static int portal_count = 1;
 static web_server_t web_server;
 static int running = 1;
+static realtime_config_t rt_config = { .priority = 0, .cpu = -1, .lock_memory = false };
+static int pump_interval_ms = PORTAL_PUMP_INTERVAL_MS;
+static bool verbose = false;                        // Dump every host report and response
+static pthread_t restore_tid;                       // Restores slots during gadget bring-up
+static bool restore_started = false;
+
+// Status pump: unsolicited 'S' reports on a timerfd while the portal is active
+typedef struct {
+    int timer_fd;                                   // -1 when disabled
+    bool armed;
+    bool due;                                       // Tick seen, report not sent yet
+    bool answered;                                  // Host got a status report since the last tick
+} status_pump_t;
 
 /**
  * Signal handler for graceful shutdown
@@ -28,54 +55,212 @@ void signal_handler(int signo) {
     running = 0;
 }
 
+/**
+ * React to the host connecting or going away
+ * Returns true when loaded figures should be announced to the host
+ */
+static bool handle_link_change(usb_gadget_t* gadget, portal_t* portal, portal_queue_t* queue,
+                               usb_link_state_t link) {
+    if (link != USB_LINK_CONFIGURED) {
+        return false;
+    }
+    
+    // New host session: fresh device file and power-on portal state
+    usb_gadget_reopen(gadget);
+    pthread_mutex_lock(&queue->state_lock);
+    portal_host_reset(portal);
+    pthread_mutex_unlock(&queue->state_lock);
+    
+    // The game usually asks for the figures it saw last; read them ahead
+    figure_cache_prewarm(portal);
+    return true;
+}
+
+/**
+ * Run the pump timer only while a host has the portal activated
+ */
+static void pump_arm(status_pump_t* pump, bool on) {
+    if (pump->timer_fd < 0 || pump->armed == on) {
+        return;
+    }
+    
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (on) {
+        its.it_interval.tv_sec = pump_interval_ms / 1000;
+        its.it_interval.tv_nsec = (long)(pump_interval_ms % 1000) * 1000000L;
+        its.it_value = its.it_interval;
+    }
+    timerfd_settime(pump->timer_fd, 0, &its, NULL);
+    pump->armed = on;
+    pump->due = false;
+}
+
+/**
+ * Send a due status report unless the host polled one itself since the
+ * last tick or the IN endpoint is still busy; the report advances slot
+ * sequences, so it is only built once it can go out
+ */
+static void pump_send(status_pump_t* pump, usb_gadget_t* gadget, portal_t* portal,
+                      portal_queue_t* queue, bool traced) {
+    // Ticks keep the cadence; only a report that actually went out skips one
+    bool answered = pump->answered;
+    pump->due = false;
+    pump->answered = false;
+    if (answered || !usb_gadget_write_ready(gadget)) {
+        metric_inc(&kaos_metrics.status_coalesced);
+        return;
+    }
+    
+    uint8_t report[PORTAL_STATUS_REPORT_SIZE];
+    pthread_mutex_lock(&queue->state_lock);
+    size_t len = portal_status_report(portal, report);
+    pthread_mutex_unlock(&queue->state_lock);
+    if (usb_gadget_write(gadget, report, len) > 0) {
+        metric_inc(&kaos_metrics.status_pumped);
+        if (traced) trace_record(TRACE_IN, 0, report, len);
+    }
+}
+
+/**
+ * Dump the start of a report
+ */
+static void dump_report(const char* what, const uint8_t* data, size_t len) {
+    printf("%s %zu bytes: ", what, len);
+    for (size_t i = 0; i < len && i < 16; i++) {
+        printf("%02X ", data[i]);
+    }
+    printf("\n");
+}
+
 /**
  * Portal communication thread
- * Handles USB communication with the host
+ * Handles USB communication with the host of one portal
  */
 void* portal_thread(void* arg) {
+    int index = (int)(intptr_t)arg;
+    portal_t* portal = &portals[index];
+    usb_gadget_t* gadget = &gadgets[index];
+    portal_queue_t* queue = &queues[index];
     uint8_t buffer[PORTAL_BUFFER_SIZE];
     uint8_t response[PORTAL_BUFFER_SIZE];
+    bool announce = false;
+    char name[16];
+    
+    // Traces hold a single portal's traffic
+    bool traced = index == 0;
+    
+    if (index == 0) {
+        snprintf(name, sizeof(name), "portal");
+    } else {
+        snprintf(name, sizeof(name), "portal%d", index);
+    }
+    
+    status_pump_t pump = { .timer_fd = -1 };
+    if (pump_interval_ms > 0) {
+        pump.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (pump.timer_fd < 0) {
+            perror("Status pump timerfd");
+        }
+    }
     
-    printf("Portal communication thread started\n");
+    printf("Portal %d communication thread started\n", index);
+    metrics_register_thread(name);
+    realtime_apply_thread(&rt_config, name);
     
     while (running) {
+        usb_link_state_t link;
+        if (usb_gadget_link_changed(gadget, &link)) {
+            announce = handle_link_change(gadget, portal, queue, link);
+        }
+        
+        // Management actions from the web server land between host reports.
+        // Portal state only changes under the state lock, so web readers see
+        // it whole
+        portal_queue_apply(queue, portal);
+        pthread_mutex_lock(&queue->state_lock);
+        portal_checkpoint(portal);
+        pthread_mutex_unlock(&queue->state_lock);
+        pump_arm(&pump, portal->state != PORTAL_STATE_IDLE &&
+                        usb_gadget_link_state(gadget) == USB_LINK_CONFIGURED);
+        
         // Read from USB
-        int bytes = usb_gadget_read(buffer, sizeof(buffer));
+        int bytes = usb_gadget_read(gadget, buffer, sizeof(buffer));
         
         if (bytes > 0) {
-            printf("Received %d bytes: ", bytes);
-            for (int i = 0; i < bytes && i < 16; i++) {
-                printf("%02X ", buffer[i]);
-            }
-            printf("\n");
+            uint64_t received_ns = latency_now_ns();
+            if (traced) trace_record(TRACE_OUT, 0, buffer, bytes);
             
             // Process command
             size_t response_len = 0;
-            int should_respond = portal_process_command(&portal, buffer, bytes, 
+            pthread_mutex_lock(&queue->state_lock);
+            int should_respond = portal_process_command(portal, buffer, bytes, 
                                                         response, &response_len);
+            pthread_mutex_unlock(&queue->state_lock);
             
             // Send response if needed
             if (should_respond > 0 && response_len > 0) {
-                printf("Sending %zu bytes: ", response_len);
-                for (size_t i = 0; i < response_len && i < 16; i++) {
-                    printf("%02X ", response[i]);
+                if (usb_gadget_write(gadget, response, response_len) > 0) {
+                    latency_record(buffer[0], latency_now_ns() - received_ns);
+                    if (traced) trace_record(TRACE_IN, 0, response, response_len);
+                    if (response[0] == RESP_STATUS) pump.answered = true;
                 }
-                printf("\n");
-                
-                usb_gadget_write(response, response_len);
+            }
+            
+            // Dumps go out after the response so they never count as latency
+            if (verbose) {
+                char what[32];
+                snprintf(what, sizeof(what), "Portal %d received", index);
+                dump_report(what, buffer, bytes);
+                if (should_respond > 0 && response_len > 0) {
+                    dump_report("Sent", response, response_len);
+                }
+            }
+            
+            // Re-announce figures that were loaded before the host reconnected
+            if (announce && buffer[0] == CMD_ACTIVATE) {
+                pthread_mutex_lock(&queue->state_lock);
+                response_len = portal_status_report(portal, response);
+                pthread_mutex_unlock(&queue->state_lock);
+                if (usb_gadget_write(gadget, response, response_len) > 0) {
+                    if (traced) trace_record(TRACE_IN, 0, response, response_len);
+                    pump.answered = true;
+                }
+                announce = false;
             }
         } else if (bytes < 0) {
-            // Error occurred
+            // Device file went bad: reopen if the host is still there, then
+            // block on the link monitor instead of spinning
             if (!running) break;
-            perror("USB read error");
-            usleep(100000); // 100ms delay before retry
+            if (usb_gadget_link_state(gadget) == USB_LINK_CONFIGURED) {
+                usb_gadget_reopen(gadget);
+            }
+            struct pollfd wake = { .fd = portal_queue_fd(queue), .events = POLLIN };
+            usb_gadget_wait(gadget, 100, &wake, 1);
+            if (wake.revents & POLLIN) portal_queue_clear_wakeup(queue);
+        } else if (pump.due) {
+            // Commands are drained first, so pumped reports only fill idle time
+            pump_send(&pump, gadget, portal, queue, traced);
         } else {
-            // No data, small delay
-            usleep(10000); // 10ms
+            // No data, block until the host sends a report, the pump ticks
+            // or the web server posts an action
+            struct pollfd wake[2] = {
+                { .fd = portal_queue_fd(queue), .events = POLLIN },
+                { .fd = pump.timer_fd, .events = POLLIN },
+            };
+            usb_gadget_wait(gadget, 100, wake, pump.armed ? 2 : 1);
+            if (wake[0].revents & POLLIN) portal_queue_clear_wakeup(queue);
+            uint64_t expirations;
+            if (pump.armed && (wake[1].revents & POLLIN) &&
+                read(pump.timer_fd, &expirations, sizeof(expirations)) > 0) {
+                pump.due = true;
+            }
         }
     }
     
-    printf("Portal communication thread stopped\n");
+    if (pump.timer_fd >= 0) close(pump.timer_fd);
+    printf("Portal %d communication thread stopped\n", index);
+    metrics_unregister_thread();
     return NULL;
 }
 
@@ -89,11 +274,28 @@ void print_usage(const char* program) {
     printf("\n");
     printf("Options:\n");
     printf("  -p PORT     Web server port (default: 8080)\n");
+    printf("  -t FILE     Capture portal traffic to a trace file\n");
+    printf("  -n COUNT    Emulate COUNT portals, one gadget and UDC each (default: 1, max %d)\n",
+           MAX_PORTALS);
+    printf("  -u UDC[,..] Bind portal n to the n-th UDC listed (default: n-th in /sys/class/udc)\n");
+    printf("  -i N        HID endpoint bInterval (f_hid needs kernel support)\n");
+    printf("  -b BACKEND  USB function: hidg (f_hid, default) or ffs (FunctionFS)\n");
+    printf("  -o PROFILE  Command path: interrupt (OUT endpoint, default) or control (SET_REPORT)\n");
+    printf("  -r MS       Send status reports every MS while activated, 0 = on request only\n");
+    printf("              (default: %d)\n", PORTAL_PUMP_INTERVAL_MS);
+    printf("  -P PRIO     Run the portal threads SCHED_FIFO at PRIO (1-99)\n");
+    printf("  -a CPU      Pin the portal threads to CPU\n");
+    printf("  -m          Lock memory and prefault the portal thread stacks\n");
+    printf("  -v          Log every host report and response\n");
     printf("  -h          Show this help message\n");
     printf("\n");
     printf("Examples:\n");
     printf("  %s              # Start with default settings\n", program);
     printf("  %s -p 80        # Use port 80 for web interface\n", program);
+    printf("  %s -t game.trc  # Record a session for kaos-replay\n", program);
+    printf("  %s -u dummy_udc.0  # Run on dummy_hcd for end-to-end tests\n", program);
+    printf("  %s -P 50 -a 3 -m   # Real-time portal thread on isolated CPU 3\n", program);
+    printf("  %s -n 2 -u dummy_udc.0,dummy_udc.1  # Two portals for two hosts\n", program);
     printf("\n");
 }
 
@@ -147,15 +349,102 @@ void print_system_info(void) {
     printf("\n");
 }
 
+/**
+ * Give portal n the n-th UDC of a comma-separated list
+ */
+static void assign_udcs(char* list) {
+    char* save = NULL;
+    int index = 0;
+    for (char* udc = strtok_r(list, ",", &save); udc && index < portal_count;
+         udc = strtok_r(NULL, ",", &save)) {
+        usb_gadget_set_udc(&gadgets[index++], udc);
+    }
+}
+
+/**
+ * Stop and remove the gadgets set up so far
+ */
+static void cleanup_gadgets(int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        usb_gadget_cleanup(&gadgets[i]);
+    }
+}
+
+/**
+ * Record and print how long startup took
+ */
+static void report_ready(uint64_t start_us, uint64_t gadget_us) {
+    uint64_t ready_us = metrics_now_us() - start_us;
+    metric_gauge_set(&kaos_metrics.startup_ready_us, ready_us);
+    
+    struct timespec boot;
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    uint64_t since_boot_us = (uint64_t)boot.tv_sec * 1000000 + boot.tv_nsec / 1000;
+    metric_gauge_set(&kaos_metrics.ready_since_boot_us, since_boot_us);
+    
+    int64_t restore_us = atomic_load_explicit(&kaos_metrics.startup_restore_us.value,
+                                              memory_order_relaxed);
+    printf("Ready in %.1f ms (gadget %.1f ms, restore %.1f ms beside it), %.1f s after boot\n",
+           ready_us / 1000.0, gadget_us / 1000.0, restore_us / 1000.0, since_boot_us / 1e6);
+}
+
+/**
+ * Restore thread: put every portal's last figures back while the gadgets come up
+ */
+static void* restore_thread(void* arg) {
+    (void)arg;
+    uint64_t start_us = metrics_now_us();
+    static portal_loadout_t session;
+    
+    for (int i = 0; i < portal_count; i++) {
+        int restored = portal_restore_session(&portals[i], &session);
+        if (restored <= 0) continue;
+        
+        // The web server may already be reading portal state
+        pthread_mutex_lock(&queues[i].state_lock);
+        portal_apply_loadout(&portals[i], &session);
+        pthread_mutex_unlock(&queues[i].state_lock);
+        printf("Portal %d: restored %d figure%s from the last session\n", i, restored,
+               restored > 1 ? "s" : "");
+    }
+    
+    metric_gauge_set(&kaos_metrics.startup_restore_us, metrics_now_us() - start_us);
+    return NULL;
+}
+
+/**
+ * Wait for the restore thread (before anything else touches the portals)
+ */
+static void join_restore(void) {
+    if (restore_started) {
+        pthread_join(restore_tid, NULL);
+        restore_started = false;
+    }
+}
+
+/**
+ * Save and unload the figures of every portal
+ */
+static void cleanup_portals(void) {
+    join_restore();
+    for (int i = 0; i < portal_count; i++) {
+        portal_cleanup(&portals[i]);
+        portal_queue_cleanup(&queues[i]);
+    }
+}
+
 /**
  * Main entry point
  */
 int main(int argc, char* argv[]) {
+    uint64_t start_us = metrics_now_us();
     int web_port = WEB_SERVER_PORT;
+    const char* trace_path = NULL;
+    char* udc_list = NULL;
     
     // Parse command line arguments
     int opt;
-    while ((opt = getopt(argc, argv, "p:h")) != -1) {
+    while ((opt = getopt(argc, argv, "p:t:n:u:i:b:o:r:P:a:mvh")) != -1) {
         switch (opt) {
             case 'p':
                 web_port = atoi(optarg);
@@ -164,6 +453,73 @@ int main(int argc, char* argv[]) {
                     return 1;
                 }
                 break;
+            case 't':
+                trace_path = optarg;
+                break;
+            case 'n':
+                portal_count = atoi(optarg);
+                if (portal_count < 1 || portal_count > MAX_PORTALS) {
+                    fprintf(stderr, "Invalid portal count: %s (1-%d)\n", optarg, MAX_PORTALS);
+                    return 1;
+                }
+                break;
+            case 'u':
+                udc_list = optarg;
+                break;
+            case 'i':
+                if (atoi(optarg) <= 0 || atoi(optarg) > 255) {
+                    fprintf(stderr, "Invalid interval: %s\n", optarg);
+                    return 1;
+                }
+                usb_gadget_set_interval(atoi(optarg));
+                break;
+            case 'b':
+                if (strcmp(optarg, "hidg") == 0) {
+                    usb_gadget_set_backend(USB_BACKEND_HIDG);
+                } else if (strcmp(optarg, "ffs") == 0) {
+                    usb_gadget_set_backend(USB_BACKEND_FFS);
+                } else {
+                    fprintf(stderr, "Invalid backend: %s (use hidg or ffs)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'o':
+                if (strcmp(optarg, "interrupt") == 0) {
+                    usb_gadget_set_profile(USB_PROFILE_INTERRUPT);
+                } else if (strcmp(optarg, "control") == 0) {
+                    usb_gadget_set_profile(USB_PROFILE_CONTROL);
+                } else {
+                    fprintf(stderr, "Invalid profile: %s (use interrupt or control)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r':
+                pump_interval_ms = atoi(optarg);
+                if (pump_interval_ms < 0 || pump_interval_ms > 1000) {
+                    fprintf(stderr, "Invalid status interval: %s (0-1000 ms)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'P':
+                rt_config.priority = atoi(optarg);
+                if (rt_config.priority <= 0 || rt_config.priority > 99) {
+                    fprintf(stderr, "Invalid priority: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'a':
+                rt_config.cpu = atoi(optarg);
+                if (rt_config.cpu < 0 || rt_config.cpu >= sysconf(_SC_NPROCESSORS_CONF)) {
+                    fprintf(stderr, "Invalid CPU: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                rt_config.lock_memory = true;
+                break;
+            case 'v':
+                verbose = true;
+                break;
             case 'h':
                 print_usage(argv[0]);
                 return 0;
@@ -181,40 +537,94 @@ int main(int argc, char* argv[]) {
     // Setup signal handlers
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    signal(SIGPIPE, SIG_IGN);   // Closed web clients must not kill the process
     
     // Print banner
     print_system_info();
     
-    // Initialize portal
-    printf("Initializing portal...\n");
-    if (portal_init(&portal) < 0) {
-        fprintf(stderr, "Failed to initialize portal\n");
+    // Lock memory before threads and buffers are created
+    if (rt_config.lock_memory && realtime_lock_memory() < 0) {
+        perror("Warning: mlockall failed");
+    }
+    
+    // Initialize event stream (before the portal starts producing events)
+    if (events_init() < 0) {
+        fprintf(stderr, "Failed to initialize event stream\n");
         return 1;
     }
     
-    // Initialize USB gadget
-    printf("Setting up USB gadget...\n");
-    if (usb_gadget_init() < 0) {
-        fprintf(stderr, "Failed to initialize USB gadget\n");
-        portal_cleanup(&portal);
+    // Background writer for uploads published straight to a slot
+    if (persist_init() < 0) {
+        fprintf(stderr, "Failed to start figure writer\n");
         return 1;
     }
     
-    // Start USB gadget
-    printf("Starting USB gadget...\n");
-    if (usb_gadget_start() < 0) {
-        fprintf(stderr, "Failed to start USB gadget\n");
-        usb_gadget_cleanup();
-        portal_cleanup(&portal);
+    // Start capture before any figure is loaded so the trace is replayable
+    if (trace_path && trace_open(trace_path) < 0) {
+        fprintf(stderr, "Failed to open trace file %s\n", trace_path);
         return 1;
     }
     
+    // Initialize portals
+    printf("Initializing %d portal%s...\n", portal_count, portal_count > 1 ? "s" : "");
+    metric_gauge_set(&kaos_metrics.portals, portal_count);
+    for (int i = 0; i < portal_count; i++) {
+        if (portal_init_instance(&portals[i], i) < 0 || portal_queue_init(&queues[i]) < 0) {
+            fprintf(stderr, "Failed to initialize portal %d\n", i);
+            return 1;
+        }
+    }
+    
+    // Keep recently used figures in memory (portal 0 saves into the library)
+    if (figure_cache_init() < 0) {
+        fprintf(stderr, "Warning: figure cache disabled\n");
+    } else {
+        for (int i = 1; i < portal_count; i++) {
+            figure_cache_watch(portals[i].data_dir);
+        }
+    }
+    
+    // Restore the last session's figures while the gadgets come up, so they
+    // are on the portal before the host's first command
+    restore_started = pthread_create(&restore_tid, NULL, restore_thread, NULL) == 0;
+    if (!restore_started) {
+        perror("Failed to create restore thread");
+    }
+    
+    // Initialize USB gadgets
+    uint64_t gadget_start_us = metrics_now_us();
+    printf("Setting up USB gadget...\n");
+    for (int i = 0; i < portal_count; i++) {
+        if (usb_gadget_init(&gadgets[i], i) < 0) {
+            fprintf(stderr, "Failed to initialize USB gadget %d\n", i);
+            cleanup_gadgets(i);
+            cleanup_portals();
+            return 1;
+        }
+    }
+    if (udc_list) {
+        assign_udcs(udc_list);
+    }
+    
+    // Start USB gadgets
+    printf("Starting USB gadget...\n");
+    for (int i = 0; i < portal_count; i++) {
+        if (usb_gadget_start(&gadgets[i]) < 0) {
+            fprintf(stderr, "Failed to start USB gadget %d\n", i);
+            cleanup_gadgets(portal_count);
+            cleanup_portals();
+            return 1;
+        }
+    }
+    uint64_t gadget_us = metrics_now_us() - gadget_start_us;
+    metric_gauge_set(&kaos_metrics.startup_gadget_us, gadget_us);
+    
     // Initialize web server
     printf("Initializing web server on port %d...\n", web_port);
-    if (web_server_init(&web_server, &portal, web_port) < 0) {
+    if (web_server_init(&web_server, portals, queues, portal_count, web_port) < 0) {
         fprintf(stderr, "Failed to initialize web server\n");
-        usb_gadget_cleanup();
-        portal_cleanup(&portal);
+        cleanup_gadgets(portal_count);
+        cleanup_portals();
         return 1;
     }
     
@@ -223,21 +633,46 @@ int main(int argc, char* argv[]) {
     if (web_server_start(&web_server) < 0) {
         fprintf(stderr, "Failed to start web server\n");
         web_server_cleanup(&web_server);
-        usb_gadget_cleanup();
-        portal_cleanup(&portal);
+        cleanup_gadgets(portal_count);
+        cleanup_portals();
         return 1;
     }
     
-    // Create portal communication thread
-    pthread_t portal_tid;
-    if (pthread_create(&portal_tid, NULL, portal_thread, NULL) != 0) {
-        fprintf(stderr, "Failed to create portal thread\n");
+    // Portal threads own the portals from here on
+    join_restore();
+    
+    // Create one portal communication thread per portal
+    pthread_t portal_tids[MAX_PORTALS];
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, REALTIME_THREAD_STACK_SIZE);
+    int started = 0;
+    while (started < portal_count &&
+           pthread_create(&portal_tids[started], &attr, portal_thread, (void*)(intptr_t)started) == 0) {
+        started++;
+    }
+    pthread_attr_destroy(&attr);
+    if (started < portal_count) {
+        fprintf(stderr, "Failed to create portal thread %d\n", started);
+        running = 0;
+        for (int i = 0; i < started; i++) {
+            pthread_join(portal_tids[i], NULL);
+        }
         web_server_cleanup(&web_server);
-        usb_gadget_cleanup();
-        portal_cleanup(&portal);
+        cleanup_gadgets(portal_count);
+        cleanup_portals();
         return 1;
     }
     
+    if (portal_count > 1) {
+        for (int i = 0; i < portal_count; i++) {
+            printf("🎮 Portal %d: %s on %s, web at /portal/%d/\n", i, gadgets[i].device,
+                   gadgets[i].udc, i);
+        }
+    }
+    
+    report_ready(start_us, gadget_us);
+    
     printf("\n✅ KAOS-Pi is running!\n\n");
     
     // Main loop - just wait for signal
@@ -247,19 +682,28 @@ int main(int argc, char* argv[]) {
     
     printf("\nShutting down...\n");
     
-    // Cleanup
-    printf("Stopping portal thread...\n");
-    pthread_cancel(portal_tid);
-    pthread_join(portal_tid, NULL);
+    // Cleanup: portal threads see running cleared within one 100 ms wait.
+    // Cancelling them could leave the state, event or persist locks held
+    printf("Stopping portal threads...\n");
+    for (int i = 0; i < portal_count; i++) {
+        pthread_join(portal_tids[i], NULL);
+    }
     
     printf("Stopping web server...\n");
     web_server_cleanup(&web_server);
+    events_cleanup();
+    persist_cleanup();
     
+    // Unbind but keep the configfs tree so the next start only reconciles it
     printf("Stopping USB gadget...\n");
-    usb_gadget_cleanup();
+    for (int i = 0; i < portal_count; i++) {
+        usb_gadget_stop(&gadgets[i]);
+    }
     
     printf("Cleaning up portal...\n");
-    portal_cleanup(&portal);
+    cleanup_portals();
+    figure_cache_cleanup();
+    trace_close();
     
     printf("Shutdown complete. Goodbye!\n");
     
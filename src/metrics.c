@@ -0,0 +1,329 @@
+#include "metrics.h"
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+kaos_metrics_t kaos_metrics;
+
+// Histogram upper bounds in microseconds (last bucket is +Inf)
+static const uint64_t hist_bounds_us[METRICS_HIST_BUCKETS - 1] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000
+};
+
+static const char* const opcode_names[METRIC_OP_COUNT] = {
+    "A", "D", "C", "Q", "W", "S", "R", "unknown"
+};
+
+static const char* const route_names[METRIC_ROUTE_COUNT] = {
+    "/", "/upload", "/list", "/load", "/unload", "/color", "/loadout", "/delete", "/status",
+    "/events", "/stats", "/metrics", "/latency", "other"
+};
+
+static const int status_codes[METRIC_STATUS_COUNT] = {
+    200, 400, 404, 408, 413, 429, 431, 500, 503, 0
+};
+
+// Threads reporting CPU time
+typedef struct {
+    pthread_t thread;
+    clockid_t clock;
+    char name[16];
+    int used;
+} metric_thread_t;
+
+static metric_thread_t threads[METRICS_MAX_THREADS];
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Record a latency observation
+ */
+void metric_observe_us(metric_histogram_t* h, uint64_t us) {
+    int i = 0;
+    while (i < METRICS_HIST_BUCKETS - 1 && us > hist_bounds_us[i]) i++;
+
+    atomic_fetch_add_explicit(&h->buckets[i], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_us, us, memory_order_relaxed);
+}
+
+/**
+ * Map a portal command byte to its metric index
+ */
+metric_opcode_t metrics_opcode_index(uint8_t command) {
+    switch (command) {
+        case CMD_ACTIVATE:   return METRIC_OP_ACTIVATE;
+        case CMD_DEACTIVATE: return METRIC_OP_DEACTIVATE;
+        case CMD_COLOR:      return METRIC_OP_COLOR;
+        case CMD_READ:       return METRIC_OP_READ;
+        case CMD_WRITE:      return METRIC_OP_WRITE;
+        case CMD_STATUS:     return METRIC_OP_STATUS;
+        case CMD_READY:      return METRIC_OP_READY;
+        default:             return METRIC_OP_UNKNOWN;
+    }
+}
+
+/**
+ * Count an HTTP response
+ */
+void metrics_http_response(metric_route_t route, int status_code) {
+    int status = METRIC_STATUS_OTHER;
+    for (int i = 0; i < METRIC_STATUS_OTHER; i++) {
+        if (status_codes[i] == status_code) {
+            status = i;
+            break;
+        }
+    }
+
+    if (route >= METRIC_ROUTE_COUNT) route = METRIC_ROUTE_OTHER;
+    metric_inc(&kaos_metrics.http_requests[route][status]);
+}
+
+/**
+ * Register the calling thread for CPU time reporting
+ */
+void metrics_register_thread(const char* name) {
+    clockid_t clock;
+    if (pthread_getcpuclockid(pthread_self(), &clock) != 0) return;
+
+    pthread_mutex_lock(&threads_lock);
+    for (int i = 0; i < METRICS_MAX_THREADS; i++) {
+        if (!threads[i].used) {
+            threads[i].thread = pthread_self();
+            threads[i].clock = clock;
+            strncpy(threads[i].name, name, sizeof(threads[i].name) - 1);
+            threads[i].name[sizeof(threads[i].name) - 1] = '\0';
+            threads[i].used = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&threads_lock);
+}
+
+/**
+ * Remove the calling thread from CPU time reporting
+ */
+void metrics_unregister_thread(void) {
+    pthread_mutex_lock(&threads_lock);
+    for (int i = 0; i < METRICS_MAX_THREADS; i++) {
+        if (threads[i].used && pthread_equal(threads[i].thread, pthread_self())) {
+            threads[i].used = 0;
+        }
+    }
+    pthread_mutex_unlock(&threads_lock);
+}
+
+/**
+ * Get monotonic time in microseconds
+ */
+uint64_t metrics_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t load_counter(metric_counter_t* c) {
+    return atomic_load_explicit(&c->value, memory_order_relaxed);
+}
+
+static double load_gauge_seconds(metric_gauge_t* g) {
+    return atomic_load_explicit(&g->value, memory_order_relaxed) / 1e6;
+}
+
+static void render_header(FILE* out, const char* name, const char* type, const char* help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void render_histogram(FILE* out, const char* name, const char* help,
+                             metric_histogram_t* h) {
+    render_header(out, name, "histogram", help);
+
+    uint64_t cumulative = 0;
+    for (int i = 0; i < METRICS_HIST_BUCKETS; i++) {
+        cumulative += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        if (i < METRICS_HIST_BUCKETS - 1) {
+            fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", name,
+                    hist_bounds_us[i] / 1e6, (unsigned long long)cumulative);
+        } else {
+            fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cumulative);
+        }
+    }
+
+    uint64_t sum_us = atomic_load_explicit(&h->sum_us, memory_order_relaxed);
+    fprintf(out, "%s_sum %.6f\n", name, sum_us / 1e6);
+    fprintf(out, "%s_count %llu\n", name, (unsigned long long)cumulative);
+}
+
+/**
+ * Write all metrics in Prometheus text exposition format
+ */
+void metrics_render(FILE* out) {
+    kaos_metrics_t* m = &kaos_metrics;
+
+    // USB
+    render_header(out, "kaos_usb_reports_total", "counter", "HID reports transferred");
+    fprintf(out, "kaos_usb_reports_total{direction=\"out\"} %llu\n",
+            (unsigned long long)load_counter(&m->usb_reports_out));
+    fprintf(out, "kaos_usb_reports_total{direction=\"in\"} %llu\n",
+            (unsigned long long)load_counter(&m->usb_reports_in));
+
+    render_header(out, "kaos_usb_errors_total", "counter", "HID read/write errors");
+    fprintf(out, "kaos_usb_errors_total{op=\"read\"} %llu\n",
+            (unsigned long long)load_counter(&m->usb_read_errors));
+    fprintf(out, "kaos_usb_errors_total{op=\"write\"} %llu\n",
+            (unsigned long long)load_counter(&m->usb_write_errors));
+
+    render_header(out, "kaos_usb_eagain_total", "counter", "HID reads/writes that would block");
+    fprintf(out, "kaos_usb_eagain_total{op=\"read\"} %llu\n",
+            (unsigned long long)load_counter(&m->usb_read_eagain));
+    fprintf(out, "kaos_usb_eagain_total{op=\"write\"} %llu\n",
+            (unsigned long long)load_counter(&m->usb_write_eagain));
+
+    render_header(out, "kaos_usb_control_requests_total", "counter",
+                  "ep0 control requests serviced by the FunctionFS backend");
+    fprintf(out, "kaos_usb_control_requests_total{result=\"handled\"} %llu\n",
+            (unsigned long long)load_counter(&m->usb_control_handled));
+    fprintf(out, "kaos_usb_control_requests_total{result=\"stalled\"} %llu\n",
+            (unsigned long long)load_counter(&m->usb_control_stalled));
+
+    render_header(out, "kaos_usb_link_transitions_total", "counter", "Host link state changes by new state");
+    for (int i = 0; i < USB_LINK_STATE_COUNT; i++) {
+        fprintf(out, "kaos_usb_link_transitions_total{to=\"%s\"} %llu\n",
+                usb_gadget_link_state_name(i),
+                (unsigned long long)load_counter(&m->usb_link_transitions[i]));
+    }
+
+    render_header(out, "kaos_usb_link_state", "gauge",
+                  "Host link state (0 disconnected, 1 attached, 2 configured, 3 suspended)");
+    int64_t portals = atomic_load_explicit(&m->portals.value, memory_order_relaxed);
+    for (int64_t i = 0; i < (portals > 0 ? portals : 1) && i < MAX_PORTALS; i++) {
+        fprintf(out, "kaos_usb_link_state{portal=\"%lld\"} %lld\n", (long long)i,
+                (long long)atomic_load_explicit(&m->usb_link_state[i].value, memory_order_relaxed));
+    }
+
+    render_histogram(out, "kaos_usb_reconnect_seconds",
+                     "Time from the host configuring the portal to the first response",
+                     &m->usb_reconnect_latency);
+
+    // Portal
+    render_header(out, "kaos_portals", "gauge", "Emulated portals");
+    fprintf(out, "kaos_portals %lld\n", (long long)portals);
+
+    render_header(out, "kaos_portal_commands_total", "counter", "Portal commands processed by opcode");
+    for (int i = 0; i < METRIC_OP_COUNT; i++) {
+        fprintf(out, "kaos_portal_commands_total{opcode=\"%s\"} %llu\n", opcode_names[i],
+                (unsigned long long)load_counter(&m->portal_commands[i]));
+    }
+
+    render_header(out, "kaos_portal_block_reads_total", "counter", "Figure blocks read by slot");
+    for (int i = 0; i < MAX_SKYLANDERS; i++) {
+        uint64_t n = load_counter(&m->block_reads[i]);
+        if (n) fprintf(out, "kaos_portal_block_reads_total{slot=\"%d\"} %llu\n", i, (unsigned long long)n);
+    }
+
+    render_header(out, "kaos_portal_block_writes_total", "counter", "Figure blocks written by slot");
+    for (int i = 0; i < MAX_SKYLANDERS; i++) {
+        uint64_t n = load_counter(&m->block_writes[i]);
+        if (n) fprintf(out, "kaos_portal_block_writes_total{slot=\"%d\"} %llu\n", i, (unsigned long long)n);
+    }
+
+    render_header(out, "kaos_portal_block_errors_total", "counter",
+                  "Block reads and writes answered with an error (empty slot or bad block)");
+    fprintf(out, "kaos_portal_block_errors_total{op=\"read\"} %llu\n",
+            (unsigned long long)load_counter(&m->block_read_errors));
+    fprintf(out, "kaos_portal_block_errors_total{op=\"write\"} %llu\n",
+            (unsigned long long)load_counter(&m->block_write_errors));
+
+    render_header(out, "kaos_portal_slots_loaded", "gauge", "Slots holding a figure");
+    fprintf(out, "kaos_portal_slots_loaded %lld\n",
+            (long long)atomic_load_explicit(&m->slots_loaded.value, memory_order_relaxed));
+
+    render_header(out, "kaos_portal_figure_swaps_total", "counter",
+                  "Figures loaded over another one (removal reported first)");
+    fprintf(out, "kaos_portal_figure_swaps_total %llu\n", (unsigned long long)load_counter(&m->figure_swaps));
+
+    render_histogram(out, "kaos_portal_arrival_seconds",
+                     "Time from a figure being loaded to the host being sent its arrival",
+                     &m->arrival_latency);
+
+    render_histogram(out, "kaos_portal_loadout_seconds",
+                     "Time from a loadout request to all its figures being on the portal",
+                     &m->loadout_latency);
+
+    render_header(out, "kaos_portal_status_pumped_total", "counter",
+                  "Status reports sent unsolicited by the status pump");
+    fprintf(out, "kaos_portal_status_pumped_total %llu\n", (unsigned long long)load_counter(&m->status_pumped));
+
+    render_header(out, "kaos_portal_status_coalesced_total", "counter",
+                  "Status pump ticks skipped (host polled since the last tick or IN endpoint busy)");
+    fprintf(out, "kaos_portal_status_coalesced_total %llu\n",
+            (unsigned long long)load_counter(&m->status_coalesced));
+
+    // Storage
+    render_histogram(out, "kaos_storage_load_seconds", "Figure file load latency", &m->load_latency);
+    render_histogram(out, "kaos_storage_save_seconds", "Figure file save latency", &m->save_latency);
+
+    render_header(out, "kaos_storage_save_bytes_total", "counter", "Bytes written saving figures");
+    fprintf(out, "kaos_storage_save_bytes_total %llu\n", (unsigned long long)load_counter(&m->save_bytes));
+
+    render_header(out, "kaos_storage_save_errors_total", "counter", "Failed figure saves");
+    fprintf(out, "kaos_storage_save_errors_total %llu\n", (unsigned long long)load_counter(&m->save_errors));
+
+    render_header(out, "kaos_storage_cache_lookups_total", "counter", "Figure reads by cache result");
+    fprintf(out, "kaos_storage_cache_lookups_total{result=\"hit\"} %llu\n",
+            (unsigned long long)load_counter(&m->cache_hits));
+    fprintf(out, "kaos_storage_cache_lookups_total{result=\"miss\"} %llu\n",
+            (unsigned long long)load_counter(&m->cache_misses));
+
+    render_header(out, "kaos_storage_cache_entries", "gauge", "Figures held in memory");
+    fprintf(out, "kaos_storage_cache_entries %lld\n",
+            (long long)atomic_load_explicit(&m->cache_entries.value, memory_order_relaxed));
+
+    render_header(out, "kaos_storage_checkpoints_total", "counter", "Portal slot state files written");
+    fprintf(out, "kaos_storage_checkpoints_total %llu\n", (unsigned long long)load_counter(&m->checkpoints));
+
+    // Startup
+    render_header(out, "kaos_startup_seconds", "gauge",
+                  "Startup phases (restore runs beside gadget bring-up; ready is the total)");
+    fprintf(out, "kaos_startup_seconds{phase=\"gadget\"} %.6f\n", load_gauge_seconds(&m->startup_gadget_us));
+    fprintf(out, "kaos_startup_seconds{phase=\"restore\"} %.6f\n", load_gauge_seconds(&m->startup_restore_us));
+    fprintf(out, "kaos_startup_seconds{phase=\"ready\"} %.6f\n", load_gauge_seconds(&m->startup_ready_us));
+
+    render_header(out, "kaos_ready_since_boot_seconds", "gauge", "Time from kernel boot to the portals running");
+    fprintf(out, "kaos_ready_since_boot_seconds %.6f\n", load_gauge_seconds(&m->ready_since_boot_us));
+
+    // HTTP
+    render_header(out, "kaos_events_dropped_total", "counter",
+                  "Portal events dropped because the dispatcher fell behind");
+    fprintf(out, "kaos_events_dropped_total %llu\n", (unsigned long long)load_counter(&m->events_dropped));
+
+    render_header(out, "kaos_http_requests_total", "counter", "HTTP responses by route and status");
+    for (int r = 0; r < METRIC_ROUTE_COUNT; r++) {
+        for (int s = 0; s < METRIC_STATUS_COUNT; s++) {
+            uint64_t n = load_counter(&m->http_requests[r][s]);
+            if (!n) continue;
+            if (status_codes[s]) {
+                fprintf(out, "kaos_http_requests_total{route=\"%s\",status=\"%d\"} %llu\n",
+                        route_names[r], status_codes[s], (unsigned long long)n);
+            } else {
+                fprintf(out, "kaos_http_requests_total{route=\"%s\",status=\"other\"} %llu\n",
+                        route_names[r], (unsigned long long)n);
+            }
+        }
+    }
+
+    // CPU time
+    struct timespec ts;
+    render_header(out, "kaos_thread_cpu_seconds_total", "counter", "CPU time consumed by thread");
+    pthread_mutex_lock(&threads_lock);
+    for (int i = 0; i < METRICS_MAX_THREADS; i++) {
+        if (threads[i].used && clock_gettime(threads[i].clock, &ts) == 0) {
+            fprintf(out, "kaos_thread_cpu_seconds_total{thread=\"%s\"} %.6f\n",
+                    threads[i].name, ts.tv_sec + ts.tv_nsec / 1e9);
+        }
+    }
+    pthread_mutex_unlock(&threads_lock);
+
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) == 0) {
+        render_header(out, "kaos_process_cpu_seconds_total", "counter", "CPU time consumed by the process");
+        fprintf(out, "kaos_process_cpu_seconds_total %.6f\n", ts.tv_sec + ts.tv_nsec / 1e9);
+    }
+}
@@ -0,0 +1,187 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include "portal.h"
+#include "usb_gadget.h"
+
+/**
+ * Metrics Registry
+ * Process-wide counters, gauges and histograms rendered in the Prometheus
+ * text exposition format. Counter updates are a single relaxed atomic add
+ * so they can be used on the USB hot path.
+ */
+
+#define METRICS_MAX_THREADS     8       // Threads reporting CPU time
+#define METRICS_HIST_BUCKETS    13      // Latency histogram buckets (incl. +Inf)
+
+// Portal opcodes tracked individually
+typedef enum {
+    METRIC_OP_ACTIVATE,
+    METRIC_OP_DEACTIVATE,
+    METRIC_OP_COLOR,
+    METRIC_OP_READ,
+    METRIC_OP_WRITE,
+    METRIC_OP_STATUS,
+    METRIC_OP_READY,
+    METRIC_OP_UNKNOWN,
+    METRIC_OP_COUNT
+} metric_opcode_t;
+
+// HTTP routes
+typedef enum {
+    METRIC_ROUTE_INDEX,
+    METRIC_ROUTE_UPLOAD,
+    METRIC_ROUTE_LIST,
+    METRIC_ROUTE_LOAD,
+    METRIC_ROUTE_UNLOAD,
+    METRIC_ROUTE_COLOR,
+    METRIC_ROUTE_LOADOUT,
+    METRIC_ROUTE_DELETE,
+    METRIC_ROUTE_STATUS,
+    METRIC_ROUTE_EVENTS,
+    METRIC_ROUTE_STATS,
+    METRIC_ROUTE_METRICS,
+    METRIC_ROUTE_LATENCY,
+    METRIC_ROUTE_OTHER,                             // Unknown path or rejected before routing
+    METRIC_ROUTE_COUNT
+} metric_route_t;
+
+// HTTP status codes tracked individually
+typedef enum {
+    METRIC_STATUS_200,
+    METRIC_STATUS_400,
+    METRIC_STATUS_404,
+    METRIC_STATUS_408,
+    METRIC_STATUS_413,
+    METRIC_STATUS_429,
+    METRIC_STATUS_431,
+    METRIC_STATUS_500,
+    METRIC_STATUS_503,
+    METRIC_STATUS_OTHER,
+    METRIC_STATUS_COUNT
+} metric_status_t;
+
+typedef struct {
+    _Atomic uint64_t value;
+} metric_counter_t;
+
+typedef struct {
+    _Atomic int64_t value;
+} metric_gauge_t;
+
+// Fixed-bucket latency histogram (microseconds)
+typedef struct {
+    _Atomic uint64_t buckets[METRICS_HIST_BUCKETS];
+    _Atomic uint64_t sum_us;
+} metric_histogram_t;
+
+// Registry
+typedef struct {
+    // USB (OUT = host to portal, IN = portal to host)
+    metric_counter_t usb_reports_out;
+    metric_counter_t usb_reports_in;
+    metric_counter_t usb_read_errors;
+    metric_counter_t usb_write_errors;
+    metric_counter_t usb_read_eagain;
+    metric_counter_t usb_write_eagain;
+    metric_counter_t usb_control_handled;
+    metric_counter_t usb_control_stalled;
+    metric_counter_t usb_link_transitions[USB_LINK_STATE_COUNT];   // By new state
+    metric_gauge_t usb_link_state[MAX_PORTALS];                     // By portal
+    metric_histogram_t usb_reconnect_latency;                       // Configured -> first response
+
+    // Portal
+    metric_gauge_t portals;                                         // Emulated portals
+    metric_counter_t portal_commands[METRIC_OP_COUNT];
+    metric_counter_t block_reads[MAX_SKYLANDERS];
+    metric_counter_t block_writes[MAX_SKYLANDERS];
+    metric_counter_t block_read_errors;                             // Q answered with an error
+    metric_counter_t block_write_errors;                            // W answered with an error
+    metric_gauge_t slots_loaded;
+    metric_counter_t figure_swaps;                                  // Loads over an occupied slot
+    metric_histogram_t arrival_latency;                             // Load -> arrival reported
+    metric_histogram_t loadout_latency;                             // Loadout request -> applied
+    metric_counter_t status_pumped;                                 // Unsolicited status reports
+    metric_counter_t status_coalesced;                              // Pump ticks with nothing sent
+
+    // Storage
+    metric_histogram_t load_latency;
+    metric_histogram_t save_latency;
+    metric_counter_t save_bytes;
+    metric_counter_t save_errors;
+    metric_counter_t cache_hits;                                    // Figure reads served from memory
+    metric_counter_t cache_misses;                                  // Figure reads from storage
+    metric_gauge_t cache_entries;                                   // Figures held by the cache
+    metric_counter_t checkpoints;                                   // Slot state files written
+
+    // Startup (microseconds)
+    metric_gauge_t startup_gadget_us;                               // Gadget bring-up
+    metric_gauge_t startup_restore_us;                              // Slot restore, beside the gadget
+    metric_gauge_t startup_ready_us;                                // Process start -> portals running
+    metric_gauge_t ready_since_boot_us;                             // Kernel boot -> portals running
+
+    // HTTP
+    metric_counter_t http_requests[METRIC_ROUTE_COUNT][METRIC_STATUS_COUNT];
+    metric_counter_t events_dropped;                                // Portal events lost to a full ring
+} kaos_metrics_t;
+
+extern kaos_metrics_t kaos_metrics;
+
+static inline void metric_inc(metric_counter_t* c) {
+    atomic_fetch_add_explicit(&c->value, 1, memory_order_relaxed);
+}
+
+static inline void metric_add(metric_counter_t* c, uint64_t n) {
+    atomic_fetch_add_explicit(&c->value, n, memory_order_relaxed);
+}
+
+static inline void metric_gauge_add(metric_gauge_t* g, int64_t n) {
+    atomic_fetch_add_explicit(&g->value, n, memory_order_relaxed);
+}
+
+static inline void metric_gauge_set(metric_gauge_t* g, int64_t v) {
+    atomic_store_explicit(&g->value, v, memory_order_relaxed);
+}
+
+// Function Prototypes
+
+/**
+ * Record a latency observation in microseconds
+ */
+void metric_observe_us(metric_histogram_t* h, uint64_t us);
+
+/**
+ * Map a portal command byte to its metric index
+ */
+metric_opcode_t metrics_opcode_index(uint8_t command);
+
+/**
+ * Count an HTTP response
+ */
+void metrics_http_response(metric_route_t route, int status_code);
+
+/**
+ * Register the calling thread for CPU time reporting
+ */
+void metrics_register_thread(const char* name);
+
+/**
+ * Remove the calling thread from CPU time reporting
+ */
+void metrics_unregister_thread(void);
+
+/**
+ * Get monotonic time in microseconds (for latency measurements)
+ */
+uint64_t metrics_now_us(void);
+
+/**
+ * Write all metrics in Prometheus text exposition format
+ */
+void metrics_render(FILE* out);
+
+#endif // METRICS_H
@@ -0,0 +1,200 @@
+#include "persist.h"
+#include "metrics.h"
+#include "figure_cache.h"
+#include "loadout.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+// One queued write
+typedef struct {
+    char path[512];
+    uint8_t data[SKYLANDER_DATA_SIZE];
+    size_t len;
+} persist_job_t;
+
+// Write queue (single ring, drained by the writer thread)
+static persist_job_t queue[PERSIST_QUEUE_SIZE];
+static unsigned int queue_head = 0;                 // Next slot to write
+static unsigned int queue_tail = 0;                 // Next job to run
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+// Newest slot state of each portal, written once the queue is empty
+static portal_loadout_t checkpoints[MAX_PORTALS];
+static uint16_t checkpoint_pending = 0;             // Bit per portal
+
+static pthread_t writer_tid;
+static int initialized = 0;
+static int running = 0;
+
+/**
+ * Write a file via a temporary name, then rename it into place
+ * st gets the metadata of the written file
+ * Returns 0 on success, -1 on error
+ */
+static int write_file(const persist_job_t* job, struct stat* st) {
+    char tmp_path[520];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", job->path);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Failed to persist figure");
+        return -1;
+    }
+
+    ssize_t written = write(fd, job->data, job->len);
+    int synced = fsync(fd);
+    if (synced == 0) synced = fstat(fd, st);
+    close(fd);
+
+    if (written != (ssize_t)job->len || synced != 0 || rename(tmp_path, job->path) != 0) {
+        fprintf(stderr, "Failed to persist figure to %s\n", job->path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writer thread: runs queued writes in order
+ */
+static void* writer_thread(void* arg) {
+    (void)arg;
+    persist_job_t job;
+    static portal_loadout_t state;
+
+    metrics_register_thread("persist");
+    pthread_mutex_lock(&queue_lock);
+    for (;;) {
+        while (running && queue_head == queue_tail && !checkpoint_pending) {
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        }
+        // Drain what is queued before stopping
+        if (queue_head == queue_tail && !checkpoint_pending) break;
+
+        // Slot state goes out after the figures it says are saved
+        if (queue_head == queue_tail) {
+            int index = __builtin_ctz(checkpoint_pending);
+            checkpoint_pending &= ~(1u << index);
+            state.mask = checkpoints[index].mask;
+            state.dirty = checkpoints[index].dirty;
+            memcpy(state.names, checkpoints[index].names, sizeof(state.names));
+            pthread_mutex_unlock(&queue_lock);
+
+            char path[64];
+            snprintf(path, sizeof(path), PORTAL_SESSION_FORMAT, index);
+            if (loadout_write_file(path, &state) == 0) {
+                metric_inc(&kaos_metrics.checkpoints);
+            } else {
+                metric_inc(&kaos_metrics.save_errors);
+            }
+
+            pthread_mutex_lock(&queue_lock);
+            continue;
+        }
+
+        job = queue[queue_tail % PERSIST_QUEUE_SIZE];
+        queue_tail++;
+        pthread_mutex_unlock(&queue_lock);
+
+        // Taken first, so a change made by anyone else after the write discards the put
+        uint64_t start_us = metrics_now_us();
+        uint64_t cache_token = figure_cache_token();
+        struct stat st;
+        if (write_file(&job, &st) == 0) {
+            metric_observe_us(&kaos_metrics.save_latency, metrics_now_us() - start_us);
+            metric_add(&kaos_metrics.save_bytes, job.len);
+            if (job.len == SKYLANDER_DATA_SIZE) {
+                figure_cache_put(job.path, job.data, &st, cache_token);
+            }
+            printf("Persisted figure to '%s'\n", job.path);
+        } else {
+            metric_inc(&kaos_metrics.save_errors);
+        }
+
+        pthread_mutex_lock(&queue_lock);
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    metrics_unregister_thread();
+    return NULL;
+}
+
+/**
+ * Start the writer thread
+ */
+int persist_init(void) {
+    if (initialized) return 0;
+
+    queue_head = queue_tail = 0;
+    checkpoint_pending = 0;
+    running = 1;
+
+    if (pthread_create(&writer_tid, NULL, writer_thread, NULL) != 0) {
+        perror("Failed to create persist thread");
+        running = 0;
+        return -1;
+    }
+
+    initialized = 1;
+    return 0;
+}
+
+/**
+ * Flush the queue and stop the writer thread
+ */
+void persist_cleanup(void) {
+    if (!initialized) return;
+
+    pthread_mutex_lock(&queue_lock);
+    running = 0;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    pthread_join(writer_tid, NULL);
+    initialized = 0;
+}
+
+/**
+ * Queue a figure write
+ */
+int persist_write(const char* path, const uint8_t* data, size_t len) {
+    if (!path || !data || len > SKYLANDER_DATA_SIZE) return -1;
+
+    pthread_mutex_lock(&queue_lock);
+    if (!initialized || !running || queue_head - queue_tail == PERSIST_QUEUE_SIZE) {
+        pthread_mutex_unlock(&queue_lock);
+        return -1;
+    }
+
+    persist_job_t* job = &queue[queue_head % PERSIST_QUEUE_SIZE];
+    snprintf(job->path, sizeof(job->path), "%s", path);
+    memcpy(job->data, data, len);
+    job->len = len;
+    queue_head++;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    return 0;
+}
+
+/**
+ * Checkpoint the portal's slot state
+ */
+int persist_checkpoint(const portal_t* portal) {
+    if (!portal || portal->index < 0 || portal->index >= MAX_PORTALS) return -1;
+
+    pthread_mutex_lock(&queue_lock);
+    if (!initialized || !running) {
+        pthread_mutex_unlock(&queue_lock);
+        return -1;
+    }
+    portal_snapshot(portal, &checkpoints[portal->index]);
+    checkpoint_pending |= 1u << portal->index;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "portal.h"
+
+/**
+ * Asynchronous Figure Writer
+ * Queue of figure files written to storage by a background thread, so
+ * request handlers never wait for the SD card. Each file is written to a
+ * temporary name, synced and renamed over the target, so a crash never
+ * leaves a truncated figure behind. The same thread checkpoints each
+ * portal's slot state to its session file, after the figures queued before.
+ */
+
+#define PERSIST_QUEUE_SIZE      16      // Pending writes (power of two)
+
+// Function Prototypes
+
+/**
+ * Start the writer thread
+ * Returns 0 on success, -1 on error
+ */
+int persist_init(void);
+
+/**
+ * Write out everything still queued and stop the writer thread
+ */
+void persist_cleanup(void);
+
+/**
+ * Queue a figure for writing to path (len <= SKYLANDER_DATA_SIZE)
+ * Returns 0 if queued, -1 if the queue is full or the writer is not running
+ */
+int persist_write(const char* path, const uint8_t* data, size_t len);
+
+/**
+ * Checkpoint the portal's slot state (only the newest state is written)
+ * Returns 0 if recorded, -1 if the writer is not running
+ */
+int persist_checkpoint(const portal_t* portal);
+
+#endif // PERSIST_H
@@ -1,14 +1,160 @@
 #include "portal.h"
 #include "crypto/skylander_crypt.h"
+#include "events.h"
+#include "metrics.h"
+#include "figure_cache.h"
+#include "loadout.h"
+#include "persist.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 
-// Skylander storage directory
-#define SKYLANDERS_DIR "/var/lib/kaos-pi/skylanders"
+/**
+ * Publish a portal event to the web event stream
+ */
+static void portal_emit(portal_t* portal, event_type_t type, uint8_t slot, uint8_t block) {
+    portal_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.portal = portal->index;
+    event.type = type;
+    event.slot = slot;
+    event.block = block;
+    events_publish(&event);
+}
+
+/**
+ * Get the SLOT_STATUS_* a slot shows in the next report
+ */
+static inline uint8_t slot_status(const portal_t* portal, uint8_t slot) {
+    return (portal->slot_status >> (slot * 2)) & 0x3;
+}
+
+/**
+ * Check whether any slot still reads as removed
+ */
+static inline bool removals_pending(const portal_t* portal) {
+    return (portal->slot_status >> 1) & ~portal->slot_status & 0x55555555u;
+}
+
+/**
+ * Set a slot's reported status and keep the portal bitmaps in step
+ */
+static void set_slot_status(portal_t* portal, uint8_t slot, uint8_t status) {
+    portal->slot_status = (portal->slot_status & ~(0x3u << (slot * 2))) |
+                          ((uint32_t)status << (slot * 2));
+    if (status == SLOT_STATUS_ADDED || status == SLOT_STATUS_REMOVED) {
+        portal->pending |= 1u << slot;
+    } else {
+        portal->pending &= ~(1u << slot);
+    }
+    if (status == SLOT_STATUS_ABSENT || status == SLOT_STATUS_REMOVED) {
+        portal->present &= ~(1u << slot);
+        portal->slot_data[slot] = NULL;
+    } else {
+        portal->present |= 1u << slot;
+        portal->slot_data[slot] = portal->figures[slot];
+    }
+}
+
+/**
+ * Queue a save of a figure the host wrote to
+ * Returns 0 if queued, -1 if the writer is busy or not running
+ */
+static int writeback(portal_t* portal, uint8_t slot) {
+    char filepath[512];
+    snprintf(filepath, sizeof(filepath), "%s/%s", portal->data_dir, portal->slots[slot].filename);
+    if (persist_write(filepath, portal->figures[slot], SKYLANDER_DATA_SIZE) != 0) {
+        return -1;
+    }
+    portal->dirty &= ~(1u << slot);
+    portal->changed = true;
+    return 0;
+}
+
+/**
+ * Put a figure into an empty slot
+ * A polling host is told with an arrival report first
+ */
+static void place_figure(portal_t* portal, uint8_t slot, const uint8_t* data, const char* name,
+                         uint64_t placed_us) {
+    skylander_slot_t* skylander = &portal->slots[slot];
+    memcpy(portal->figures[slot], data, SKYLANDER_DATA_SIZE);
+    
+    // Mark slot as occupied
+    if (!(portal->present & (1u << slot))) {
+        metric_gauge_add(&kaos_metrics.slots_loaded, 1);
+    }
+    strncpy(skylander->filename, name, sizeof(skylander->filename) - 1);
+    skylander->filename[sizeof(skylander->filename) - 1] = '\0';
+    portal->held &= ~(1u << slot);
+    portal->changed = true;
+    bool idle = portal->state == PORTAL_STATE_IDLE;
+    set_slot_status(portal, slot, idle ? SLOT_STATUS_PRESENT : SLOT_STATUS_ADDED);
+    skylander->removal_reports = 0;
+    skylander->placed_us = idle ? 0 : placed_us;
+    
+    portal_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.portal = portal->index;
+    event.type = EVENT_SLOT_LOAD;
+    event.slot = slot;
+    strncpy(event.filename, skylander->filename, sizeof(event.filename) - 1);
+    events_publish(&event);
+    
+    printf("Loaded Skylander '%s' into slot %d\n", skylander->filename, slot);
+}
+
+/**
+ * Take the figure off a slot
+ * A polling host sees it as removed for PORTAL_SWAP_REMOVAL_REPORTS reports
+ */
+static void lift_figure(portal_t* portal, uint8_t slot) {
+    skylander_slot_t* skylander = &portal->slots[slot];
+    
+    // Keep what the game wrote before the data goes, here if the writer cannot take it
+    if ((portal->dirty & (1u << slot)) && writeback(portal, slot) != 0 &&
+        portal_save_skylander(portal, slot) != 0) {
+        fprintf(stderr, "Writes to '%s' in slot %d are lost\n", skylander->filename, slot);
+        portal->dirty &= ~(1u << slot);
+    }
+    portal->changed = true;
+    memset(portal->figures[slot], 0, SKYLANDER_DATA_SIZE);
+    skylander->filename[0] = '\0';
+    if (portal->state == PORTAL_STATE_IDLE) {
+        set_slot_status(portal, slot, SLOT_STATUS_ABSENT);
+        skylander->removal_reports = 0;
+    } else {
+        set_slot_status(portal, slot, SLOT_STATUS_REMOVED);
+        skylander->removal_reports = PORTAL_SWAP_REMOVAL_REPORTS;
+    }
+    metric_gauge_add(&kaos_metrics.slots_loaded, -1);
+    portal_emit(portal, EVENT_SLOT_UNLOAD, slot, 0);
+}
+
+/**
+ * Finish pending arrivals and removals at once when nobody is polling
+ */
+static void settle_slots(portal_t* portal) {
+    for (int i = 0; i < MAX_SKYLANDERS; i++) {
+        skylander_slot_t* skylander = &portal->slots[i];
+        if (skylander->staged) {
+            skylander->staged = false;
+            place_figure(portal, i, skylander->staged_data, skylander->staged_filename, 0);
+        } else if (slot_status(portal, i) == SLOT_STATUS_REMOVED) {
+            set_slot_status(portal, i, SLOT_STATUS_ABSENT);
+        } else if (slot_status(portal, i) == SLOT_STATUS_ADDED) {
+            set_slot_status(portal, i, SLOT_STATUS_PRESENT);
+        }
+        skylander->removal_reports = 0;
+        skylander->placed_us = 0;
+    }
+    portal->held = 0;
+}
 
 /**
  * Initialize the portal
@@ -17,37 +163,109 @@ int portal_init(portal_t* portal) {
     if (!portal) return -1;
     
     memset(portal, 0, sizeof(portal_t));
+    strcpy(portal->data_dir, PORTAL_LIBRARY_DIR);
     portal->state = PORTAL_STATE_IDLE;
     portal->auto_sense = true;
     
-    // Initialize all slots as inactive
-    for (int i = 0; i < MAX_SKYLANDERS; i++) {
-        portal->slots[i].active = false;
-    }
-    
     // Create skylanders directory if it doesn't exist
     struct stat st;
-    if (stat(SKYLANDERS_DIR, &st) != 0) {
-        mkdir(SKYLANDERS_DIR, 0755);
+    if (stat(PORTAL_LIBRARY_DIR, &st) != 0) {
+        mkdir(PORTAL_LIBRARY_DIR, 0755);
     }
     
     printf("Portal initialized\n");
     return 0;
 }
 
+/**
+ * Initialize portal n of several
+ */
+int portal_init_instance(portal_t* portal, int index) {
+    if (!portal || index < 0 || index >= MAX_PORTALS) return -1;
+    
+    if (portal_init(portal) < 0) return -1;
+    portal->index = index;
+    portal->save_writes = true;
+    
+    if (index > 0) {
+        snprintf(portal->data_dir, sizeof(portal->data_dir), PORTAL_DATA_DIR_FORMAT, index);
+        struct stat st;
+        if (stat(portal->data_dir, &st) != 0 && mkdir(portal->data_dir, 0755) < 0) {
+            perror("Failed to create portal data directory");
+            fprintf(stderr, "Path: %s\n", portal->data_dir);
+            return -1;
+        }
+    }
+    
+    printf("Portal %d saves to %s\n", index, portal->data_dir);
+    return 0;
+}
+
+/**
+ * Record the slot state as the portal's session
+ */
+static void save_session(const portal_t* portal) {
+    static portal_loadout_t session;
+    char path[64];
+    snprintf(path, sizeof(path), PORTAL_SESSION_FORMAT, portal->index);
+    
+    portal_snapshot(portal, &session);
+    loadout_write_file(path, &session);
+}
+
+/**
+ * Fill session with the portal's slot state
+ */
+void portal_snapshot(const portal_t* portal, portal_loadout_t* session) {
+    session->mask = 0;
+    session->dirty = portal->dirty;
+    for (int i = 0; i < MAX_SKYLANDERS; i++) {
+        // A staged replacement is what the slot is about to hold
+        const skylander_slot_t* skylander = &portal->slots[i];
+        const char* name = skylander->staged ? skylander->staged_filename :
+                           (portal->present & (1u << i)) ? skylander->filename : "";
+        if (name[0]) {
+            snprintf(session->names[i], sizeof(session->names[i]), "%s", name);
+            session->mask |= 1u << i;
+        }
+    }
+}
+
+/**
+ * Save figures the host stopped writing to and checkpoint changed slot state
+ */
+void portal_checkpoint(portal_t* portal) {
+    if (!portal->changed && !portal->dirty) return;
+    
+    if (portal->dirty &&
+        metrics_now_us() - portal->written_us >= PORTAL_WRITEBACK_DELAY_MS * 1000ULL) {
+        for (uint16_t dirty = portal->dirty; dirty; dirty &= dirty - 1) {
+            writeback(portal, __builtin_ctz(dirty));
+        }
+    }
+    
+    // Figures queued above reach storage before the state saying they are saved
+    if (portal->changed && persist_checkpoint(portal) == 0) {
+        portal->changed = false;
+    }
+}
+
 /**
  * Cleanup portal resources
  */
 void portal_cleanup(portal_t* portal) {
     if (!portal) return;
     
-    // Unload all Skylanders
+    // Save all Skylanders, record them, then unload them
     for (int i = 0; i < MAX_SKYLANDERS; i++) {
-        if (portal->slots[i].active) {
+        if (portal_slot_active(portal, i)) {
             portal_save_skylander(portal, i);
-            portal_unload_skylander(portal, i);
         }
     }
+    save_session(portal);
+    for (int i = 0; i < MAX_SKYLANDERS; i++) {
+        portal_unload_skylander(portal, i);
+    }
     
     printf("Portal cleaned up\n");
 }
@@ -59,6 +277,7 @@ void portal_activate(portal_t* portal) {
     if (!portal) return;
     
     portal->state = PORTAL_STATE_ACTIVATED;
+    portal_emit(portal, EVENT_PORTAL_ACTIVATE, 0, 0);
     printf("Portal activated\n");
 }
 
@@ -69,6 +288,8 @@ void portal_deactivate(portal_t* portal) {
     if (!portal) return;
     
     portal->state = PORTAL_STATE_IDLE;
+    settle_slots(portal);
+    portal_emit(portal, EVENT_PORTAL_DEACTIVATE, 0, 0);
     printf("Portal deactivated\n");
 }
 
@@ -82,6 +303,15 @@ void portal_set_color(portal_t* portal, uint8_t r, uint8_t g, uint8_t b) {
     portal->led_color[1] = g;
     portal->led_color[2] = b;
     
+    portal_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.portal = portal->index;
+    event.type = EVENT_LED_COLOR;
+    event.color[0] = r;
+    event.color[1] = g;
+    event.color[2] = b;
+    events_publish(&event);
+    
     printf("LED color set to R:%d G:%d B:%d\n", r, g, b);
 }
 
@@ -90,15 +320,75 @@ void portal_set_color(portal_t* portal, uint8_t r, uint8_t g, uint8_t b) {
  */
 uint16_t portal_get_status(portal_t* portal) {
     if (!portal) return 0;
+    return portal->present;
+}
+
+/**
+ * Build a status report ('S' + 2-bit slot status + counter + active)
+ */
+size_t portal_status_report(portal_t* portal, uint8_t* response) {
+    uint32_t status = portal->slot_status;
     
-    uint16_t status = 0;
-    for (int i = 0; i < MAX_SKYLANDERS; i++) {
-        if (portal->slots[i].active) {
-            status |= (1 << i);
+    // Each report moves arrivals and removals on by one step
+    for (uint16_t pending = portal->pending; pending; pending &= pending - 1) {
+        int i = __builtin_ctz(pending);
+        skylander_slot_t* skylander = &portal->slots[i];
+        
+        if (slot_status(portal, i) == SLOT_STATUS_ADDED) {
+            set_slot_status(portal, i, SLOT_STATUS_PRESENT);
+            if (skylander->placed_us) {
+                metric_observe_us(&kaos_metrics.arrival_latency, metrics_now_us() - skylander->placed_us);
+                skylander->placed_us = 0;
+            }
+        } else if (skylander->removal_reports > 1) {
+            skylander->removal_reports--;
+        } else if (skylander->staged && !(portal->held & (1u << i))) {
+            // Publish the swapped-in figure; the next report announces it
+            skylander->staged = false;
+            place_figure(portal, i, skylander->staged_data, skylander->staged_filename,
+                         skylander->placed_us);
+        } else {
+            set_slot_status(portal, i, SLOT_STATUS_ABSENT);
+            skylander->removal_reports = 0;
+        }
+    }
+    
+    // A loadout's figures arrive together once every removal has been reported
+    if (portal->held && !removals_pending(portal)) {
+        for (uint16_t held = portal->held; held; held &= held - 1) {
+            int i = __builtin_ctz(held);
+            skylander_slot_t* skylander = &portal->slots[i];
+            skylander->staged = false;
+            place_figure(portal, i, skylander->staged_data, skylander->staged_filename,
+                         skylander->placed_us);
         }
     }
     
-    return status;
+    response[0] = RESP_STATUS;
+    response[1] = status & 0xFF;
+    response[2] = (status >> 8) & 0xFF;
+    response[3] = (status >> 16) & 0xFF;
+    response[4] = (status >> 24) & 0xFF;
+    response[5] = portal->status_counter++;
+    response[6] = portal->state != PORTAL_STATE_IDLE ? 0x01 : 0x00;
+    return PORTAL_STATUS_REPORT_SIZE;
+}
+
+/**
+ * Return to the power-on state a newly connected host expects
+ */
+void portal_host_reset(portal_t* portal) {
+    if (!portal) return;
+    
+    // Figures stay on the portal; only the session state is reset
+    if (portal->state != PORTAL_STATE_IDLE) {
+        portal_deactivate(portal);
+    }
+    if (portal->led_color[0] || portal->led_color[1] || portal->led_color[2]) {
+        portal_set_color(portal, 0, 0, 0);
+    }
+    printf("Portal reset for new host session (%d figures loaded)\n",
+           __builtin_popcount(portal_get_status(portal)));
 }
 
 /**
@@ -106,7 +396,7 @@ uint16_t portal_get_status(portal_t* portal) {
  */
 bool portal_slot_active(portal_t* portal, uint8_t slot) {
     if (!portal || slot >= MAX_SKYLANDERS) return false;
-    return portal->slots[slot].active;
+    return portal->present & (1u << slot);
 }
 
 /**
@@ -114,7 +404,7 @@ bool portal_slot_active(portal_t* portal, uint8_t slot) {
  */
 skylander_slot_t* portal_get_skylander(portal_t* portal, uint8_t slot) {
     if (!portal || slot >= MAX_SKYLANDERS) return NULL;
-    if (!portal->slots[slot].active) return NULL;
+    if (!(portal->present & (1u << slot))) return NULL;
     return &portal->slots[slot];
 }
 
@@ -135,6 +425,17 @@ bool portal_is_valid_extension(const char* filename) {
             (len >= 5 && strcasecmp(filename + len - 5, EXT_DUMP) == 0));
 }
 
+/**
+ * Check the header block of a figure
+ */
+bool portal_is_valid_figure(const uint8_t* data) {
+    if (!data) return false;
+    
+    uint8_t bcc = data[0] ^ data[1] ^ data[2] ^ data[3];
+    bool blank = (data[0] | data[1] | data[2] | data[3]) == 0;
+    return !blank && data[4] == bcc;
+}
+
 /**
  * Load a Skylander into a slot
  */
@@ -143,20 +444,48 @@ int portal_load_skylander(portal_t* portal, uint8_t slot, const char* filename)
         return -1;
     }
     
+    uint8_t data[SKYLANDER_DATA_SIZE];
+    if (portal_read_skylander_file(portal, filename, data) != 0) {
+        return -1;
+    }
+    return portal_load_skylander_from_buffer(portal, slot, data, SKYLANDER_DATA_SIZE, filename);
+}
+
+/**
+ * Read a figure file without touching the slots
+ */
+int portal_read_skylander_file(const portal_t* portal, const char* filename, uint8_t* data) {
+    if (!portal || !filename || !data) {
+        return -1;
+    }
+    
     // Check file extension
     if (!portal_is_valid_extension(filename)) {
         fprintf(stderr, "Invalid file extension: %s\n", filename);
         return -1;
     }
     
+    uint64_t start_us = metrics_now_us();
+    
     // Build full path
     char filepath[512];
     if (filename[0] == '/') {
         strncpy(filepath, filename, sizeof(filepath) - 1);
     } else {
-        snprintf(filepath, sizeof(filepath), "%s/%s", SKYLANDERS_DIR, filename);
+        // This portal's own save wins over the library copy (portal 0 saves into the library)
+        snprintf(filepath, sizeof(filepath), "%s/%s", portal->data_dir, filename);
+        if (portal->index > 0 && access(filepath, F_OK) != 0) {
+            snprintf(filepath, sizeof(filepath), "%s/%s", PORTAL_LIBRARY_DIR, filename);
+        }
     }
     
+    // Recently used figures are served from memory
+    if (figure_cache_get(filepath, data) == 0) {
+        metric_observe_us(&kaos_metrics.load_latency, metrics_now_us() - start_us);
+        return 0;
+    }
+    uint64_t cache_token = figure_cache_token();
+    
     // Open file
     FILE* fp = fopen(filepath, "rb");
     if (!fp) {
@@ -166,20 +495,16 @@ int portal_load_skylander(portal_t* portal, uint8_t slot, const char* filename)
     }
     
     // Get file size
-    fseek(fp, 0, SEEK_END);
-    long size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    
-    if (size < SKYLANDER_DATA_SIZE) {
-        fprintf(stderr, "File too small: %ld bytes (expected %d)\n", 
-                size, SKYLANDER_DATA_SIZE);
+    struct stat st = { 0 };
+    if (fstat(fileno(fp), &st) != 0 || st.st_size < SKYLANDER_DATA_SIZE) {
+        fprintf(stderr, "File too small: %lld bytes (expected %d)\n", 
+                (long long)st.st_size, SKYLANDER_DATA_SIZE);
         fclose(fp);
         return -1;
     }
     
     // Read data
-    skylander_slot_t* skylander = &portal->slots[slot];
-    size_t read_bytes = fread(skylander->data, 1, SKYLANDER_DATA_SIZE, fp);
+    size_t read_bytes = fread(data, 1, SKYLANDER_DATA_SIZE, fp);
     fclose(fp);
     
     if (read_bytes != SKYLANDER_DATA_SIZE) {
@@ -187,17 +512,135 @@ int portal_load_skylander(portal_t* portal, uint8_t slot, const char* filename)
         return -1;
     }
     
-    // Mark slot as active
-    skylander->active = true;
-    strncpy(skylander->filename, filename, sizeof(skylander->filename) - 1);
-    skylander->last_read_block = 0;
-    skylander->last_write_block = 0;
+    figure_cache_put(filepath, data, &st, cache_token);
+    metric_observe_us(&kaos_metrics.load_latency, metrics_now_us() - start_us);
+    return 0;
+}
+
+/**
+ * Read the portal's last session
+ */
+int portal_read_session(const portal_t* portal, portal_loadout_t* session) {
+    if (!portal || !session) return -1;
     
-    printf("Loaded Skylander '%s' into slot %d\n", filename, slot);
+    char path[64];
+    snprintf(path, sizeof(path), PORTAL_SESSION_FORMAT, portal->index);
+    return loadout_read_file(path, session);
+}
+
+/**
+ * Read the last session and its figures
+ */
+int portal_restore_session(const portal_t* portal, portal_loadout_t* session) {
+    if (!portal || !session || portal_read_session(portal, session) != 0) {
+        return 0;
+    }
     
+    for (uint16_t mask = session->mask; mask; mask &= mask - 1) {
+        int i = __builtin_ctz(mask);
+        if (portal_read_skylander_file(portal, session->names[i], session->data[i]) != 0) {
+            fprintf(stderr, "Portal %d: could not restore '%s' to slot %d\n",
+                    portal->index, session->names[i], i);
+            session->mask &= ~(1u << i);
+        }
+    }
+    if (session->dirty) {
+        fprintf(stderr, "Portal %d: figures in slots 0x%04x had unsaved writes when stopped\n",
+                portal->index, session->dirty);
+    }
+    return __builtin_popcount(session->mask);
+}
+
+/**
+ * Load Skylander data already in memory into a slot
+ */
+int portal_load_skylander_from_buffer(portal_t* portal, uint8_t slot, const uint8_t* data,
+                                      size_t len, const char* name) {
+    if (!portal || !data || !name || slot >= MAX_SKYLANDERS || len < SKYLANDER_DATA_SIZE) {
+        return -1;
+    }
+    
+    skylander_slot_t* skylander = &portal->slots[slot];
+    
+    // Traces are single-portal (see trace.h)
+    if (portal->index == 0) {
+        trace_record(TRACE_LOAD, slot, data, SKYLANDER_DATA_SIZE);
+    }
+    
+    // Swap: the game only notices a new figure after seeing the old one leave,
+    // so stage the new one until the removal has been reported
+    bool occupied = portal->present & (1u << slot);
+    bool removal_pending = slot_status(portal, slot) == SLOT_STATUS_REMOVED;
+    if (portal->state != PORTAL_STATE_IDLE && (occupied || removal_pending)) {
+        memcpy(skylander->staged_data, data, SKYLANDER_DATA_SIZE);
+        strncpy(skylander->staged_filename, name, sizeof(skylander->staged_filename) - 1);
+        skylander->staged_filename[sizeof(skylander->staged_filename) - 1] = '\0';
+        skylander->staged = true;
+        if (occupied) {
+            lift_figure(portal, slot);
+        }
+        skylander->placed_us = metrics_now_us();
+        metric_inc(&kaos_metrics.figure_swaps);
+        printf("Staged Skylander '%s' for slot %d until the removal is reported\n", name, slot);
+        return 0;
+    }
+    
+    skylander->staged = false;
+    place_figure(portal, slot, data, name, metrics_now_us());
     return 0;
 }
 
+/**
+ * Replace the figures on the portal with a loadout in one transition
+ */
+int portal_apply_loadout(portal_t* portal, const portal_loadout_t* loadout) {
+    if (!portal || !loadout) return -1;
+    
+    uint64_t now_us = metrics_now_us();
+    uint16_t keep = 0;
+    int changed = 0;
+    
+    // Take off everything the loadout does not have in the same slot
+    for (int i = 0; i < MAX_SKYLANDERS; i++) {
+        uint16_t bit = 1u << i;
+        skylander_slot_t* skylander = &portal->slots[i];
+        if ((portal->present & bit) && (loadout->mask & bit) && !skylander->staged &&
+            strcmp(skylander->filename, loadout->names[i]) == 0 &&
+            memcmp(portal->figures[i], loadout->data[i], SKYLANDER_DATA_SIZE) == 0) {
+            keep |= bit;
+        } else if ((portal->present & bit) || skylander->staged) {
+            portal_unload_skylander(portal, i);
+            changed++;
+        }
+    }
+    
+    // Hold the new figures back while removals are still to be reported
+    bool hold = portal->state != PORTAL_STATE_IDLE && (loadout->mask & ~keep) &&
+                removals_pending(portal);
+    for (uint16_t add = loadout->mask & ~keep; add; add &= add - 1) {
+        int i = __builtin_ctz(add);
+        skylander_slot_t* skylander = &portal->slots[i];
+        if (portal->index == 0) {
+            trace_record(TRACE_LOAD, i, loadout->data[i], SKYLANDER_DATA_SIZE);
+        }
+        if (hold) {
+            memcpy(skylander->staged_data, loadout->data[i], SKYLANDER_DATA_SIZE);
+            snprintf(skylander->staged_filename, sizeof(skylander->staged_filename), "%s",
+                     loadout->names[i]);
+            skylander->staged = true;
+            skylander->placed_us = now_us;
+            portal->held |= 1u << i;
+        } else {
+            place_figure(portal, i, loadout->data[i], loadout->names[i], now_us);
+        }
+        changed++;
+    }
+    
+    printf("Applied loadout: %d slot%s changed%s\n", changed, changed == 1 ? "" : "s",
+           hold ? ", arrivals held until the removals are reported" : "");
+    return changed;
+}
+
 /**
  * Unload a Skylander from a slot
  */
@@ -206,10 +649,18 @@ void portal_unload_skylander(portal_t* portal, uint8_t slot) {
     
     skylander_slot_t* skylander = &portal->slots[slot];
     
-    if (skylander->active) {
+    bool occupied = portal->present & (1u << slot);
+    if (occupied || skylander->staged) {
         printf("Unloaded Skylander from slot %d\n", slot);
-        memset(skylander, 0, sizeof(skylander_slot_t));
-        skylander->active = false;
+        skylander->staged = false;
+        portal->held &= ~(1u << slot);
+        skylander->placed_us = 0;
+        if (occupied) {
+            lift_figure(portal, slot);
+        }
+        if (portal->index == 0) {
+            trace_record(TRACE_UNLOAD, slot, NULL, 0);
+        }
     }
 }
 
@@ -222,8 +673,9 @@ int portal_read_block(portal_t* portal, uint8_t slot, uint8_t block,
         return -1;
     }
     
-    skylander_slot_t* skylander = portal_get_skylander(portal, slot);
-    if (!skylander) {
+    // Only the hot header and the block itself are touched
+    const uint8_t* figure = portal->slot_data[slot];
+    if (!figure) {
         fprintf(stderr, "No Skylander in slot %d\n", slot);
         return -1;
     }
@@ -234,10 +686,9 @@ int portal_read_block(portal_t* portal, uint8_t slot, uint8_t block,
     }
     
     // Copy block data
-    uint32_t offset = block * SKYLANDER_BLOCK_SIZE;
-    memcpy(data, skylander->data + offset, SKYLANDER_BLOCK_SIZE);
+    memcpy(data, figure + block * SKYLANDER_BLOCK_SIZE, SKYLANDER_BLOCK_SIZE);
     
-    skylander->last_read_block = block;
+    metric_inc(&kaos_metrics.block_reads[slot]);
     
     return 0;
 }
@@ -251,8 +702,8 @@ int portal_write_block(portal_t* portal, uint8_t slot, uint8_t block,
         return -1;
     }
     
-    skylander_slot_t* skylander = portal_get_skylander(portal, slot);
-    if (!skylander) {
+    uint8_t* figure = portal->slot_data[slot];
+    if (!figure) {
         fprintf(stderr, "No Skylander in slot %d\n", slot);
         return -1;
     }
@@ -263,10 +714,15 @@ int portal_write_block(portal_t* portal, uint8_t slot, uint8_t block,
     }
     
     // Write block data
-    uint32_t offset = block * SKYLANDER_BLOCK_SIZE;
-    memcpy(skylander->data + offset, data, SKYLANDER_BLOCK_SIZE);
+    memcpy(figure + block * SKYLANDER_BLOCK_SIZE, data, SKYLANDER_BLOCK_SIZE);
+    if (portal->save_writes && !(portal->dirty & (1u << slot))) {
+        portal->dirty |= 1u << slot;
+        portal->changed = true;
+    }
+    portal->written_us = metrics_now_us();
     
-    skylander->last_write_block = block;
+    metric_inc(&kaos_metrics.block_writes[slot]);
+    portal_emit(portal, EVENT_BLOCK_WRITE, slot, block);
     
     printf("Wrote block %d to slot %d\n", block, slot);
     
@@ -286,26 +742,38 @@ int portal_save_skylander(portal_t* portal, uint8_t slot) {
         return -1;
     }
     
+    uint64_t start_us = metrics_now_us();
+    
     // Build full path
     char filepath[512];
-    snprintf(filepath, sizeof(filepath), "%s/%s", SKYLANDERS_DIR, skylander->filename);
+    snprintf(filepath, sizeof(filepath), "%s/%s", portal->data_dir, skylander->filename);
     
-    // Open file for writing
+    // Open file for writing (cache token first, as for reads)
+    uint64_t cache_token = figure_cache_token();
     FILE* fp = fopen(filepath, "wb");
     if (!fp) {
         perror("Failed to save Skylander file");
+        metric_inc(&kaos_metrics.save_errors);
         return -1;
     }
     
     // Write data
-    size_t written = fwrite(skylander->data, 1, SKYLANDER_DATA_SIZE, fp);
+    size_t written = fwrite(portal->figures[slot], 1, SKYLANDER_DATA_SIZE, fp);
+    struct stat st;
+    if (fflush(fp) != 0 || fstat(fileno(fp), &st) != 0) written = 0;
     fclose(fp);
     
+    metric_observe_us(&kaos_metrics.save_latency, metrics_now_us() - start_us);
+    metric_add(&kaos_metrics.save_bytes, written);
+    
     if (written != SKYLANDER_DATA_SIZE) {
         fprintf(stderr, "Failed to write complete Skylander data\n");
+        metric_inc(&kaos_metrics.save_errors);
         return -1;
     }
     
+    figure_cache_put(filepath, portal->figures[slot], &st, cache_token);
+    portal->dirty &= ~(1u << slot);
     printf("Saved Skylander to '%s'\n", filepath);
     return 0;
 }
@@ -318,7 +786,7 @@ char** portal_list_skylanders(int* count) {
     
     *count = 0;
     
-    DIR* dir = opendir(SKYLANDERS_DIR);
+    DIR* dir = opendir(PORTAL_LIBRARY_DIR);
     if (!dir) {
         return NULL;
     }
@@ -359,6 +827,73 @@ char** portal_list_skylanders(int* count) {
     return files;
 }
 
+/**
+ * List available Skylander files with metadata
+ */
+skylander_file_t* portal_list_skylander_files(const char* dir, bool with_stat, int* count) {
+    if (!count) return NULL;
+    
+    *count = 0;
+    if (!dir) dir = PORTAL_LIBRARY_DIR;
+    
+    DIR* d = opendir(dir);
+    if (!d) {
+        return NULL;
+    }
+    
+    skylander_file_t* files = NULL;
+    int capacity = 0;
+    int index = 0;
+    
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_type != DT_REG || !portal_is_valid_extension(entry->d_name)) {
+            continue;
+        }
+        
+        // Grow array geometrically
+        if (index == capacity) {
+            int new_capacity = capacity ? capacity * 2 : 64;
+            skylander_file_t* grown = realloc(files, sizeof(skylander_file_t) * new_capacity);
+            if (!grown) break;
+            files = grown;
+            capacity = new_capacity;
+        }
+        
+        skylander_file_t* file = &files[index];
+        file->name = strdup(entry->d_name);
+        if (!file->name) break;
+        file->size = -1;
+        file->mtime = 0;
+        
+        if (with_stat) {
+            struct stat st;
+            if (fstatat(dirfd(d), entry->d_name, &st, 0) == 0) {
+                file->size = st.st_size;
+                file->mtime = st.st_mtime;
+            }
+        }
+        
+        index++;
+    }
+    
+    closedir(d);
+    *count = index;
+    return files;
+}
+
+/**
+ * Free a Skylander file listing
+ */
+void portal_free_skylander_files(skylander_file_t* files, int count) {
+    if (!files) return;
+    
+    for (int i = 0; i < count; i++) {
+        free(files[i].name);
+    }
+    free(files);
+}
+
 /**
  * Process a command from the host
  */
@@ -371,6 +906,8 @@ int portal_process_command(portal_t* portal, const uint8_t* cmd, size_t cmd_len,
     uint8_t command = cmd[0];
     *response_len = 0;
     
+    metric_inc(&kaos_metrics.portal_commands[metrics_opcode_index(command)]);
+    
     switch (command) {
         case CMD_ACTIVATE: {
             // Activate portal
@@ -401,12 +938,7 @@ int portal_process_command(portal_t* portal, const uint8_t* cmd, size_t cmd_len,
         
         case CMD_STATUS: {
             // Get portal status
-            uint16_t status = portal_get_status(portal);
-            
-            response[0] = RESP_STATUS;
-            response[1] = (status >> 8) & 0xFF;
-            response[2] = status & 0xFF;
-            *response_len = 3;
+            *response_len = portal_status_report(portal, response);
             return 1;
         }
         
@@ -416,19 +948,20 @@ int portal_process_command(portal_t* portal, const uint8_t* cmd, size_t cmd_len,
                 return -1;
             }
             
-            uint8_t slot = cmd[1];
+            uint8_t slot = cmd[1] & 0x0F;
             uint8_t block = cmd[2];
             
-            uint8_t block_data[SKYLANDER_BLOCK_SIZE];
-            if (portal_read_block(portal, slot, block, block_data) == 0) {
-                response[0] = RESP_READ;
-                response[1] = slot;
-                response[2] = block;
-                memcpy(response + 3, block_data, SKYLANDER_BLOCK_SIZE);
-                *response_len = 3 + SKYLANDER_BLOCK_SIZE;
-                return 1;
+            response[0] = RESP_READ;
+            response[2] = block;
+            *response_len = 3 + SKYLANDER_BLOCK_SIZE;
+            if (portal_read_block(portal, slot, block, response + 3) == 0) {
+                response[1] = RESP_RESULT_OK | slot;
+            } else {
+                response[1] = RESP_RESULT_ERROR;
+                memset(response + 3, 0, SKYLANDER_BLOCK_SIZE);
+                metric_inc(&kaos_metrics.block_read_errors);
             }
-            return -1;
+            return 1;
         }
         
         case CMD_WRITE: {
@@ -437,17 +970,19 @@ int portal_process_command(portal_t* portal, const uint8_t* cmd, size_t cmd_len,
                 return -1;
             }
             
-            uint8_t slot = cmd[1];
+            uint8_t slot = cmd[1] & 0x0F;
             uint8_t block = cmd[2];
             
+            response[0] = RESP_WRITE;
+            response[2] = block;
+            *response_len = 3;
             if (portal_write_block(portal, slot, block, cmd + 3) == 0) {
-                response[0] = RESP_WRITE;
-                response[1] = slot;
-                response[2] = block;
-                *response_len = 3;
-                return 1;
+                response[1] = RESP_RESULT_OK | slot;
+            } else {
+                response[1] = RESP_RESULT_ERROR;
+                metric_inc(&kaos_metrics.block_write_errors);
             }
-            return -1;
+            return 1;
         }
         
         case CMD_READY: {
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <time.h>
 
 /**
  * Skylander Portal Protocol Implementation
@@ -27,17 +28,48 @@
 #define RESP_ARRIVAL        0x49  // 'I' - Skylander arrived
 #define RESP_REMOVAL        0x52  // 'R' - Skylander removed
 
+// Second byte of Q/W responses (the slot is the low nibble of the request's)
+#define RESP_RESULT_OK      0x10  // OR'ed with the slot
+#define RESP_RESULT_ERROR   0x01  // Empty slot or bad block; answered at once
+
 // Skylander Slots
 #define MAX_SKYLANDERS      16
 #define SLOT_PLAYER_1       0x00
 #define SLOT_PLAYER_2       0x01
 #define SLOT_TRAP           0x10
 
+// Slot status in status reports (2 bits per slot, slot n at bits 2n..2n+1)
+#define SLOT_STATUS_ABSENT      0x0
+#define SLOT_STATUS_PRESENT     0x1
+#define SLOT_STATUS_REMOVED     0x2   // Lifted; reported before the slot reads as absent
+#define SLOT_STATUS_ADDED       0x3   // Placed; reported before the slot reads as present
+
+// Status report: 'S' | u32 slot status (LE) | counter | active
+#define PORTAL_STATUS_REPORT_SIZE   7
+
+// Unsolicited status reports while the portal is activated (ms, 0 = on request only)
+#define PORTAL_PUMP_INTERVAL_MS     20
+
+// Status reports showing a swapped-out figure as removed before the new one arrives
+#define PORTAL_SWAP_REMOVAL_REPORTS 1
+
 // Skylander Data
 #define SKYLANDER_BLOCK_SIZE    16
 #define SKYLANDER_BLOCKS        64
 #define SKYLANDER_DATA_SIZE     (SKYLANDER_BLOCK_SIZE * SKYLANDER_BLOCKS)  // 1024 bytes
 
+// Multiple portals
+#define MAX_PORTALS         4                       // Emulated portals per process
+#define PORTAL_LIBRARY_DIR  "/var/lib/kaos-pi/skylanders"   // Figure library, shared
+#define PORTAL_DATA_DIR_FORMAT "/var/lib/kaos-pi/portal%d"  // Saves of portal n > 0
+#define PORTAL_SESSION_FORMAT "/var/lib/kaos-pi/portal%d.session" // Slot state of portal n (checkpointed)
+
+// Figures written by the host are saved once its writes pause this long
+#define PORTAL_WRITEBACK_DELAY_MS   1000
+
+// Alignment of the portal's hot header and figure data
+#define PORTAL_CACHE_LINE   64
+
 // File extensions
 #define EXT_BIN     ".bin"
 #define EXT_DMP     ".dmp"
@@ -52,21 +84,62 @@ typedef enum {
 } portal_state_t;
 
 // Skylander Slot
+// Metadata used off the USB command path (loads, saves, swaps, web UI);
+// the figure data itself is portal_t.figures[slot]
 typedef struct {
-    bool active;                                    // Is slot occupied
-    uint8_t data[SKYLANDER_DATA_SIZE];             // Skylander data (1KB)
     char filename[256];                             // Source filename
-    uint32_t last_read_block;                       // Last block read
-    uint32_t last_write_block;                      // Last block written
+    
+    // Swap engine: the host must see a removal before the replacement arrives
+    uint8_t removal_reports;                        // Removal reports left to send
+    bool staged;                                    // Replacement waiting in staged_data
+    uint64_t placed_us;                             // When the pending arrival was requested
+    char staged_filename[256];
+    uint8_t staged_data[SKYLANDER_DATA_SIZE];
 } skylander_slot_t;
 
+// Skylander File (library listing entry)
+typedef struct {
+    char* name;                                     // Filename
+    long size;                                      // Size in bytes (-1 if not stat'ed)
+    time_t mtime;                                   // Last modification time
+} skylander_file_t;
+
+// Loadout: a set of figures for the whole portal, read ahead of publishing
+typedef struct {
+    uint16_t mask;                                  // Slots with a figure
+    uint16_t dirty;                                 // Slots with host writes not saved yet (sessions)
+    char names[MAX_SKYLANDERS][256];
+    uint8_t data[MAX_SKYLANDERS][SKYLANDER_DATA_SIZE];
+} portal_loadout_t;
+
 // Portal State
+// Hot header first: a status poll only touches its first cache line, a
+// block read or write adds the slot's data pointer and the line holding
+// the block. Names and swap metadata are kept after the figure data.
 typedef struct {
+    // Hot: USB command path
     portal_state_t state;                           // Current state
-    skylander_slot_t slots[MAX_SKYLANDERS];        // Skylander slots
+    uint8_t status_counter;                         // Sequence number of status reports
+    uint16_t present;                               // Occupied slots
+    uint16_t pending;                               // Slots with an arrival or removal to report
+    uint16_t held;                                  // Staged loadout figures waiting for all removals
+    uint32_t slot_status;                           // SLOT_STATUS_* of every slot, report layout
+    uint8_t* slot_data[MAX_SKYLANDERS];             // figures[n] while slot n is occupied, else NULL
+    
+    // Figure data (1 KB per slot)
+    uint8_t figures[MAX_SKYLANDERS][SKYLANDER_DATA_SIZE] __attribute__((aligned(PORTAL_CACHE_LINE)));
+    
+    // Cold: configuration and slot metadata
+    int index;                                      // Portal number (0 = first)
+    char data_dir[256];                             // Where figure saves are written
     uint8_t led_color[3];                           // RGB LED color
     bool auto_sense;                                // Auto-send status updates
-} portal_t;
+    bool save_writes;                               // Save figures the host writes to (not in tools)
+    skylander_slot_t slots[MAX_SKYLANDERS];         // Slot metadata
+    uint16_t dirty;                                 // Slots written by the host since their last save
+    bool changed;                                   // Slot state changed since the last checkpoint
+    uint64_t written_us;                            // Last block write from the host
+} __attribute__((aligned(PORTAL_CACHE_LINE))) portal_t;
 
 // Function Prototypes
 
@@ -75,24 +148,92 @@ typedef struct {
  */
 int portal_init(portal_t* portal);
 
+/**
+ * Initialize portal n of several
+ * Portal 0 saves into the library like a single portal; the others save
+ * into their own data directory so games on different consoles never
+ * overwrite each other's figures
+ * Returns 0 on success, -1 on error
+ */
+int portal_init_instance(portal_t* portal, int index);
+
 /**
  * Cleanup portal resources
+ * Saves every figure and records the slots as the portal's session
  */
 void portal_cleanup(portal_t* portal);
 
 /**
  * Process a command from the host
- * Returns 1 if response should be sent, 0 otherwise, -1 on error
+ * Failed reads and writes are answered with RESP_RESULT_ERROR so the host
+ * never waits for a timeout
+ * Returns 1 if response should be sent, 0 otherwise, -1 on malformed commands
  */
 int portal_process_command(portal_t* portal, const uint8_t* cmd, size_t cmd_len,
                           uint8_t* response, size_t* response_len);
 
 /**
  * Load a Skylander into a slot
+ * Relative names are looked up in the portal's data directory first,
+ * then in the shared library
  * Returns 0 on success, -1 on error
  */
 int portal_load_skylander(portal_t* portal, uint8_t slot, const char* filename);
 
+/**
+ * Read a figure file into data (SKYLANDER_DATA_SIZE bytes), looked up like
+ * portal_load_skylander(); only the portal's data directory is used, so
+ * other threads may call this while the portal thread runs
+ * Returns 0 on success, -1 on error
+ */
+int portal_read_skylander_file(const portal_t* portal, const char* filename, uint8_t* data);
+
+/**
+ * Read the portal's last recorded slot state
+ * (mask, dirty and names of session; data is left alone)
+ * Returns 0 on success, -1 if no session was recorded
+ */
+int portal_read_session(const portal_t* portal, portal_loadout_t* session);
+
+/**
+ * Read the last session and its figures into session, ready for
+ * portal_apply_loadout(); figures that can no longer be read are left out
+ * Returns the number of figures read, 0 if no session was recorded
+ */
+int portal_restore_session(const portal_t* portal, portal_loadout_t* session);
+
+/**
+ * Fill session with the portal's slot state (mask, dirty and names)
+ */
+void portal_snapshot(const portal_t* portal, portal_loadout_t* session);
+
+/**
+ * Save figures the host stopped writing to and checkpoint changed slot
+ * state, both through the background writer (portal thread)
+ * Cheap when nothing changed
+ */
+void portal_checkpoint(portal_t* portal);
+
+/**
+ * Load Skylander data already in memory into a slot
+ * name is recorded as the slot's filename (used when saving)
+ * While the host is polling, a figure already in the slot is swapped:
+ * it reads as removed for PORTAL_SWAP_REMOVAL_REPORTS status reports and
+ * the new one, staged meanwhile, is published with the next report
+ * Returns 0 on success, -1 on error
+ */
+int portal_load_skylander_from_buffer(portal_t* portal, uint8_t slot, const uint8_t* data,
+                                      size_t len, const char* name);
+
+/**
+ * Replace the figures on the portal with a loadout in one transition
+ * Slots already holding the same figure are left alone. While the host is
+ * polling, the figures taken off are reported as removed first, then all
+ * new figures arrive in the same status report
+ * Returns the number of slots changed
+ */
+int portal_apply_loadout(portal_t* portal, const portal_loadout_t* loadout);
+
 /**
  * Unload a Skylander from a slot
  */
@@ -112,9 +253,24 @@ bool portal_slot_active(portal_t* portal, uint8_t slot);
 /**
  * Get portal status as bitmask
  * Each bit represents a slot (1 = occupied, 0 = empty)
+ * O(1): read from the maintained bitmap
  */
 uint16_t portal_get_status(portal_t* portal);
 
+/**
+ * Build a status report for the host
+ * Advances every slot's arrival/removal sequence by one report; only
+ * slots with a pending transition are visited
+ * Returns the report length (PORTAL_STATUS_REPORT_SIZE)
+ */
+size_t portal_status_report(portal_t* portal, uint8_t* response);
+
+/**
+ * Reset session state (activation, LED) for a newly connected host
+ * Loaded figures are kept and reported by the next status report
+ */
+void portal_host_reset(portal_t* portal);
+
 /**
  * Activate the portal
  */
@@ -156,9 +312,28 @@ int portal_save_skylander(portal_t* portal, uint8_t slot);
  */
 char** portal_list_skylanders(int* count);
 
+/**
+ * List available Skylander files with metadata
+ * Scans dir (or the default Skylanders directory if NULL) in a single pass.
+ * Size and mtime are only filled in when with_stat is set.
+ * Returns array of entries (free with portal_free_skylander_files)
+ */
+skylander_file_t* portal_list_skylander_files(const char* dir, bool with_stat, int* count);
+
+/**
+ * Free a listing returned by portal_list_skylander_files
+ */
+void portal_free_skylander_files(skylander_file_t* files, int count);
+
 /**
  * Check if filename has valid Skylander extension
  */
 bool portal_is_valid_extension(const char* filename);
 
+/**
+ * Check that data looks like a figure dump: block 0 holds a non-zero UID
+ * followed by its check byte (XOR of the 4 UID bytes)
+ */
+bool portal_is_valid_figure(const uint8_t* data);
+
 #endif // PORTAL_H
\ No newline at end of file
@@ -0,0 +1,165 @@
+#include "portal_queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+/**
+ * Initialize a queue and its eventfd
+ */
+int portal_queue_init(portal_queue_t* queue) {
+    memset(queue, 0, sizeof(*queue));
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    pthread_mutex_init(&queue->producer_lock, NULL);
+    pthread_mutex_init(&queue->state_lock, NULL);
+
+    queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->event_fd < 0) {
+        perror("Failed to create portal queue eventfd");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Free loadouts still queued and close the eventfd
+ */
+void portal_queue_cleanup(portal_queue_t* queue) {
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    for (uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed); tail != head; tail++) {
+        portal_msg_t* msg = &queue->msgs[tail & (PORTAL_QUEUE_DEPTH - 1)];
+        if (msg->type == PORTAL_MSG_LOADOUT) {
+            free(msg->loadout);
+        }
+    }
+    
+    if (queue->event_fd >= 0) {
+        close(queue->event_fd);
+        queue->event_fd = -1;
+    }
+    pthread_mutex_destroy(&queue->producer_lock);
+    pthread_mutex_destroy(&queue->state_lock);
+}
+
+/**
+ * Copy a message into the ring and wake the portal thread
+ * Caller must hold producer_lock; returns the message's position or -1 if full
+ */
+static int64_t post_locked(portal_queue_t* queue, const portal_msg_t* msg) {
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (head - tail >= PORTAL_QUEUE_DEPTH) {
+        return -1;
+    }
+
+    queue->msgs[head & (PORTAL_QUEUE_DEPTH - 1)] = *msg;
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+
+    uint64_t one = 1;
+    if (write(queue->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("Portal queue wakeup");
+    }
+    return head;
+}
+
+/**
+ * Post a message
+ */
+int portal_queue_post(portal_queue_t* queue, const portal_msg_t* msg) {
+    pthread_mutex_lock(&queue->producer_lock);
+    int64_t pos = post_locked(queue, msg);
+    pthread_mutex_unlock(&queue->producer_lock);
+    return pos < 0 ? -1 : 0;
+}
+
+/**
+ * Post a flush and wait for the portal thread to pass it
+ */
+int portal_queue_flush(portal_queue_t* queue) {
+    portal_msg_t msg = { .type = PORTAL_MSG_FLUSH };
+
+    pthread_mutex_lock(&queue->producer_lock);
+    int64_t pos = post_locked(queue, &msg);
+    pthread_mutex_unlock(&queue->producer_lock);
+    if (pos < 0) {
+        return -1;
+    }
+
+    // The portal thread answers the host first; poll for the tail to move past
+    uint32_t done = (uint32_t)pos + 1;
+    struct timespec step = { 0, 1000000 };
+    for (int waited = 0; waited < PORTAL_QUEUE_FLUSH_TIMEOUT_MS; waited++) {
+        uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+        if ((int32_t)(tail - done) >= 0) {
+            return 0;
+        }
+        nanosleep(&step, NULL);
+    }
+    return -1;
+}
+
+/**
+ * Apply one message to the portal
+ */
+static void apply(portal_t* portal, const portal_msg_t* msg) {
+    switch (msg->type) {
+        case PORTAL_MSG_LOAD:
+            portal_load_skylander_from_buffer(portal, msg->slot, msg->data, SKYLANDER_DATA_SIZE,
+                                              msg->name);
+            break;
+        case PORTAL_MSG_UNLOAD:
+            portal_unload_skylander(portal, msg->slot);
+            break;
+        case PORTAL_MSG_COLOR:
+            portal_set_color(portal, msg->color[0], msg->color[1], msg->color[2]);
+            break;
+        case PORTAL_MSG_LOADOUT:
+            portal_apply_loadout(portal, msg->loadout);
+            free(msg->loadout);
+            break;
+        case PORTAL_MSG_FLUSH:
+            break;
+    }
+}
+
+/**
+ * Apply all pending messages (portal thread only)
+ */
+int portal_queue_apply(portal_queue_t* queue, portal_t* portal) {
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    if (head == tail) {
+        return 0;
+    }
+
+    // Readers of portal state (web status) are short and do no I/O
+    pthread_mutex_lock(&queue->state_lock);
+    int applied = 0;
+    for (; tail != head; tail++, applied++) {
+        apply(portal, &queue->msgs[tail & (PORTAL_QUEUE_DEPTH - 1)]);
+        atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&queue->state_lock);
+    return applied;
+}
+
+/**
+ * Reset the eventfd after poll() reported it readable
+ */
+void portal_queue_clear_wakeup(portal_queue_t* queue) {
+    uint64_t count;
+    if (read(queue->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("Portal queue read");
+    }
+}
+
+/**
+ * Descriptor to poll for POLLIN
+ */
+int portal_queue_fd(portal_queue_t* queue) {
+    return queue->event_fd;
+}
@@ -0,0 +1,100 @@
+#ifndef PORTAL_QUEUE_H
+#define PORTAL_QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "portal.h"
+
+/**
+ * Portal Management Queue
+ * Single-producer/single-consumer ring carrying management actions from the
+ * web server into the portal thread, which owns all portal state. The
+ * producer does any file I/O before posting; the portal thread applies
+ * messages between host reports, woken through an eventfd.
+ * Web worker threads serialize among themselves on the producer lock, so the
+ * ring itself only ever sees one producer and the portal thread never locks it.
+ * The portal thread holds the state lock whenever it changes portal state
+ * (applying messages, host commands, status reports, checkpoints), so web
+ * threads that take it read a consistent snapshot.
+ */
+
+#define PORTAL_QUEUE_DEPTH          8       // Pending messages per portal (power of two)
+#define PORTAL_QUEUE_FLUSH_TIMEOUT_MS 500   // How long a producer waits for a flush
+
+// Management Actions
+typedef enum {
+    PORTAL_MSG_LOAD,                                // Put data on slot (swaps an occupied slot)
+    PORTAL_MSG_UNLOAD,                              // Take the figure off slot
+    PORTAL_MSG_COLOR,                               // Override the LED color
+    PORTAL_MSG_LOADOUT,                             // Replace all figures at once
+    PORTAL_MSG_FLUSH                                // Barrier: everything before it is applied
+} portal_msg_type_t;
+
+// Management Message
+typedef struct {
+    portal_msg_type_t type;
+    uint8_t slot;                                   // Load/unload
+    uint8_t color[3];                               // RGB (color)
+    char name[256];                                 // Figure name (load)
+    uint8_t data[SKYLANDER_DATA_SIZE];              // Figure data (load)
+    portal_loadout_t* loadout;                      // Heap copy freed by the portal thread (loadout)
+} portal_msg_t;
+
+// Queue of one portal
+typedef struct {
+    portal_msg_t msgs[PORTAL_QUEUE_DEPTH];
+    _Atomic uint32_t head;                          // Next message to write (producer)
+    _Atomic uint32_t tail;                          // Next message to apply (portal thread)
+    int event_fd;                                   // Signalled after every post
+    pthread_mutex_t producer_lock;                  // Serializes web worker threads
+    pthread_mutex_t state_lock;                     // Held by the portal thread while changing portal state
+} portal_queue_t;
+
+// Function Prototypes
+
+/**
+ * Initialize a queue and its eventfd
+ * Returns 0 on success, -1 on error
+ */
+int portal_queue_init(portal_queue_t* queue);
+
+/**
+ * Close the eventfd; pending messages are dropped (and their loadouts freed)
+ */
+void portal_queue_cleanup(portal_queue_t* queue);
+
+/**
+ * Post a message (producer side)
+ * A posted loadout belongs to the queue; on failure it stays the caller's
+ * Returns 0 on success, -1 if the queue is full
+ */
+int portal_queue_post(portal_queue_t* queue, const portal_msg_t* msg);
+
+/**
+ * Post a flush and wait until the portal thread has applied it
+ * Returns 0 once everything posted before is applied, -1 on timeout or full queue
+ */
+int portal_queue_flush(portal_queue_t* queue);
+
+/**
+ * Apply all pending messages to the portal (portal thread only)
+ * Cheap when nothing is pending: a single atomic load
+ * Returns the number of messages applied
+ */
+int portal_queue_apply(portal_queue_t* queue, portal_t* portal);
+
+/**
+ * Descriptor to poll for POLLIN in the portal thread's event loop
+ * The loop calls portal_queue_apply() before every wait, so a wakeup only
+ * has to be cleared with portal_queue_clear_wakeup()
+ */
+int portal_queue_fd(portal_queue_t* queue);
+
+/**
+ * Reset the eventfd after poll() reported it readable
+ */
+void portal_queue_clear_wakeup(portal_queue_t* queue);
+
+#endif // PORTAL_QUEUE_H
@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+#include "realtime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+// Result of realtime_lock_memory (0 = not attempted, 1 = locked, -errno)
+static int lock_result = 0;
+
+/**
+ * Lock current and future pages in memory
+ */
+int realtime_lock_memory(void) {
+#ifdef MCL_ONFAULT
+    // Lock pages as they are touched instead of populating every mapping
+    if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) == 0) {
+        lock_result = 1;
+        return 0;
+    }
+    if (errno != EINVAL) {
+        lock_result = -errno;
+        return -1;
+    }
+#endif
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+        lock_result = 1;
+        return 0;
+    }
+    lock_result = -errno;
+    return -1;
+}
+
+/**
+ * Touch the top of the stack so it is resident before the first command
+ */
+static void __attribute__((noinline)) prefault_stack(void) {
+    volatile char stack[REALTIME_PREFAULT_STACK];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) {
+        stack[i] = 0;
+    }
+}
+
+/**
+ * Read a single number from a /proc or /sys file
+ */
+static long read_long(const char* path, long fallback) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) return fallback;
+    long value;
+    if (fscanf(fp, "%ld", &value) != 1) value = fallback;
+    fclose(fp);
+    return value;
+}
+
+/**
+ * Check whether a CPU is in the kernel's isolated set (isolcpus=)
+ */
+static bool cpu_isolated(int cpu) {
+    char list[256] = "";
+    FILE* fp = fopen("/sys/devices/system/cpu/isolated", "r");
+    if (!fp) return false;
+    if (!fgets(list, sizeof(list), fp)) list[0] = '\0';
+    fclose(fp);
+
+    // Format: "2-3,5"
+    char* save = NULL;
+    for (char* tok = strtok_r(list, ",\n", &save); tok; tok = strtok_r(NULL, ",\n", &save)) {
+        int lo, hi;
+        int n = sscanf(tok, "%d-%d", &lo, &hi);
+        if (n == 1) hi = lo;
+        if (n >= 1 && cpu >= lo && cpu <= hi) return true;
+    }
+    return false;
+}
+
+/**
+ * Get locked memory of the process in kB, or -1
+ */
+static long locked_kb(void) {
+    FILE* fp = fopen("/proc/self/status", "r");
+    if (!fp) return -1;
+    char line[128];
+    long kb = -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "VmLck: %ld kB", &kb) == 1) break;
+    }
+    fclose(fp);
+    return kb;
+}
+
+/**
+ * Apply the settings to the calling thread and print a self-check
+ */
+int realtime_apply_thread(const realtime_config_t* config, const char* name) {
+    if (!config) return 0;
+
+    int failures = 0;
+    printf("Real-time self-check (%s thread):\n", name);
+
+    // Scheduling
+    if (config->priority > 0) {
+        struct sched_param sp = { .sched_priority = config->priority };
+        int rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+
+        int policy;
+        pthread_getschedparam(pthread_self(), &policy, &sp);
+        if (rc == 0 && policy == SCHED_FIFO && sp.sched_priority == config->priority) {
+            printf("  ✓ SCHED_FIFO priority %d\n", config->priority);
+
+            long runtime = read_long("/proc/sys/kernel/sched_rt_runtime_us", -1);
+            if (runtime >= 0) {
+                printf("    note: RT throttling limits real-time threads to %ld us per %ld us\n",
+                       runtime, read_long("/proc/sys/kernel/sched_rt_period_us", 1000000));
+            }
+        } else {
+            struct rlimit rl;
+            getrlimit(RLIMIT_RTPRIO, &rl);
+            printf("  ✗ SCHED_FIFO priority %d: %s (RLIMIT_RTPRIO %ld)\n", config->priority,
+                   strerror(rc ? rc : EINVAL), (long)rl.rlim_cur);
+            failures++;
+        }
+    } else {
+        printf("  - SCHED_OTHER (no priority requested)\n");
+    }
+
+    // CPU affinity
+    if (config->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(config->cpu, &set);
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+        cpu_set_t actual;
+        CPU_ZERO(&actual);
+        pthread_getaffinity_np(pthread_self(), sizeof(actual), &actual);
+        if (rc == 0 && CPU_COUNT(&actual) == 1 && CPU_ISSET(config->cpu, &actual)) {
+            printf("  ✓ Pinned to CPU %d%s\n", config->cpu,
+                   cpu_isolated(config->cpu) ? " (isolated)" : " (not isolated; see isolcpus=)");
+        } else {
+            printf("  ✗ Pin to CPU %d: %s\n", config->cpu, strerror(rc ? rc : EINVAL));
+            failures++;
+        }
+    } else {
+        printf("  - Any CPU (no affinity requested)\n");
+    }
+
+    // Memory
+    if (config->lock_memory) {
+        prefault_stack();
+        if (lock_result == 1) {
+            printf("  ✓ Memory locked (VmLck %ld kB), %d KB stack prefaulted\n",
+                   locked_kb(), REALTIME_PREFAULT_STACK / 1024);
+        } else {
+            struct rlimit rl;
+            getrlimit(RLIMIT_MEMLOCK, &rl);
+            printf("  ✗ Memory lock: %s (RLIMIT_MEMLOCK %ld kB)\n",
+                   lock_result ? strerror(-lock_result) : "not attempted",
+                   rl.rlim_cur == RLIM_INFINITY ? -1L : (long)(rl.rlim_cur / 1024));
+            failures++;
+        }
+    } else {
+        printf("  - Memory not locked\n");
+    }
+
+    return failures;
+}
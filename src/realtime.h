@@ -0,0 +1,37 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Real-time Tuning for the Portal Thread
+ * SCHED_FIFO priority, CPU affinity, memory locking and stack prefaulting.
+ * Each setting is best effort; the self-check reports what took effect.
+ */
+
+#define REALTIME_PREFAULT_STACK     (64 * 1024)     // Stack bytes touched up front
+#define REALTIME_THREAD_STACK_SIZE  (256 * 1024)    // Portal thread stack
+
+// Settings
+typedef struct {
+    int priority;                                   // SCHED_FIFO 1-99, 0 = normal scheduling
+    int cpu;                                        // CPU to pin to, -1 = any
+    bool lock_memory;                               // mlockall + prefault stack
+} realtime_config_t;
+
+// Function Prototypes
+
+/**
+ * Lock current and future pages in memory (process wide)
+ * Call before starting threads. Returns 0 on success, -1 on error
+ */
+int realtime_lock_memory(void);
+
+/**
+ * Apply the settings to the calling thread and print a self-check
+ * Returns the number of settings that failed to take effect
+ */
+int realtime_apply_thread(const realtime_config_t* config, const char* name);
+
+#endif // REALTIME_H
@@ -0,0 +1,181 @@
+#include "trace.h"
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// Capture state
+static FILE* trace_fp = NULL;
+static uint64_t last_us = 0;
+static struct timespec start_ts;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void put_le(uint8_t* p, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        p[i] = (v >> (8 * i)) & 0xFF;
+    }
+}
+
+static uint64_t get_le(const uint8_t* p, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++) {
+        v |= (uint64_t)p[i] << (8 * i);
+    }
+    return v;
+}
+
+/**
+ * Start capturing to a file
+ */
+int trace_open(const char* path) {
+    if (!path) return -1;
+
+    FILE* fp = fopen(path, "wb");
+    if (!fp) {
+        perror("Failed to open trace file");
+        return -1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    uint8_t header[TRACE_HEADER_SIZE];
+    memcpy(header, TRACE_MAGIC, 8);
+    put_le(header + 8, TRACE_VERSION, 4);
+    put_le(header + 12, 0, 4);
+    put_le(header + 16, (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec, 8);
+
+    if (fwrite(header, 1, sizeof(header), fp) != sizeof(header)) {
+        perror("Failed to write trace header");
+        fclose(fp);
+        return -1;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fp) fclose(trace_fp);
+    trace_fp = fp;
+    last_us = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start_ts);
+    pthread_mutex_unlock(&trace_lock);
+
+    printf("Capturing portal traffic to %s\n", path);
+    return 0;
+}
+
+/**
+ * Stop capturing
+ */
+void trace_close(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fp) {
+        fclose(trace_fp);
+        trace_fp = NULL;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * Append a record
+ */
+void trace_record(trace_type_t type, uint8_t slot, const uint8_t* data, uint16_t length) {
+    if (length > TRACE_MAX_PAYLOAD) length = TRACE_MAX_PAYLOAD;
+
+    pthread_mutex_lock(&trace_lock);
+    if (!trace_fp) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+
+    // Timestamp under the lock so records are in time order
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t now_us = (uint64_t)(now.tv_sec - start_ts.tv_sec) * 1000000 +
+                      (now.tv_nsec - start_ts.tv_nsec) / 1000;
+    uint64_t delta = now_us - last_us;
+    if (delta > UINT32_MAX) delta = UINT32_MAX;
+    last_us += delta;
+
+    uint8_t header[TRACE_RECORD_HEADER_SIZE];
+    put_le(header, delta, 4);
+    header[4] = type;
+    header[5] = slot;
+    put_le(header + 6, length, 2);
+
+    fwrite(header, 1, sizeof(header), trace_fp);
+    if (length > 0 && data) {
+        fwrite(data, 1, length, trace_fp);
+    }
+
+    // Figure changes are rare; make them durable immediately
+    if (type == TRACE_LOAD || type == TRACE_UNLOAD) {
+        fflush(trace_fp);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * Open a trace for reading
+ */
+int trace_reader_open(trace_reader_t* reader, const char* path) {
+    if (!reader || !path) return -1;
+
+    memset(reader, 0, sizeof(*reader));
+    reader->fp = fopen(path, "rb");
+    if (!reader->fp) {
+        perror("Failed to open trace file");
+        return -1;
+    }
+
+    uint8_t header[TRACE_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), reader->fp) != sizeof(header) ||
+        memcmp(header, TRACE_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: not a portal trace\n", path);
+        trace_reader_close(reader);
+        return -1;
+    }
+
+    if (get_le(header + 8, 4) != TRACE_VERSION) {
+        fprintf(stderr, "%s: unsupported trace version %u\n", path,
+                (unsigned)get_le(header + 8, 4));
+        trace_reader_close(reader);
+        return -1;
+    }
+
+    reader->start_ns = get_le(header + 16, 8);
+    return 0;
+}
+
+/**
+ * Read the next record
+ */
+int trace_reader_next(trace_reader_t* reader, trace_record_t* record) {
+    if (!reader || !reader->fp || !record) return -1;
+
+    uint8_t header[TRACE_RECORD_HEADER_SIZE];
+    size_t n = fread(header, 1, sizeof(header), reader->fp);
+    if (n == 0) return 0;
+    if (n != sizeof(header)) return -1;
+
+    reader->time_us += get_le(header, 4);
+    record->time_us = reader->time_us;
+    record->type = header[4];
+    record->slot = header[5];
+    record->length = get_le(header + 6, 2);
+
+    if (record->length > TRACE_MAX_PAYLOAD) return -1;
+    if (record->length > 0 &&
+        fread(record->data, 1, record->length, reader->fp) != record->length) {
+        return -1;
+    }
+
+    return 1;
+}
+
+/**
+ * Close a trace reader
+ */
+void trace_reader_close(trace_reader_t* reader) {
+    if (reader && reader->fp) {
+        fclose(reader->fp);
+        reader->fp = NULL;
+    }
+}
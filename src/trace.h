@@ -0,0 +1,83 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Portal Traffic Trace
+ * Compact binary log of every HID report in both directions plus the figure
+ * loads and unloads that change what the reports return, so a session can
+ * be replayed (see tools/kaos_replay.c).
+ *
+ * File layout (all integers little-endian):
+ *   header  "KAOSTRC1" | u32 version | u32 reserved | u64 start (CLOCK_REALTIME ns)
+ *   record  u32 delta_us | u8 type | u8 slot | u16 length | payload[length]
+ * delta_us is the time since the previous record.
+ */
+
+#define TRACE_MAGIC             "KAOSTRC1"
+#define TRACE_VERSION           1
+#define TRACE_HEADER_SIZE       24
+#define TRACE_RECORD_HEADER_SIZE 8
+#define TRACE_MAX_PAYLOAD       1024    // A full figure image
+
+// Record Types
+typedef enum {
+    TRACE_OUT = 1,                                  // Report from host (command)
+    TRACE_IN = 2,                                   // Report to host (response)
+    TRACE_LOAD = 3,                                 // Figure placed in slot (payload = data)
+    TRACE_UNLOAD = 4                                // Figure removed from slot
+} trace_type_t;
+
+// Decoded Record
+typedef struct {
+    uint64_t time_us;                               // Since start of capture
+    uint8_t type;
+    uint8_t slot;
+    uint16_t length;
+    uint8_t data[TRACE_MAX_PAYLOAD];
+} trace_record_t;
+
+// Trace Reader
+typedef struct {
+    FILE* fp;
+    uint64_t start_ns;                              // Capture start (CLOCK_REALTIME)
+    uint64_t time_us;                               // Time of last record read
+} trace_reader_t;
+
+// Function Prototypes
+
+/**
+ * Start capturing to a file (truncated)
+ */
+int trace_open(const char* path);
+
+/**
+ * Stop capturing and flush the file
+ */
+void trace_close(void);
+
+/**
+ * Append a record
+ * No-op when no capture is open
+ */
+void trace_record(trace_type_t type, uint8_t slot, const uint8_t* data, uint16_t length);
+
+/**
+ * Open a trace for reading
+ */
+int trace_reader_open(trace_reader_t* reader, const char* path);
+
+/**
+ * Read the next record
+ * Returns 1 on success, 0 at end of trace, -1 on a malformed record
+ */
+int trace_reader_next(trace_reader_t* reader, trace_record_t* record);
+
+/**
+ * Close a trace reader
+ */
+void trace_reader_close(trace_reader_t* reader);
+
+#endif // TRACE_H
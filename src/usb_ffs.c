@@ -0,0 +1,619 @@
+#define _GNU_SOURCE
+#include "usb_ffs.h"
+#include "usb_gadget.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/aio_abi.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+
+// HID class (HID 1.11, section 7)
+#define HID_DT_HID          0x21
+#define HID_DT_REPORT       0x22
+#define HID_REQ_GET_REPORT  0x01
+#define HID_REQ_GET_IDLE    0x02
+#define HID_REQ_GET_PROTOCOL 0x03
+#define HID_REQ_SET_REPORT  0x09
+#define HID_REQ_SET_IDLE    0x0A
+#define HID_REQ_SET_PROTOCOL 0x0B
+
+// HID class descriptor (follows the interface descriptor)
+struct hid_class_descriptor {
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint16_t bcdHID;
+    uint8_t  bCountryCode;
+    uint8_t  bNumDescriptors;
+    uint8_t  bReportType;
+    uint16_t wReportLength;
+} __attribute__((packed));
+
+// Descriptors for one speed: interface, HID, IN endpoint, OUT endpoint (optional, last)
+struct ffs_speed_descriptors {
+    struct usb_interface_descriptor intf;
+    struct hid_class_descriptor hid;
+    struct usb_endpoint_descriptor_no_audio ep_in;
+    struct usb_endpoint_descriptor_no_audio ep_out;
+} __attribute__((packed));
+
+static struct {
+    struct usb_functionfs_descs_head_v2 header;
+    uint32_t fs_count;
+    uint32_t hs_count;
+} __attribute__((packed)) descriptors_head;
+
+static struct ffs_speed_descriptors fs_descriptors;
+static struct ffs_speed_descriptors hs_descriptors;
+
+static struct {
+    struct usb_functionfs_strings_head header;
+    struct {
+        uint16_t code;
+        char interface[sizeof(USB_PRODUCT)];
+    } __attribute__((packed)) lang0;
+} __attribute__((packed)) strings;
+
+// One AIO transfer and its buffer
+typedef struct {
+    struct iocb iocb;
+    uint8_t data[USB_EP_SIZE];
+    bool busy;
+} ffs_io_t;
+
+// File descriptors
+static int ep0_fd = -1;
+static int ep_in_fd = -1;
+static int ep_out_fd = -1;
+static int event_fd = -1;
+static aio_context_t aio_ctx = 0;
+static bool enabled = false;
+static bool has_out_endpoint = true;
+
+static ffs_io_t out_io[FFS_OUT_DEPTH];
+static ffs_io_t in_io[FFS_IN_DEPTH];
+
+// Reports received from the host, oldest at rx_head
+static uint8_t rx_data[FFS_RX_QUEUE][PORTAL_BUFFER_SIZE];
+static size_t rx_len[FFS_RX_QUEUE];
+static unsigned rx_head = 0;
+static unsigned rx_count = 0;
+
+// HID state answered on ep0
+static const uint8_t* report_descriptor = NULL;
+static size_t report_descriptor_len = 0;
+static uint8_t last_report[USB_EP_SIZE];
+static uint8_t hid_idle = 0;
+static uint8_t hid_protocol = 1;                    // Report protocol
+
+// AIO system calls (no libaio dependency)
+static long aio_setup(unsigned nr, aio_context_t* ctx) {
+    return syscall(__NR_io_setup, nr, ctx);
+}
+
+static long aio_destroy(aio_context_t ctx) {
+    return syscall(__NR_io_destroy, ctx);
+}
+
+static long aio_submit(aio_context_t ctx, long n, struct iocb** iocbs) {
+    return syscall(__NR_io_submit, ctx, n, iocbs);
+}
+
+static long aio_getevents(aio_context_t ctx, long min, long max, struct io_event* events,
+                          struct timespec* timeout) {
+    return syscall(__NR_io_getevents, ctx, min, max, events, timeout);
+}
+
+/**
+ * Convert an interval in ms to high-speed bInterval (2^(n-1) microframes)
+ */
+static uint8_t hs_interval(int ms) {
+    uint8_t b = 1;
+    for (int uframes = ms * 8; uframes > 1 && b < 16; uframes >>= 1) {
+        b++;
+    }
+    return b;
+}
+
+/**
+ * Fill in the descriptors for one speed
+ */
+static void fill_speed(struct ffs_speed_descriptors* d, uint8_t interval) {
+    d->intf.bLength = USB_DT_INTERFACE_SIZE;
+    d->intf.bDescriptorType = USB_DT_INTERFACE;
+    d->intf.bInterfaceNumber = 0;
+    d->intf.bNumEndpoints = has_out_endpoint ? 2 : 1;
+    d->intf.bInterfaceClass = USB_CLASS_HID;
+    d->intf.iInterface = 1;
+
+    d->hid.bLength = sizeof(d->hid);
+    d->hid.bDescriptorType = HID_DT_HID;
+    d->hid.bcdHID = htole16(0x0111);
+    d->hid.bNumDescriptors = 1;
+    d->hid.bReportType = HID_DT_REPORT;
+    d->hid.wReportLength = htole16(report_descriptor_len);
+
+    d->ep_in.bLength = USB_DT_ENDPOINT_SIZE;
+    d->ep_in.bDescriptorType = USB_DT_ENDPOINT;
+    d->ep_in.bEndpointAddress = USB_EP_IN;
+    d->ep_in.bmAttributes = USB_ENDPOINT_XFER_INT;
+    d->ep_in.wMaxPacketSize = htole16(USB_EP_SIZE);
+    d->ep_in.bInterval = interval;
+
+    d->ep_out = d->ep_in;
+    d->ep_out.bEndpointAddress = USB_EP_OUT;
+}
+
+/**
+ * Write descriptors and strings to ep0
+ */
+static int write_descriptors(int interval) {
+    // Without an OUT endpoint each speed ends after ep_in
+    size_t speed_len = has_out_endpoint ? sizeof(struct ffs_speed_descriptors)
+                                        : offsetof(struct ffs_speed_descriptors, ep_out);
+    uint32_t count = has_out_endpoint ? 4 : 3;
+    uint8_t buffer[sizeof(descriptors_head) + 2 * sizeof(struct ffs_speed_descriptors)];
+    size_t length = sizeof(descriptors_head) + 2 * speed_len;
+
+    memset(&fs_descriptors, 0, sizeof(fs_descriptors));
+    memset(&hs_descriptors, 0, sizeof(hs_descriptors));
+    fill_speed(&fs_descriptors, interval);
+    fill_speed(&hs_descriptors, hs_interval(interval));
+
+    descriptors_head.header.magic = htole32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2);
+    descriptors_head.header.length = htole32(length);
+    descriptors_head.header.flags = htole32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC);
+    descriptors_head.fs_count = htole32(count);
+    descriptors_head.hs_count = htole32(count);
+
+    memcpy(buffer, &descriptors_head, sizeof(descriptors_head));
+    memcpy(buffer + sizeof(descriptors_head), &fs_descriptors, speed_len);
+    memcpy(buffer + sizeof(descriptors_head) + speed_len, &hs_descriptors, speed_len);
+
+    if (write(ep0_fd, buffer, length) != (ssize_t)length) {
+        perror("Failed to write FunctionFS descriptors");
+        return -1;
+    }
+
+    memset(&strings, 0, sizeof(strings));
+    strings.header.magic = htole32(FUNCTIONFS_STRINGS_MAGIC);
+    strings.header.length = htole32(sizeof(strings));
+    strings.header.str_count = htole32(1);
+    strings.header.lang_count = htole32(1);
+    strings.lang0.code = htole16(0x0409);
+    memcpy(strings.lang0.interface, USB_PRODUCT, sizeof(USB_PRODUCT));
+
+    if (write(ep0_fd, &strings, sizeof(strings)) != (ssize_t)sizeof(strings)) {
+        perror("Failed to write FunctionFS strings");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Submit one transfer, completion is signalled on event_fd
+ */
+static int submit(ffs_io_t* io, int fd, uint16_t opcode, size_t length) {
+    memset(&io->iocb, 0, sizeof(io->iocb));
+    io->iocb.aio_data = (uint64_t)(uintptr_t)io;
+    io->iocb.aio_lio_opcode = opcode;
+    io->iocb.aio_fildes = fd;
+    io->iocb.aio_buf = (uint64_t)(uintptr_t)io->data;
+    io->iocb.aio_nbytes = length;
+    io->iocb.aio_flags = IOCB_FLAG_RESFD;
+    io->iocb.aio_resfd = event_fd;
+
+    struct iocb* list[1] = { &io->iocb };
+    if (aio_submit(aio_ctx, 1, list) != 1) {
+        return -1;
+    }
+    io->busy = true;
+    return 0;
+}
+
+/**
+ * Keep every idle OUT buffer queued while the endpoints are enabled
+ */
+static void submit_reads(void) {
+    for (int i = 0; i < FFS_OUT_DEPTH && enabled && has_out_endpoint; i++) {
+        if (!out_io[i].busy && submit(&out_io[i], ep_out_fd, IOCB_CMD_PREAD, USB_EP_SIZE) < 0) {
+            metric_inc(&kaos_metrics.usb_read_errors);
+            perror("Failed to queue OUT transfer");
+            break;
+        }
+    }
+}
+
+/**
+ * Queue a report received from the host
+ */
+static void rx_push(const uint8_t* data, size_t length) {
+    if (rx_count == FFS_RX_QUEUE) {
+        metric_inc(&kaos_metrics.usb_read_errors);
+        fprintf(stderr, "FunctionFS: receive queue full, report dropped\n");
+        return;
+    }
+
+    unsigned tail = (rx_head + rx_count) % FFS_RX_QUEUE;
+    if (length > PORTAL_BUFFER_SIZE) length = PORTAL_BUFFER_SIZE;
+    memcpy(rx_data[tail], data, length);
+    rx_len[tail] = length;
+    rx_count++;
+}
+
+/**
+ * Collect finished transfers and requeue OUT reads
+ */
+static void reap_completions(void) {
+    uint64_t ready;
+    if (read(event_fd, &ready, sizeof(ready)) < 0 && errno != EAGAIN) {
+        perror("FunctionFS eventfd read");
+    }
+
+    struct io_event events[FFS_OUT_DEPTH + FFS_IN_DEPTH];
+    struct timespec no_wait = { 0, 0 };
+    long n = aio_getevents(aio_ctx, 0, FFS_OUT_DEPTH + FFS_IN_DEPTH, events, &no_wait);
+
+    for (long i = 0; i < n; i++) {
+        ffs_io_t* io = (ffs_io_t*)(uintptr_t)events[i].data;
+        long res = (long)events[i].res;
+        io->busy = false;
+
+        if (io >= out_io && io < out_io + FFS_OUT_DEPTH) {
+            if (res > 0) {
+                rx_push(io->data, res);
+            } else if (res < 0 && res != -ESHUTDOWN && res != -ECONNRESET) {
+                metric_inc(&kaos_metrics.usb_read_errors);
+                fprintf(stderr, "FunctionFS OUT transfer failed: %s\n", strerror(-res));
+            }
+        } else if (res >= 0) {
+            metric_inc(&kaos_metrics.usb_reports_in);
+        } else if (res != -ESHUTDOWN && res != -ECONNRESET) {
+            metric_inc(&kaos_metrics.usb_write_errors);
+            fprintf(stderr, "FunctionFS IN transfer failed: %s\n", strerror(-res));
+        }
+    }
+
+    submit_reads();
+}
+
+/**
+ * Send the data stage of an IN control request
+ */
+static void ep0_reply(const struct usb_ctrlrequest* setup, const void* data, size_t length) {
+    size_t requested = le16toh(setup->wLength);
+    if (length > requested) length = requested;
+    if (write(ep0_fd, data, length) < 0) {
+        perror("FunctionFS ep0 write");
+    }
+    metric_inc(&kaos_metrics.usb_control_handled);
+}
+
+/**
+ * Complete an OUT control request without (more) data
+ */
+static void ep0_ack(void) {
+    if (read(ep0_fd, NULL, 0) < 0) {
+        perror("FunctionFS ep0 ack");
+    }
+    metric_inc(&kaos_metrics.usb_control_handled);
+}
+
+/**
+ * Reject a control request (reading for IN or writing for OUT halts ep0)
+ */
+static void ep0_stall(const struct usb_ctrlrequest* setup) {
+    if (setup->bRequestType & USB_DIR_IN) {
+        if (read(ep0_fd, NULL, 0) < 0 && errno != EL2HLT) perror("FunctionFS ep0 stall");
+    } else {
+        if (write(ep0_fd, NULL, 0) < 0 && errno != EL2HLT) perror("FunctionFS ep0 stall");
+    }
+    metric_inc(&kaos_metrics.usb_control_stalled);
+}
+
+/**
+ * Service a control request addressed to the HID interface
+ */
+static void handle_setup(const struct usb_ctrlrequest* setup) {
+    uint16_t value = le16toh(setup->wValue);
+
+    switch (setup->bRequestType) {
+        case USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_INTERFACE:
+            if (setup->bRequest == USB_REQ_GET_DESCRIPTOR && (value >> 8) == HID_DT_REPORT) {
+                ep0_reply(setup, report_descriptor, report_descriptor_len);
+                return;
+            }
+            if (setup->bRequest == USB_REQ_GET_DESCRIPTOR && (value >> 8) == HID_DT_HID) {
+                ep0_reply(setup, &fs_descriptors.hid, sizeof(fs_descriptors.hid));
+                return;
+            }
+            break;
+
+        case USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE:
+            switch (setup->bRequest) {
+                case HID_REQ_GET_REPORT:
+                    ep0_reply(setup, last_report, sizeof(last_report));
+                    return;
+                case HID_REQ_GET_IDLE:
+                    ep0_reply(setup, &hid_idle, 1);
+                    return;
+                case HID_REQ_GET_PROTOCOL:
+                    ep0_reply(setup, &hid_protocol, 1);
+                    return;
+            }
+            break;
+
+        case USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE:
+            switch (setup->bRequest) {
+                case HID_REQ_SET_REPORT: {
+                    // Portal commands may arrive on the control pipe instead of the OUT endpoint
+                    uint8_t data[PORTAL_BUFFER_SIZE];
+                    size_t length = le16toh(setup->wLength);
+                    if (length > sizeof(data)) length = sizeof(data);
+                    ssize_t n = read(ep0_fd, data, length);
+                    if (n < 0) {
+                        metric_inc(&kaos_metrics.usb_read_errors);
+                        perror("FunctionFS SET_REPORT");
+                        return;
+                    }
+                    if (n > 0) rx_push(data, n);
+                    metric_inc(&kaos_metrics.usb_control_handled);
+                    return;
+                }
+                case HID_REQ_SET_IDLE:
+                    hid_idle = value >> 8;
+                    ep0_ack();
+                    return;
+                case HID_REQ_SET_PROTOCOL:
+                    hid_protocol = value & 0xFF;
+                    ep0_ack();
+                    return;
+            }
+            break;
+    }
+
+    ep0_stall(setup);
+}
+
+/**
+ * Handle pending ep0 events
+ */
+static void handle_ep0(void) {
+    struct usb_functionfs_event events[4];
+    ssize_t n = read(ep0_fd, events, sizeof(events));
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EINTR) perror("FunctionFS ep0 read");
+        return;
+    }
+
+    for (size_t i = 0; i < (size_t)n / sizeof(events[0]); i++) {
+        switch (events[i].type) {
+            case FUNCTIONFS_ENABLE:
+                printf("FunctionFS: host configured the portal\n");
+                enabled = true;
+                submit_reads();
+                break;
+            case FUNCTIONFS_DISABLE:
+                printf("FunctionFS: portal deconfigured\n");
+                enabled = false;
+                break;
+            case FUNCTIONFS_SETUP:
+                handle_setup(&events[i].u.setup);
+                break;
+            case FUNCTIONFS_BIND:
+            case FUNCTIONFS_UNBIND:
+            case FUNCTIONFS_SUSPEND:
+            case FUNCTIONFS_RESUME:
+            default:
+                break;
+        }
+    }
+}
+
+/**
+ * Open the FunctionFS instance and publish the descriptors
+ */
+int usb_ffs_open(const char* mount_path, const uint8_t* report_desc, size_t report_desc_len,
+                 int interval, bool out_endpoint) {
+    char path[512];
+
+    has_out_endpoint = out_endpoint;
+    report_descriptor = report_desc;
+    report_descriptor_len = report_desc_len;
+    if (interval <= 0) interval = 1;
+    if (interval > 255) interval = 255;
+
+    snprintf(path, sizeof(path), "%s/ep0", mount_path);
+    ep0_fd = open(path, O_RDWR);
+    if (ep0_fd < 0) {
+        perror("Failed to open FunctionFS ep0");
+        fprintf(stderr, "Path: %s\n", path);
+        return -1;
+    }
+
+    if (write_descriptors(interval) < 0) {
+        usb_ffs_close();
+        return -1;
+    }
+
+    // Endpoint files appear once the descriptors are accepted (ep1 = IN, ep2 = OUT)
+    snprintf(path, sizeof(path), "%s/ep1", mount_path);
+    ep_in_fd = open(path, O_RDWR);
+    if (has_out_endpoint) {
+        snprintf(path, sizeof(path), "%s/ep2", mount_path);
+        ep_out_fd = open(path, O_RDWR);
+    }
+    if (ep_in_fd < 0 || (has_out_endpoint && ep_out_fd < 0)) {
+        perror("Failed to open FunctionFS endpoints");
+        usb_ffs_close();
+        return -1;
+    }
+
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0 || aio_setup(FFS_OUT_DEPTH + FFS_IN_DEPTH, &aio_ctx) < 0) {
+        perror("Failed to set up AIO");
+        usb_ffs_close();
+        return -1;
+    }
+
+    // Events are only read after poll() reports them
+    fcntl(ep0_fd, F_SETFL, fcntl(ep0_fd, F_GETFL) | O_NONBLOCK);
+
+    printf("FunctionFS ready at %s (bInterval %d ms, commands on %s)\n", mount_path, interval,
+           has_out_endpoint ? "interrupt OUT and SET_REPORT" : "SET_REPORT only");
+    return 0;
+}
+
+/**
+ * Close the FunctionFS instance
+ */
+void usb_ffs_close(void) {
+    enabled = false;
+
+    // Waits for cancelled transfers, so buffers are free afterwards
+    if (aio_ctx) {
+        aio_destroy(aio_ctx);
+        aio_ctx = 0;
+    }
+    for (int i = 0; i < FFS_OUT_DEPTH; i++) out_io[i].busy = false;
+    for (int i = 0; i < FFS_IN_DEPTH; i++) in_io[i].busy = false;
+    rx_head = rx_count = 0;
+
+    int* fds[] = { &event_fd, &ep_out_fd, &ep_in_fd, &ep0_fd };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (*fds[i] >= 0) {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+}
+
+/**
+ * Wait for ep0 events and transfer completions
+ */
+int usb_ffs_wait(int timeout_ms, struct pollfd* extra, int extra_count) {
+    if (ep0_fd < 0) {
+        return -1;
+    }
+    if (rx_count > 0) {
+        return 1;
+    }
+    if (extra_count > FFS_MAX_EXTRA_FDS) {
+        extra_count = FFS_MAX_EXTRA_FDS;
+    }
+
+    struct pollfd fds[2 + FFS_MAX_EXTRA_FDS] = {
+        { .fd = ep0_fd, .events = POLLIN },
+        { .fd = event_fd, .events = POLLIN },
+    };
+    for (int i = 0; i < extra_count; i++) {
+        fds[2 + i] = extra[i];
+    }
+    int rc = poll(fds, 2 + extra_count, timeout_ms);
+    if (rc < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (int i = 0; i < extra_count; i++) {
+        extra[i].revents = fds[2 + i].revents;
+    }
+
+    if (fds[0].revents & POLLIN) handle_ep0();
+    if (fds[1].revents & POLLIN) reap_completions();
+
+    return rx_count > 0 ? 1 : 0;
+}
+
+/**
+ * Get the next report from the host
+ */
+int usb_ffs_read(uint8_t* buffer, size_t max_length) {
+    if (ep0_fd < 0) {
+        return -1;
+    }
+
+    if (rx_count == 0 && usb_ffs_wait(0, NULL, 0) <= 0) {
+        metric_inc(&kaos_metrics.usb_read_eagain);
+        return 0;
+    }
+
+    size_t length = rx_len[rx_head];
+    if (length > max_length) length = max_length;
+    memcpy(buffer, rx_data[rx_head], length);
+    rx_head = (rx_head + 1) % FFS_RX_QUEUE;
+    rx_count--;
+
+    metric_inc(&kaos_metrics.usb_reports_out);
+    return length;
+}
+
+/**
+ * Queue a report on the IN endpoint
+ */
+int usb_ffs_write(const uint8_t* buffer, size_t length) {
+    if (!enabled) {
+        metric_inc(&kaos_metrics.usb_write_errors);
+        fprintf(stderr, "USB write error: host has not configured the portal\n");
+        return -1;
+    }
+
+    if (length > USB_EP_SIZE) length = USB_EP_SIZE;
+
+    ffs_io_t* io = NULL;
+    for (int pass = 0; pass < 2 && !io; pass++) {
+        if (pass == 1) reap_completions();
+        for (int i = 0; i < FFS_IN_DEPTH; i++) {
+            if (!in_io[i].busy) {
+                io = &in_io[i];
+                break;
+            }
+        }
+    }
+    if (!io) {
+        metric_inc(&kaos_metrics.usb_write_eagain);
+        fprintf(stderr, "USB write error: %d reports already in flight\n", FFS_IN_DEPTH);
+        return -1;
+    }
+
+    memcpy(io->data, buffer, length);
+    if (submit(io, ep_in_fd, IOCB_CMD_PWRITE, length) < 0) {
+        metric_inc(&kaos_metrics.usb_write_errors);
+        perror("USB write error");
+        return -1;
+    }
+
+    // GET_REPORT answers with the latest input report
+    memset(last_report, 0, sizeof(last_report));
+    memcpy(last_report, buffer, length);
+    return length;
+}
+
+/**
+ * Count writes not yet completed on the IN endpoint
+ */
+int usb_ffs_in_flight(void) {
+    reap_completions();
+    int busy = 0;
+    for (int i = 0; i < FFS_IN_DEPTH; i++) {
+        if (in_io[i].busy) busy++;
+    }
+    return busy;
+}
+
+/**
+ * Check if the endpoints are enabled
+ */
+int usb_ffs_is_enabled(void) {
+    return enabled;
+}
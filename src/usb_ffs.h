@@ -0,0 +1,68 @@
+#ifndef USB_FFS_H
+#define USB_FFS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <poll.h>
+
+/**
+ * FunctionFS (f_fs) Backend
+ * kaos-pi supplies the HID interface descriptors itself, services ep0
+ * control requests (GET_DESCRIPTOR, GET/SET_REPORT, idle, protocol) and
+ * drives the interrupt endpoints with Linux AIO completed through an eventfd.
+ * Used instead of f_hid and /dev/hidg0 when selected with usb_gadget_set_backend().
+ */
+
+#define FFS_OUT_DEPTH   4       // Reads kept queued on the OUT endpoint
+#define FFS_IN_DEPTH    4       // Writes that may be in flight on the IN endpoint
+#define FFS_RX_QUEUE    16      // Received reports waiting for usb_ffs_read()
+#define FFS_MAX_EXTRA_FDS 4     // Caller descriptors usb_ffs_wait() can poll alongside
+
+// Function Prototypes
+
+/**
+ * Open ep0 in a mounted FunctionFS instance, write the descriptors and
+ * strings and open the endpoints. Must be done before binding the UDC.
+ * interval is the endpoint polling interval in ms (0 = 1 ms); without
+ * out_endpoint the host sends every command as SET_REPORT on ep0
+ * Returns 0 on success, -1 on error
+ */
+int usb_ffs_open(const char* mount_path, const uint8_t* report_desc, size_t report_desc_len,
+                 int interval, bool out_endpoint);
+
+/**
+ * Cancel outstanding transfers and close all endpoint files
+ */
+void usb_ffs_close(void);
+
+/**
+ * Get the next report from the host (OUT endpoint or SET_REPORT)
+ * Returns number of bytes read, 0 if none is pending, -1 on error
+ */
+int usb_ffs_read(uint8_t* buffer, size_t max_length);
+
+/**
+ * Queue a report on the IN endpoint
+ * Returns number of bytes queued, -1 on error
+ */
+int usb_ffs_write(const uint8_t* buffer, size_t length);
+
+/**
+ * Count reports still in flight on the IN endpoint (completions reaped first)
+ */
+int usb_ffs_in_flight(void);
+
+/**
+ * Service ep0 and transfer completions until a report is available
+ * extra descriptors are polled too; their revents are filled in on return
+ * Returns 1 when readable, 0 on timeout or extra activity, -1 on error
+ */
+int usb_ffs_wait(int timeout_ms, struct pollfd* extra, int extra_count);
+
+/**
+ * Check if the host has configured the function (endpoints enabled)
+ */
+int usb_ffs_is_enabled(void);
+
+#endif // USB_FFS_H
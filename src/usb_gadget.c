@@ -1,4 +1,6 @@
 #include "usb_gadget.h"
+#include "usb_ffs.h"
+#include "metrics.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,6 +9,12 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <poll.h>
+#include <sys/mount.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <stdbool.h>
 
 // USB HID Report Descriptor for Skylander Portal
 // This descriptor matches the official Skylander Portal
@@ -27,9 +35,14 @@ static const uint8_t hid_report_descriptor[] = {
     0xC0,              // End Collection
 };
 
-// File descriptors
-static int hidg_fd = -1;
-static char udc_name[256] = {0};
+// Settings shared by every portal
+static int hid_interval = 0;                        // 0 = f_hid default
+static usb_backend_t backend = USB_BACKEND_HIDG;
+static usb_profile_t profile = USB_PROFILE_INTERRUPT;
+
+static const char* link_state_names[USB_LINK_STATE_COUNT] = {
+    "disconnected", "attached", "configured", "suspended"
+};
 
 /**
  * Write a string to a sysfs file
@@ -121,271 +134,901 @@ static void rmdir_recursive(const char* path) {
     rmdir(path);
 }
 
+/**
+ * Select the UDC to bind to instead of the one matching the portal number
+ */
+void usb_gadget_set_udc(usb_gadget_t* gadget, const char* name) {
+    if (!name) return;
+    strncpy(gadget->udc, name, sizeof(gadget->udc) - 1);
+    gadget->udc[sizeof(gadget->udc) - 1] = '\0';
+}
+
+/**
+ * Set the interrupt endpoint polling interval (bInterval)
+ */
+void usb_gadget_set_interval(int interval) {
+    hid_interval = interval;
+}
+
+/**
+ * Select f_hid or FunctionFS
+ */
+void usb_gadget_set_backend(usb_backend_t selected) {
+    backend = selected;
+}
+
+/**
+ * Select interrupt OUT or control (SET_REPORT) commands
+ */
+void usb_gadget_set_profile(usb_profile_t selected) {
+    profile = selected;
+}
+
+/**
+ * Skip "." and ".." when listing /sys/class/udc
+ */
+static int udc_filter(const struct dirent* entry) {
+    return entry->d_name[0] != '.';
+}
+
 /**
  * Find the USB Device Controller (UDC) name
+ * Portal n takes the n-th UDC so several portals never race for the same one
  */
-const char* usb_gadget_get_udc(void) {
-    if (udc_name[0] != '\0') {
-        return udc_name;
+const char* usb_gadget_get_udc(usb_gadget_t* gadget) {
+    if (gadget->udc[0] != '\0') {
+        return gadget->udc;
     }
     
-    DIR* dir = opendir("/sys/class/udc");
-    if (!dir) {
+    struct dirent** entries;
+    int count = scandir("/sys/class/udc", &entries, udc_filter, alphasort);
+    if (count < 0) {
         perror("Failed to open /sys/class/udc");
         return NULL;
     }
     
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_name[0] != '.') {
-            strncpy(udc_name, entry->d_name, sizeof(udc_name) - 1);
-            break;
+    if (gadget->index < count) {
+        strncpy(gadget->udc, entries[gadget->index]->d_name, sizeof(gadget->udc) - 1);
+    }
+    for (int i = 0; i < count; i++) {
+        free(entries[i]);
+    }
+    free(entries);
+    
+    if (gadget->udc[0] == '\0') {
+        if (gadget->index == 0) {
+            fprintf(stderr, "No UDC found. Is dwc2 module loaded?\n");
+        } else {
+            fprintf(stderr, "No UDC left for portal %d (%d found). Try: modprobe dummy_hcd num=%d\n",
+                    gadget->index, count, gadget->index + 1);
         }
+        return NULL;
     }
     
-    closedir(dir);
+    printf("Found UDC: %s\n", gadget->udc);
+    return gadget->udc;
+}
+
+/**
+ * Map a UDC state string (see usb_state_string()) to a link state
+ */
+static usb_link_state_t parse_link_state(const char* state) {
+    if (strcmp(state, "configured") == 0) return USB_LINK_CONFIGURED;
+    if (strcmp(state, "suspended") == 0) return USB_LINK_SUSPENDED;
+    if (state[0] == '\0' || strcmp(state, "not attached") == 0) return USB_LINK_DISCONNECTED;
+    return USB_LINK_ATTACHED;                       // attached, powered, default, addressed...
+}
+
+/**
+ * Re-read the UDC state and record a transition
+ */
+static void monitor_update(usb_gadget_t* gadget) {
+    if (gadget->udc_state_fd < 0) {
+        return;
+    }
     
-    if (udc_name[0] == '\0') {
-        fprintf(stderr, "No UDC found. Is dwc2 module loaded?\n");
-        return NULL;
+    // sysfs attributes must be re-read from the start to re-arm poll()
+    char state[64];
+    ssize_t n = pread(gadget->udc_state_fd, state, sizeof(state) - 1, 0);
+    if (n < 0) {
+        return;
     }
+    state[n] = '\0';
+    state[strcspn(state, "\n")] = '\0';
     
-    printf("Found UDC: %s\n", udc_name);
-    return udc_name;
+    usb_link_state_t next = parse_link_state(state);
+    if (next == gadget->link_state) {
+        return;
+    }
+    
+    printf("USB link (portal %d): %s -> %s\n", gadget->index,
+           link_state_names[gadget->link_state], link_state_names[next]);
+    metric_inc(&kaos_metrics.usb_link_transitions[next]);
+    metric_gauge_set(&kaos_metrics.usb_link_state[gadget->index], next);
+    gadget->link_state = next;
+    gadget->link_changed = true;
+    gadget->configured_at_us = next == USB_LINK_CONFIGURED ? metrics_now_us() : 0;
 }
 
 /**
- * Initialize USB gadget mode
+ * Handle kernel uevents; anything about the UDC or hidg re-reads the state
+ */
+static void monitor_uevents(usb_gadget_t* gadget) {
+    char message[2048];
+    bool relevant = false;
+    ssize_t n;
+    
+    while ((n = recv(gadget->uevent_fd, message, sizeof(message) - 1, 0)) > 0) {
+        message[n] = '\0';
+        if (strstr(message, "udc") || strstr(message, "hidg") || strstr(message, "gadget")) {
+            relevant = true;
+        }
+    }
+    
+    if (relevant) {
+        monitor_update(gadget);
+    }
+}
+
+/**
+ * Start watching the UDC state after binding
  */
-int usb_gadget_init(void) {
+static void monitor_open(usb_gadget_t* gadget, const char* udc) {
     char path[512];
+    snprintf(path, sizeof(path), "/sys/class/udc/%s/state", udc);
+    gadget->udc_state_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (gadget->udc_state_fd < 0) {
+        fprintf(stderr, "Warning: cannot monitor %s, host reconnects rely on read errors\n", path);
+    }
     
-    printf("Initializing USB Gadget for Skylander Portal...\n");
+    gadget->uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                               NETLINK_KOBJECT_UEVENT);
+    if (gadget->uevent_fd >= 0) {
+        struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+        if (bind(gadget->uevent_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            close(gadget->uevent_fd);
+            gadget->uevent_fd = -1;
+        }
+    }
     
-    // Check if configfs is mounted
-    struct stat st;
-    if (stat("/sys/kernel/config/usb_gadget", &st) != 0) {
-        fprintf(stderr, "USB Gadget ConfigFS not found. Is configfs mounted?\n");
-        fprintf(stderr, "Try: mount -t configfs none /sys/kernel/config\n");
+    // Initial state is not a transition
+    gadget->link_state = USB_LINK_DISCONNECTED;
+    monitor_update(gadget);
+    gadget->link_changed = false;
+    metric_gauge_set(&kaos_metrics.usb_link_state[gadget->index], gadget->link_state);
+    printf("USB link (portal %d): %s\n", gadget->index, link_state_names[gadget->link_state]);
+}
+
+/**
+ * Stop watching the UDC state
+ */
+static void monitor_close(usb_gadget_t* gadget) {
+    if (gadget->udc_state_fd >= 0) {
+        close(gadget->udc_state_fd);
+        gadget->udc_state_fd = -1;
+    }
+    if (gadget->uevent_fd >= 0) {
+        close(gadget->uevent_fd);
+        gadget->uevent_fd = -1;
+    }
+    gadget->link_state = USB_LINK_CONFIGURED;
+    gadget->link_changed = false;
+}
+
+/**
+ * Declarative gadget description, reconciled against configfs
+ */
+typedef enum {
+    ENTRY_DIR,
+    ENTRY_ATTR,
+    ENTRY_BINARY,
+    ENTRY_LINK
+} gadget_entry_kind_t;
+
+typedef struct {
+    gadget_entry_kind_t kind;
+    const char* path;                               // Relative to the gadget directory
+    const char* value;                              // ATTR: text, LINK: target (relative)
+    const uint8_t* data;                            // BINARY contents
+    size_t length;
+    bool optional;                                  // ATTR: skipped if the kernel lacks it
+} gadget_entry_t;
+
+#define GADGET_MAX_ENTRIES 40
+
+#define DIR_ENTRY(p)        (gadget_entry_t){ ENTRY_DIR, p, NULL, NULL, 0, false }
+#define ATTR_ENTRY(p, v)    (gadget_entry_t){ ENTRY_ATTR, p, v, NULL, 0, false }
+#define OPTIONAL_ENTRY(p, v) (gadget_entry_t){ ENTRY_ATTR, p, v, NULL, 0, true }
+#define LINK_ENTRY(p, t)    (gadget_entry_t){ ENTRY_LINK, p, t, NULL, 0, false }
+
+/**
+ * Read a sysfs/configfs attribute without the trailing newline
+ */
+static int read_sysfs(const char* path, char* value, size_t size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        value[0] = '\0';
         return -1;
     }
     
-    // Remove existing gadget if present
-    usb_gadget_cleanup();
-    
-    // Create gadget directory
-    if (mkdir_p(GADGET_BASE_PATH) < 0) {
+    ssize_t n = read(fd, value, size - 1);
+    close(fd);
+    if (n < 0) {
+        value[0] = '\0';
         return -1;
     }
     
-    // Set USB device class
-    snprintf(path, sizeof(path), "%s/bDeviceClass", GADGET_BASE_PATH);
-    if (write_sysfs(path, "0x00") < 0) return -1;
+    value[n] = '\0';
+    value[strcspn(value, "\n")] = '\0';
+    return 0;
+}
+
+/**
+ * Compare attribute values, numerically when both are numbers ("0x0200" == "0x200")
+ */
+static bool same_value(const char* current, const char* desired) {
+    char* end_a;
+    char* end_b;
+    long a = strtol(current, &end_a, 0);
+    long b = strtol(desired, &end_b, 0);
+    if (current[0] && desired[0] && *end_a == '\0' && *end_b == '\0') {
+        return a == b;
+    }
+    return strcmp(current, desired) == 0;
+}
+
+/**
+ * Build the desired gadget tree for the selected backend and profile
+ */
+static int gadget_entries(usb_gadget_t* gadget, gadget_entry_t* entries, int max) {
+    static char interval_value[16];
+    char path[512];
+    int n = 0;
+    
+    entries[n++] = DIR_ENTRY("");
+    entries[n++] = ATTR_ENTRY("bDeviceClass", "0x00");
+    entries[n++] = ATTR_ENTRY("bDeviceSubClass", "0x00");
+    entries[n++] = ATTR_ENTRY("bDeviceProtocol", "0x00");
+    entries[n++] = ATTR_ENTRY("idVendor", "0x1430");
+    entries[n++] = ATTR_ENTRY("idProduct", "0x0150");
+    entries[n++] = ATTR_ENTRY("bcdUSB", "0x0200");                // USB 2.0
+    entries[n++] = ATTR_ENTRY("bcdDevice", "0x0100");
+    entries[n++] = DIR_ENTRY("strings/0x409");
+    entries[n++] = ATTR_ENTRY("strings/0x409/manufacturer", USB_MANUFACTURER);
+    entries[n++] = ATTR_ENTRY("strings/0x409/product", USB_PRODUCT);
+    entries[n++] = ATTR_ENTRY("strings/0x409/serialnumber", gadget->serial);
+    entries[n++] = DIR_ENTRY("configs/c.1");
+    entries[n++] = DIR_ENTRY("configs/c.1/strings/0x409");
+    entries[n++] = ATTR_ENTRY("configs/c.1/strings/0x409/configuration", "Skylander Portal Config");
+    entries[n++] = ATTR_ENTRY("configs/c.1/MaxPower", "500");
     
-    snprintf(path, sizeof(path), "%s/bDeviceSubClass", GADGET_BASE_PATH);
-    if (write_sysfs(path, "0x00") < 0) return -1;
+    if (backend == USB_BACKEND_FFS) {
+        entries[n++] = DIR_ENTRY("functions/ffs." GADGET_FFS_INSTANCE);
+        entries[n++] = LINK_ENTRY("configs/c.1/ffs." GADGET_FFS_INSTANCE, "functions/ffs." GADGET_FFS_INSTANCE);
+        return n;
+    }
     
-    snprintf(path, sizeof(path), "%s/bDeviceProtocol", GADGET_BASE_PATH);
-    if (write_sysfs(path, "0x00") < 0) return -1;
+    entries[n++] = DIR_ENTRY("functions/hid.usb0");
+    entries[n++] = ATTR_ENTRY("functions/hid.usb0/protocol", "0");
+    entries[n++] = ATTR_ENTRY("functions/hid.usb0/subclass", "0");
+    entries[n++] = ATTR_ENTRY("functions/hid.usb0/report_length", "32");
     
-    // Set VID and PID
-    snprintf(path, sizeof(path), "%s/idVendor", GADGET_BASE_PATH);
-    if (write_sysfs(path, "0x1430") < 0) return -1;
+    // Polling interval (only newer kernels expose it)
+    if (hid_interval > 0) {
+        snprintf(interval_value, sizeof(interval_value), "%d", hid_interval);
+        entries[n++] = OPTIONAL_ENTRY("functions/hid.usb0/interval", interval_value);
+    }
     
-    snprintf(path, sizeof(path), "%s/idProduct", GADGET_BASE_PATH);
-    if (write_sysfs(path, "0x0150") < 0) return -1;
+    // Control profile: f_hid drops the OUT endpoint and queues SET_REPORT data for read()
+    // (needs Linux 5.19+; reset to 0 only where a previous run could have set it)
+    if (profile == USB_PROFILE_CONTROL) {
+        entries[n++] = ATTR_ENTRY("functions/hid.usb0/no_out_endpoint", "1");
+    } else if (snprintf(path, sizeof(path), "%s/functions/hid.usb0/no_out_endpoint",
+                        gadget->base_path) > 0 && access(path, F_OK) == 0) {
+        entries[n++] = ATTR_ENTRY("functions/hid.usb0/no_out_endpoint", "0");
+    }
     
-    // Set USB version (USB 2.0)
-    snprintf(path, sizeof(path), "%s/bcdUSB", GADGET_BASE_PATH);
-    if (write_sysfs(path, "0x0200") < 0) return -1;
+    entries[n++] = (gadget_entry_t){ ENTRY_BINARY, "functions/hid.usb0/report_desc", NULL,
+                                     hid_report_descriptor, sizeof(hid_report_descriptor), false };
+    entries[n++] = LINK_ENTRY("configs/c.1/hid.usb0", "functions/hid.usb0");
     
-    snprintf(path, sizeof(path), "%s/bcdDevice", GADGET_BASE_PATH);
-    if (write_sysfs(path, "0x0100") < 0) return -1;
+    return n <= max ? n : -1;
+}
+
+/**
+ * Compare one entry with configfs and, if apply is set, fix it
+ * Returns 1 if it differed, 0 if already correct, -1 on error
+ */
+static int reconcile_entry(usb_gadget_t* gadget, const gadget_entry_t* entry, bool apply) {
+    char path[512];
+    struct stat st;
     
-    // Create strings directory
-    snprintf(path, sizeof(path), "%s/strings/0x409", GADGET_BASE_PATH);
-    if (mkdir_p(path) < 0) return -1;
+    snprintf(path, sizeof(path), "%s%s%s", gadget->base_path, entry->path[0] ? "/" : "", entry->path);
     
-    // Set device strings
-    snprintf(path, sizeof(path), "%s/strings/0x409/manufacturer", GADGET_BASE_PATH);
-    if (write_sysfs(path, USB_MANUFACTURER) < 0) return -1;
+    switch (entry->kind) {
+        case ENTRY_DIR:
+            if (stat(path, &st) == 0) return 0;
+            if (!apply) return 1;
+            return mkdir_p(path) < 0 ? -1 : 1;
+            
+        case ENTRY_ATTR: {
+            char current[256];
+            // A missing optional attribute is no drift: checking must agree with applying
+            if (access(path, F_OK) != 0) {
+                if (entry->optional) {
+                    if (apply) {
+                        fprintf(stderr, "Warning: %s is not supported by this kernel, skipped\n",
+                                entry->path);
+                    }
+                    return 0;
+                }
+                if (!apply) return 1;
+                fprintf(stderr, "%s is not supported by this kernel\n", entry->path);
+                return -1;
+            }
+            if (read_sysfs(path, current, sizeof(current)) == 0 && same_value(current, entry->value)) {
+                return 0;
+            }
+            if (!apply) return 1;
+            return write_sysfs(path, entry->value) < 0 ? -1 : 1;
+        }
+            
+        case ENTRY_BINARY: {
+            uint8_t current[256];
+            ssize_t n = -1;
+            int fd = open(path, O_RDONLY);
+            if (fd >= 0) {
+                n = read(fd, current, sizeof(current));
+                close(fd);
+            }
+            if (n == (ssize_t)entry->length && memcmp(current, entry->data, entry->length) == 0) {
+                return 0;
+            }
+            if (!apply) return 1;
+            return write_binary_file(path, entry->data, entry->length) < 0 ? -1 : 1;
+        }
+            
+        case ENTRY_LINK: {
+            if (lstat(path, &st) == 0) return 0;
+            if (!apply) return 1;
+            char target[512];
+            snprintf(target, sizeof(target), "%s/%s", gadget->base_path, entry->value);
+            if (symlink(target, path) < 0 && errno != EEXIST) {
+                perror("Failed to link function to configuration");
+                return -1;
+            }
+            return 1;
+        }
+    }
     
-    snprintf(path, sizeof(path), "%s/strings/0x409/product", GADGET_BASE_PATH);
-    if (write_sysfs(path, USB_PRODUCT) < 0) return -1;
+    return -1;
+}
+
+/**
+ * Check whether a function directory exists
+ */
+static bool function_present(usb_gadget_t* gadget, const char* name) {
+    char path[512];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/functions/%s", gadget->base_path, name);
+    return stat(path, &st) == 0;
+}
+
+/**
+ * Unlink a function from the configuration and remove it
+ */
+static void remove_function(usb_gadget_t* gadget, const char* name) {
+    char path[512];
     
-    snprintf(path, sizeof(path), "%s/strings/0x409/serialnumber", GADGET_BASE_PATH);
-    if (write_sysfs(path, USB_SERIAL) < 0) return -1;
+    snprintf(path, sizeof(path), "%s/configs/c.1/%s", gadget->base_path, name);
+    unlink(path);
+    if (strncmp(name, "ffs.", 4) == 0) {
+        umount(FFS_MOUNT_PATH);
+    }
+    snprintf(path, sizeof(path), "%s/functions/%s", gadget->base_path, name);
+    rmdir(path);
+}
+
+/**
+ * Check whether the gadget is bound to a UDC
+ */
+static bool gadget_bound(usb_gadget_t* gadget) {
+    char path[512], current[256];
+    snprintf(path, sizeof(path), "%s/UDC", gadget->base_path);
+    return read_sysfs(path, current, sizeof(current)) == 0 && current[0] != '\0';
+}
+
+/**
+ * Wait for a device node to appear, using inotify on its directory
+ * Returns 0 once it exists, -1 when the deadline passes
+ */
+static int wait_for_device(const char* path, int inotify_fd, int timeout_ms) {
+    uint64_t deadline = metrics_now_us() + (uint64_t)timeout_ms * 1000;
     
-    // Create configuration
-    snprintf(path, sizeof(path), "%s/configs/c.1", GADGET_BASE_PATH);
-    if (mkdir_p(path) < 0) return -1;
+    while (access(path, F_OK) != 0) {
+        uint64_t now = metrics_now_us();
+        if (now >= deadline) {
+            return -1;
+        }
+        
+        // Without inotify fall back to short polls
+        int remaining_ms = (int)((deadline - now + 999) / 1000);
+        if (inotify_fd < 0) {
+            usleep(10000);
+            continue;
+        }
+        
+        struct pollfd pfd = { .fd = inotify_fd, .events = POLLIN };
+        if (poll(&pfd, 1, remaining_ms) > 0) {
+            char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            while (read(inotify_fd, events, sizeof(events)) > 0);
+        }
+    }
     
-    snprintf(path, sizeof(path), "%s/configs/c.1/strings/0x409", GADGET_BASE_PATH);
-    if (mkdir_p(path) < 0) return -1;
+    return 0;
+}
+
+/**
+ * Mount the FunctionFS instance and publish the descriptors
+ */
+static int init_ffs_function(void) {
+    if (mkdir_p(FFS_MOUNT_PATH) < 0) return -1;
+    if (mount(GADGET_FFS_INSTANCE, FFS_MOUNT_PATH, "functionfs", 0, NULL) < 0 && errno != EBUSY) {
+        perror("Failed to mount functionfs");
+        fprintf(stderr, "Is usb_f_fs available? Try: modprobe usb_f_fs\n");
+        return -1;
+    }
     
-    snprintf(path, sizeof(path), "%s/configs/c.1/strings/0x409/configuration", GADGET_BASE_PATH);
-    if (write_sysfs(path, "Skylander Portal Config") < 0) return -1;
+    if (usb_ffs_open(FFS_MOUNT_PATH, hid_report_descriptor, sizeof(hid_report_descriptor),
+                     hid_interval, profile == USB_PROFILE_INTERRUPT) < 0) {
+        return -1;
+    }
     
-    snprintf(path, sizeof(path), "%s/configs/c.1/MaxPower", GADGET_BASE_PATH);
-    if (write_sysfs(path, "500") < 0) return -1;
+    printf("USB Gadget initialized successfully (FunctionFS)\n");
+    return 0;
+}
+
+/**
+ * Find the device node of the gadget's f_hid function
+ * f_hid hands out minors in creation order, so portal n is not always hidgN;
+ * the function's dev attribute names the char device, whose uevent has DEVNAME
+ */
+static void resolve_device(usb_gadget_t* gadget) {
+    char path[512], dev[32], line[128];
     
-    // Create HID function
-    snprintf(path, sizeof(path), "%s/functions/hid.usb0", GADGET_BASE_PATH);
-    if (mkdir_p(path) < 0) return -1;
+    snprintf(gadget->device, sizeof(gadget->device), "/dev/hidg%d", gadget->index);
     
-    // Configure HID function
-    snprintf(path, sizeof(path), "%s/functions/hid.usb0/protocol", GADGET_BASE_PATH);
-    if (write_sysfs(path, "0") < 0) return -1;
+    snprintf(path, sizeof(path), "%s/functions/hid.usb0/dev", gadget->base_path);
+    if (read_sysfs(path, dev, sizeof(dev)) < 0 || dev[0] == '\0') {
+        return;
+    }
     
-    snprintf(path, sizeof(path), "%s/functions/hid.usb0/subclass", GADGET_BASE_PATH);
-    if (write_sysfs(path, "0") < 0) return -1;
+    snprintf(path, sizeof(path), "/sys/dev/char/%s/uevent", dev);
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "DEVNAME=", 8) == 0) {
+            snprintf(gadget->device, sizeof(gadget->device), "/dev/%s", line + 8);
+            break;
+        }
+    }
+    fclose(fp);
+}
+
+/**
+ * Initialize USB gadget mode
+ * Reconciles configfs against gadget_entries() and only writes what differs,
+ * so restarting on an existing tree costs a few reads instead of a rebuild
+ */
+int usb_gadget_init(usb_gadget_t* gadget, int index) {
+    printf("Initializing USB Gadget for Skylander Portal %d...\n", index);
     
-    snprintf(path, sizeof(path), "%s/functions/hid.usb0/report_length", GADGET_BASE_PATH);
-    if (write_sysfs(path, "32") < 0) return -1;
+    memset(gadget, 0, sizeof(*gadget));
+    gadget->index = index;
+    gadget->hidg_fd = -1;
+    gadget->udc_state_fd = -1;
+    gadget->uevent_fd = -1;
+    gadget->link_state = USB_LINK_CONFIGURED;
+    gadget->init_started_us = metrics_now_us();
+    if (index == 0) {
+        snprintf(gadget->base_path, sizeof(gadget->base_path), "%s/%s", GADGET_CONFIGFS_PATH, GADGET_NAME);
+    } else {
+        snprintf(gadget->base_path, sizeof(gadget->base_path), "%s/%s%d", GADGET_CONFIGFS_PATH, GADGET_NAME, index);
+    }
+    snprintf(gadget->serial, sizeof(gadget->serial), USB_SERIAL_FORMAT, index + 1);
     
-    // Write HID report descriptor
-    snprintf(path, sizeof(path), "%s/functions/hid.usb0/report_desc", GADGET_BASE_PATH);
-    if (write_binary_file(path, hid_report_descriptor, sizeof(hid_report_descriptor)) < 0) {
+    if (backend == USB_BACKEND_FFS && index > 0) {
+        fprintf(stderr, "The FunctionFS backend supports a single portal\n");
         return -1;
     }
     
-    // Link function to configuration
-    char link_src[512], link_dst[512];
-    snprintf(link_src, sizeof(link_src), "%s/functions/hid.usb0", GADGET_BASE_PATH);
-    snprintf(link_dst, sizeof(link_dst), "%s/configs/c.1/hid.usb0", GADGET_BASE_PATH);
+    // Check if configfs is mounted
+    struct stat st;
+    if (stat(GADGET_CONFIGFS_PATH, &st) != 0) {
+        fprintf(stderr, "USB Gadget ConfigFS not found. Is configfs mounted?\n");
+        fprintf(stderr, "Try: mount -t configfs none /sys/kernel/config\n");
+        return -1;
+    }
     
-    if (symlink(link_src, link_dst) < 0 && errno != EEXIST) {
-        perror("Failed to link function to configuration");
+    gadget_entry_t entries[GADGET_MAX_ENTRIES];
+    int count = gadget_entries(gadget, entries, GADGET_MAX_ENTRIES);
+    if (count < 0) {
         return -1;
     }
     
-    printf("USB Gadget initialized successfully\n");
+    // Functions must not change while bound; FunctionFS always needs fresh descriptors
+    int differences = 0;
+    for (int i = 0; i < count; i++) {
+        differences += reconcile_entry(gadget, &entries[i], false);
+    }
+    const char* function = backend == USB_BACKEND_FFS ? "ffs." GADGET_FFS_INSTANCE : "hid.usb0";
+    const char* other = backend == USB_BACKEND_FFS ? "hid.usb0" : "ffs." GADGET_FFS_INSTANCE;
+    bool stale_function = function_present(gadget, other);
+    if ((differences > 0 || stale_function || backend == USB_BACKEND_FFS) && gadget_bound(gadget)) {
+        usb_gadget_stop(gadget);
+    }
+    
+    // Drop the other backend's function if a previous run used it
+    if (stale_function) {
+        remove_function(gadget, other);
+    }
+    
+    // f_hid attributes are read-only while the function is linked into the configuration
+    if (differences > 0) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/configs/c.1/%s", gadget->base_path, function);
+        unlink(path);
+    }
+    
+    int changed = 0;
+    for (int i = 0; i < count; i++) {
+        int rc = reconcile_entry(gadget, &entries[i], true);
+        if (rc < 0) {
+            if (profile == USB_PROFILE_CONTROL && backend == USB_BACKEND_HIDG) {
+                fprintf(stderr, "Use the FunctionFS backend (-b ffs) for the control profile\n");
+            }
+            return -1;
+        }
+        changed += rc;
+    }
+    printf("USB Gadget configuration: %d of %d settings changed\n", changed, count);
+    
+    if (backend == USB_BACKEND_FFS) {
+        return init_ffs_function();
+    }
+    
+    resolve_device(gadget);
+    printf("USB Gadget initialized successfully (%s)\n", gadget->device);
     return 0;
 }
 
 /**
  * Start the USB gadget
  */
-int usb_gadget_start(void) {
+int usb_gadget_start(usb_gadget_t* gadget) {
     char path[512];
+    char current[256] = "";
     
-    const char* udc = usb_gadget_get_udc();
+    const char* udc = usb_gadget_get_udc(gadget);
     if (!udc) {
         return -1;
     }
     
     printf("Starting USB Gadget with UDC: %s\n", udc);
     
-    // Bind to UDC
-    snprintf(path, sizeof(path), "%s/UDC", GADGET_BASE_PATH);
-    if (write_sysfs(path, udc) < 0) {
+    // Watch /dev before binding so the device node cannot be missed
+    int inotify_fd = -1;
+    if (backend == USB_BACKEND_HIDG) {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd >= 0 && inotify_add_watch(inotify_fd, "/dev", IN_CREATE | IN_ATTRIB) < 0) {
+            close(inotify_fd);
+            inotify_fd = -1;
+        }
+    }
+    
+    // Bind to UDC (unless a previous run left it bound with the same configuration)
+    snprintf(path, sizeof(path), "%s/UDC", gadget->base_path);
+    read_sysfs(path, current, sizeof(current));
+    if (strcmp(current, udc) != 0 && write_sysfs(path, udc) < 0) {
         fprintf(stderr, "Failed to bind to UDC. Make sure no other gadget is active.\n");
+        if (inotify_fd >= 0) close(inotify_fd);
         return -1;
     }
     
-    // Open HID device file
-    sleep(1); // Give kernel time to create the device
+    monitor_open(gadget, udc);
+    
+    // FunctionFS endpoints are already open and come alive on ENABLE
+    if (backend == USB_BACKEND_FFS) {
+        printf("USB Gadget started successfully (FunctionFS, %.1f ms after init)\n",
+               (metrics_now_us() - gadget->init_started_us) / 1000.0);
+        return 0;
+    }
+    
+    // Open HID device file as soon as the kernel creates it
+    int rc = wait_for_device(gadget->device, inotify_fd, USB_DEVICE_TIMEOUT_MS);
+    if (inotify_fd >= 0) close(inotify_fd);
+    if (rc < 0) {
+        fprintf(stderr, "%s did not appear within %d ms\n", gadget->device, USB_DEVICE_TIMEOUT_MS);
+        return -1;
+    }
     
-    hidg_fd = open("/dev/hidg0", O_RDWR | O_NONBLOCK);
-    if (hidg_fd < 0) {
-        perror("Failed to open /dev/hidg0");
-        fprintf(stderr, "The HID gadget device was not created.\n");
+    gadget->hidg_fd = open(gadget->device, O_RDWR | O_NONBLOCK);
+    if (gadget->hidg_fd < 0) {
+        perror("Failed to open HID gadget device");
+        fprintf(stderr, "The HID gadget device %s was not created.\n", gadget->device);
         return -1;
     }
     
-    printf("USB Gadget started successfully (fd=%d)\n", hidg_fd);
+    printf("USB Gadget started successfully (%s fd=%d, %.1f ms after init)\n", gadget->device,
+           gadget->hidg_fd, (metrics_now_us() - gadget->init_started_us) / 1000.0);
     return 0;
 }
 
 /**
  * Stop the USB gadget
  */
-void usb_gadget_stop(void) {
+void usb_gadget_stop(usb_gadget_t* gadget) {
     char path[512];
     
-    if (hidg_fd >= 0) {
-        close(hidg_fd);
-        hidg_fd = -1;
+    monitor_close(gadget);
+    
+    if (gadget->hidg_fd >= 0) {
+        close(gadget->hidg_fd);
+        gadget->hidg_fd = -1;
     }
     
     // Unbind from UDC
-    snprintf(path, sizeof(path), "%s/UDC", GADGET_BASE_PATH);
+    snprintf(path, sizeof(path), "%s/UDC", gadget->base_path);
     write_sysfs(path, "");
     
-    printf("USB Gadget stopped\n");
+    // Endpoint files must be closed before the instance can be unmounted
+    if (backend == USB_BACKEND_FFS) {
+        usb_ffs_close();
+    }
+    
+    printf("USB Gadget %d stopped\n", gadget->index);
 }
 
 /**
  * Cleanup USB gadget configuration
  */
-void usb_gadget_cleanup(void) {
+void usb_gadget_cleanup(usb_gadget_t* gadget) {
+    const char* base = gadget->base_path;
     char path[512];
     
-    usb_gadget_stop();
+    usb_gadget_stop(gadget);
     
     // Unlink function from configuration
-    snprintf(path, sizeof(path), "%s/configs/c.1/hid.usb0", GADGET_BASE_PATH);
+    snprintf(path, sizeof(path), "%s/configs/c.1/hid.usb0", base);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/configs/c.1/ffs.%s", base, GADGET_FFS_INSTANCE);
     unlink(path);
     
     // Remove configuration strings
-    snprintf(path, sizeof(path), "%s/configs/c.1/strings/0x409", GADGET_BASE_PATH);
+    snprintf(path, sizeof(path), "%s/configs/c.1/strings/0x409", base);
     rmdir(path);
     
     // Remove configuration
-    snprintf(path, sizeof(path), "%s/configs/c.1", GADGET_BASE_PATH);
+    snprintf(path, sizeof(path), "%s/configs/c.1", base);
     rmdir(path);
     
-    // Remove function
-    snprintf(path, sizeof(path), "%s/functions/hid.usb0", GADGET_BASE_PATH);
+    // Remove functions
+    snprintf(path, sizeof(path), "%s/functions/hid.usb0", base);
+    rmdir(path);
+    if (gadget->index == 0) {
+        umount(FFS_MOUNT_PATH);
+    }
+    snprintf(path, sizeof(path), "%s/functions/ffs.%s", base, GADGET_FFS_INSTANCE);
     rmdir(path);
     
     // Remove strings
-    snprintf(path, sizeof(path), "%s/strings/0x409", GADGET_BASE_PATH);
+    snprintf(path, sizeof(path), "%s/strings/0x409", base);
     rmdir(path);
     
     // Remove gadget
-    rmdir(GADGET_BASE_PATH);
+    rmdir(base);
     
-    printf("USB Gadget cleaned up\n");
+    printf("USB Gadget %d cleaned up\n", gadget->index);
 }
 
 /**
  * Read data from USB host
  */
-int usb_gadget_read(uint8_t* buffer, size_t max_length) {
-    if (hidg_fd < 0) {
+int usb_gadget_read(usb_gadget_t* gadget, uint8_t* buffer, size_t max_length) {
+    if (backend == USB_BACKEND_FFS) {
+        return usb_ffs_read(buffer, max_length);
+    }
+    if (gadget->hidg_fd < 0) {
         return -1;
     }
     
-    ssize_t bytes = read(hidg_fd, buffer, max_length);
-    if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    ssize_t bytes = read(gadget->hidg_fd, buffer, max_length);
+    if (bytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            metric_inc(&kaos_metrics.usb_read_eagain);
+            return 0;
+        }
+        metric_inc(&kaos_metrics.usb_read_errors);
         perror("USB read error");
         return -1;
     }
     
-    return bytes > 0 ? bytes : 0;
+    if (bytes > 0) {
+        metric_inc(&kaos_metrics.usb_reports_out);
+    }
+    return bytes;
 }
 
 /**
- * Write data to USB host
+ * Wait until a report from the host can be read
+ */
+int usb_gadget_wait(usb_gadget_t* gadget, int timeout_ms, struct pollfd* extra, int extra_count) {
+    if (extra_count > 2) {
+        extra_count = 2;
+    }
+    
+    // Link monitor first, then the caller's descriptors
+    struct pollfd monitor[4] = {
+        { .fd = gadget->udc_state_fd, .events = POLLPRI },
+        { .fd = gadget->uevent_fd, .events = POLLIN },
+    };
+    for (int i = 0; i < extra_count; i++) {
+        monitor[2 + i] = extra[i];
+    }
+    int rc;
+    
+    if (backend == USB_BACKEND_FFS) {
+        rc = usb_ffs_wait(timeout_ms, monitor, 2 + extra_count);
+    } else {
+        // A closed hidg_fd is ignored by poll(), so this still waits for the link monitor
+        struct pollfd pfds[5] = { { .fd = gadget->hidg_fd, .events = POLLIN } };
+        for (int i = 0; i < 2 + extra_count; i++) {
+            pfds[1 + i] = monitor[i];
+        }
+        rc = poll(pfds, 3 + extra_count, timeout_ms);
+        if (rc < 0) {
+            return errno == EINTR ? 0 : -1;
+        }
+        for (int i = 0; i < 2 + extra_count; i++) {
+            monitor[i].revents = pfds[1 + i].revents;
+        }
+        if (pfds[0].revents & (POLLERR | POLLNVAL)) {
+            rc = -1;
+        } else {
+            rc = (pfds[0].revents & POLLIN) ? 1 : 0;
+        }
+    }
+    
+    for (int i = 0; i < extra_count; i++) {
+        extra[i].revents = monitor[2 + i].revents;
+    }
+    if (monitor[0].revents & (POLLPRI | POLLERR)) monitor_update(gadget);
+    if (monitor[1].revents & POLLIN) monitor_uevents(gadget);
+    return rc;
+}
+
+/**
+ * Write a report to the hidg device
+ * f_hid has a single IN request; while it is queued, wait up to USB_WRITE_TIMEOUT_MS for it
  */
-int usb_gadget_write(const uint8_t* buffer, size_t length) {
-    if (hidg_fd < 0) {
+static int hidg_write(usb_gadget_t* gadget, const uint8_t* buffer, size_t length) {
+    if (gadget->hidg_fd < 0) {
         return -1;
     }
     
-    ssize_t bytes = write(hidg_fd, buffer, length);
+    ssize_t bytes = write(gadget->hidg_fd, buffer, length);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        struct pollfd pfd = { .fd = gadget->hidg_fd, .events = POLLOUT };
+        if (poll(&pfd, 1, USB_WRITE_TIMEOUT_MS) > 0 && (pfd.revents & POLLOUT)) {
+            bytes = write(gadget->hidg_fd, buffer, length);
+        } else {
+            errno = EAGAIN;
+        }
+    }
     if (bytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            metric_inc(&kaos_metrics.usb_write_eagain);
+        } else {
+            metric_inc(&kaos_metrics.usb_write_errors);
+        }
         perror("USB write error");
         return -1;
     }
     
+    metric_inc(&kaos_metrics.usb_reports_in);
+    return bytes;
+}
+
+/**
+ * Write data to USB host
+ */
+int usb_gadget_write(usb_gadget_t* gadget, const uint8_t* buffer, size_t length) {
+    int bytes = backend == USB_BACKEND_FFS ? usb_ffs_write(buffer, length)
+                                           : hidg_write(gadget, buffer, length);
+    
+    // Reconnect latency: host configured the portal -> first answer sent
+    if (bytes > 0 && gadget->configured_at_us) {
+        uint64_t elapsed = metrics_now_us() - gadget->configured_at_us;
+        metric_observe_us(&kaos_metrics.usb_reconnect_latency, elapsed);
+        printf("First response %.1f ms after the host configured portal %d\n",
+               elapsed / 1000.0, gadget->index);
+        gadget->configured_at_us = 0;
+    }
     return bytes;
 }
 
+/**
+ * Check whether nothing is in flight on the IN endpoint
+ */
+bool usb_gadget_write_ready(usb_gadget_t* gadget) {
+    if (backend == USB_BACKEND_FFS) {
+        return usb_ffs_is_enabled() && usb_ffs_in_flight() == 0;
+    }
+    if (gadget->hidg_fd < 0) {
+        return false;
+    }
+    
+    struct pollfd pfd = { .fd = gadget->hidg_fd, .events = POLLOUT };
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLOUT);
+}
+
+/**
+ * Report a link state transition once
+ */
+bool usb_gadget_link_changed(usb_gadget_t* gadget, usb_link_state_t* state) {
+    if (!gadget->link_changed) {
+        return false;
+    }
+    gadget->link_changed = false;
+    if (state) *state = gadget->link_state;
+    return true;
+}
+
+/**
+ * Get the current link state
+ */
+usb_link_state_t usb_gadget_link_state(usb_gadget_t* gadget) {
+    return gadget->link_state;
+}
+
+/**
+ * Get a link state name
+ */
+const char* usb_gadget_link_state_name(usb_link_state_t state) {
+    return state < USB_LINK_STATE_COUNT ? link_state_names[state] : "unknown";
+}
+
+/**
+ * Reopen the hidg device after the host went away
+ */
+int usb_gadget_reopen(usb_gadget_t* gadget) {
+    // FunctionFS endpoints stay open and are re-enabled by the ENABLE event
+    if (backend == USB_BACKEND_FFS) {
+        return 0;
+    }
+    
+    if (gadget->hidg_fd >= 0) {
+        close(gadget->hidg_fd);
+    }
+    gadget->hidg_fd = open(gadget->device, O_RDWR | O_NONBLOCK);
+    if (gadget->hidg_fd < 0) {
+        perror("Failed to reopen HID gadget device");
+        return -1;
+    }
+    
+    printf("Reopened %s (fd=%d)\n", gadget->device, gadget->hidg_fd);
+    return 0;
+}
+
 /**
  * Check if USB gadget is connected
  */
-int usb_gadget_is_connected(void) {
-    return hidg_fd >= 0;
-}
\ No newline at end of file
+int usb_gadget_is_connected(usb_gadget_t* gadget) {
+    if (backend == USB_BACKEND_FFS) {
+        return usb_ffs_is_enabled();
+    }
+    return gadget->hidg_fd >= 0;
+}
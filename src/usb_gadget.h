@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
+#include <poll.h>
 
 /**
  * USB Gadget Configuration for Skylander Portal Emulation
@@ -16,7 +18,7 @@
 // USB Device Information
 #define USB_MANUFACTURER "Activision"
 #define USB_PRODUCT      "Skylands Portal"
-#define USB_SERIAL       "KAOS-PI-001"
+#define USB_SERIAL_FORMAT "KAOS-PI-%03d"   // Portal number, from 001
 
 // USB HID Report Descriptor Size
 #define HID_REPORT_DESC_SIZE 32
@@ -26,61 +28,173 @@
 #define USB_EP_OUT  0x01  // Interrupt OUT endpoint
 #define USB_EP_SIZE 32    // Max packet size
 
+// Deadline for the hidg device to appear after binding the UDC
+#define USB_DEVICE_TIMEOUT_MS 2000
+
+// How long a response may wait for the IN endpoint (e.g. behind a pumped status report)
+#define USB_WRITE_TIMEOUT_MS 20
+
 // Portal Response Buffer Size
 #define PORTAL_BUFFER_SIZE 64
 
 // USB Gadget Paths (Linux ConfigFS)
-#define GADGET_BASE_PATH "/sys/kernel/config/usb_gadget/skylander"
-#define GADGET_FUNC_PATH GADGET_BASE_PATH "/functions/hid.usb0"
-#define GADGET_CONFIG_PATH GADGET_BASE_PATH "/configs/c.1"
+// Portal 0 is gadget "skylander", portal n > 0 is "skylander<n>"
+#define GADGET_CONFIGFS_PATH "/sys/kernel/config/usb_gadget"
+#define GADGET_NAME "skylander"
+
+// FunctionFS backend (instance "kaos" mounted at FFS_MOUNT_PATH, portal 0 only)
+#define GADGET_FFS_INSTANCE "kaos"
+#define FFS_MOUNT_PATH "/dev/ffs-kaos"
+
+// Gadget function implementing the portal
+typedef enum {
+    USB_BACKEND_HIDG = 0,   // Kernel f_hid, /dev/hidg0
+    USB_BACKEND_FFS         // FunctionFS, descriptors and ep0 handled by kaos-pi
+} usb_backend_t;
+
+// Where the host sends portal commands
+typedef enum {
+    USB_PROFILE_INTERRUPT = 0,  // Interrupt OUT endpoint (SET_REPORT also accepted)
+    USB_PROFILE_CONTROL         // No OUT endpoint, HID SET_REPORT on ep0 only
+} usb_profile_t;
+
+// Host link state, from the UDC state in sysfs
+typedef enum {
+    USB_LINK_DISCONNECTED = 0,  // Not attached
+    USB_LINK_ATTACHED,          // Attached, powered, default or addressed
+    USB_LINK_CONFIGURED,        // Host selected the configuration
+    USB_LINK_SUSPENDED,
+    USB_LINK_STATE_COUNT
+} usb_link_state_t;
+
+// One emulated portal: a configfs gadget bound to its own UDC
+typedef struct {
+    int index;                                      // Portal number
+    char base_path[128];                            // configfs gadget directory
+    char serial[32];                                // iSerialNumber
+    char udc[256];                                  // Bound UDC ("" = pick by index)
+    char device[128];                               // hidg device node
+    int hidg_fd;
+    uint64_t init_started_us;
+    
+    // Link monitor (/sys/class/udc/<udc>/state, uevents as fallback)
+    int udc_state_fd;
+    int uevent_fd;
+    usb_link_state_t link_state;                    // Assumed configured when not monitored
+    bool link_changed;
+    uint64_t configured_at_us;                      // Waiting for the first response
+} usb_gadget_t;
 
 // Function Prototypes
 
 /**
- * Initialize USB gadget mode
+ * Initialize USB gadget mode for portal index
  * Configures the Pi as a Skylander Portal USB device
  * Returns 0 on success, -1 on error
  */
-int usb_gadget_init(void);
+int usb_gadget_init(usb_gadget_t* gadget, int index);
 
 /**
  * Cleanup and remove USB gadget configuration
  */
-void usb_gadget_cleanup(void);
+void usb_gadget_cleanup(usb_gadget_t* gadget);
 
 /**
  * Start the USB gadget (bind to UDC)
  * Returns 0 on success, -1 on error
  */
-int usb_gadget_start(void);
+int usb_gadget_start(usb_gadget_t* gadget);
 
 /**
  * Stop the USB gadget (unbind from UDC)
  */
-void usb_gadget_stop(void);
+void usb_gadget_stop(usb_gadget_t* gadget);
 
 /**
  * Read data from USB host
  * Returns number of bytes read, -1 on error
  */
-int usb_gadget_read(uint8_t* buffer, size_t max_length);
+int usb_gadget_read(usb_gadget_t* gadget, uint8_t* buffer, size_t max_length);
+
+/**
+ * Wait until a report from the host can be read
+ * Also services the link monitor; check usb_gadget_link_changed() afterwards
+ * extra descriptors (at most 2) are polled too; their revents are filled in
+ * Returns 1 when readable, 0 on timeout or extra activity, -1 on error
+ */
+int usb_gadget_wait(usb_gadget_t* gadget, int timeout_ms, struct pollfd* extra, int extra_count);
 
 /**
  * Write data to USB host
+ * Waits up to USB_WRITE_TIMEOUT_MS for a busy IN endpoint
  * Returns number of bytes written, -1 on error
  */
-int usb_gadget_write(const uint8_t* buffer, size_t length);
+int usb_gadget_write(usb_gadget_t* gadget, const uint8_t* buffer, size_t length);
+
+/**
+ * Check whether the IN endpoint is idle, so a write would not wait
+ * Used for unsolicited reports that must never queue up behind a response
+ */
+bool usb_gadget_write_ready(usb_gadget_t* gadget);
+
+/**
+ * Report each host link transition once
+ * Returns true and sets state if the link changed since the last call
+ */
+bool usb_gadget_link_changed(usb_gadget_t* gadget, usb_link_state_t* state);
+
+/**
+ * Get the current host link state
+ * USB_LINK_CONFIGURED when the UDC state cannot be monitored
+ */
+usb_link_state_t usb_gadget_link_state(usb_gadget_t* gadget);
+
+/**
+ * Get a printable link state name
+ */
+const char* usb_gadget_link_state_name(usb_link_state_t state);
+
+/**
+ * Reopen the HID device after a host disconnect (no-op for FunctionFS)
+ * Returns 0 on success, -1 on error
+ */
+int usb_gadget_reopen(usb_gadget_t* gadget);
 
 /**
  * Check if USB gadget is connected to host
  * Returns 1 if connected, 0 if not
  */
-int usb_gadget_is_connected(void);
+int usb_gadget_is_connected(usb_gadget_t* gadget);
+
+/**
+ * Select the UDC to bind to (e.g. "dummy_udc.0" for dummy_hcd testing)
+ * Call between usb_gadget_init() and usb_gadget_start(); by default portal n
+ * takes the n-th UDC in /sys/class/udc (sorted by name)
+ */
+void usb_gadget_set_udc(usb_gadget_t* gadget, const char* name);
+
+/**
+ * Set the HID endpoint polling interval (bInterval) used by usb_gadget_init()
+ * f_hid needs a kernel that exposes the interval attribute; 0 keeps the default
+ */
+void usb_gadget_set_interval(int interval);
+
+/**
+ * Select the gadget function; must be called before usb_gadget_init()
+ * FunctionFS supports a single portal
+ */
+void usb_gadget_set_backend(usb_backend_t backend);
+
+/**
+ * Select the command path topology; must be called before usb_gadget_init()
+ * USB_PROFILE_CONTROL needs f_hid with no_out_endpoint (Linux 5.19+) or FunctionFS
+ */
+void usb_gadget_set_profile(usb_profile_t profile);
 
 /**
  * Get the UDC (USB Device Controller) name
  * Returns the UDC name or NULL if not found
  */
-const char* usb_gadget_get_udc(void);
+const char* usb_gadget_get_udc(usb_gadget_t* gadget);
 
 #endif // USB_GADGET_H
\ No newline at end of file
@@ -1,5 +1,14 @@
+#define _GNU_SOURCE
 #include "web_server.h"
 #include "portal.h"
+#include "events.h"
+#include "persist.h"
+#include "loadout.h"
+#include "figure_cache.h"
+#include "json_writer.h"
+#include "http_parser.h"
+#include "metrics.h"
+#include "latency.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,9 +18,33 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <errno.h>
+#include <limits.h>
 #include <ctype.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/stat.h>
 
-#define WEB_SERVER_MAX_CONNECTIONS 10
+// Result of a deadline-bounded read
+#define READ_TIMEOUT -2
+
+// Admission decisions
+typedef enum {
+    ADMIT_OK,
+    ADMIT_BUSY,
+    ADMIT_PER_IP,
+    ADMIT_RATE_LIMITED
+} admit_result_t;
+
+// Route of the request being handled on this thread (for metrics)
+static _Thread_local metric_route_t current_route = METRIC_ROUTE_OTHER;
+
+// Request thread argument
+typedef struct {
+    web_server_t* server;
+    int client_fd;
+    web_client_bucket_t* bucket;                    // NULL if the client is untracked
+} client_job_t;
 
 // HTML content for the web interface
 static const char* HTML_INDEX = 
@@ -153,12 +186,13 @@ static const char* HTML_INDEX =
 "        \n"
 "        .slots {\n"
 "            display: flex;\n"
+"            flex-wrap: wrap;\n"
 "            gap: 20px;\n"
 "            margin-top: 20px;\n"
 "        }\n"
 "        \n"
 "        .slot {\n"
-"            flex: 1;\n"
+"            flex: 1 1 200px;\n"
 "            padding: 20px;\n"
 "            background: #f8f9fa;\n"
 "            border-radius: 8px;\n"
@@ -171,6 +205,25 @@ static const char* HTML_INDEX =
 "            border-color: #28a745;\n"
 "        }\n"
 "        \n"
+"        .slot.writing {\n"
+"            border-color: #f59e0b;\n"
+"        }\n"
+"        \n"
+"        .portal-info {\n"
+"            display: flex;\n"
+"            align-items: center;\n"
+"            gap: 10px;\n"
+"            color: #666;\n"
+"        }\n"
+"        \n"
+"        .led {\n"
+"            width: 18px;\n"
+"            height: 18px;\n"
+"            border-radius: 50%;\n"
+"            border: 2px solid #dee2e6;\n"
+"            background: #000;\n"
+"        }\n"
+"        \n"
 "        .slot-label {\n"
 "            font-weight: bold;\n"
 "            color: #667eea;\n"
@@ -215,6 +268,10 @@ static const char* HTML_INDEX =
 "        \n"
 "        <div class=\"card\">\n"
 "            <h2>Portal Status</h2>\n"
+"            <div class=\"portal-info\">\n"
+"                <div class=\"led\" id=\"portalLed\"></div>\n"
+"                <span id=\"portalState\">Idle</span>\n"
+"            </div>\n"
 "            <div class=\"slots\" id=\"slotsContainer\">\n"
 "                <div class=\"slot\">\n"
 "                    <div class=\"slot-label\">Slot 1</div>\n"
@@ -276,6 +333,9 @@ static const char* HTML_INDEX =
 "            }\n"
 "        }\n"
 "        \n"
+"        // Served at / or /portal/{n}/; requests stay in the same namespace\n"
+"        const base = location.pathname.replace(/\\/$/, '');\n"
+"        \n"
 "        function showStatus(message, isError = false) {\n"
 "            const status = document.getElementById('statusMessage');\n"
 "            status.textContent = message;\n"
@@ -287,7 +347,7 @@ static const char* HTML_INDEX =
 "            const formData = new FormData();\n"
 "            formData.append('file', file);\n"
 "            \n"
-"            fetch('/upload', {\n"
+"            fetch(base + '/upload', {\n"
 "                method: 'POST',\n"
 "                body: formData\n"
 "            })\n"
@@ -301,9 +361,17 @@ static const char* HTML_INDEX =
 "            });\n"
 "        }\n"
 "        \n"
-"        function loadFileList() {\n"
-"            fetch('/list')\n"
+"        function fetchFileList(cursor, files) {\n"
+"            return fetch(base + '/list?limit=500' + (cursor ? '&cursor=' + cursor : ''))\n"
 "            .then(response => response.json())\n"
+"            .then(page => {\n"
+"                files = files.concat(page.files.map(file => file.name));\n"
+"                return page.next_cursor ? fetchFileList(page.next_cursor, files) : files;\n"
+"            });\n"
+"        }\n"
+"        \n"
+"        function loadFileList() {\n"
+"            fetchFileList(null, [])\n"
 "            .then(files => {\n"
 "                const container = document.getElementById('fileListContainer');\n"
 "                if (files.length === 0) {\n"
@@ -328,7 +396,7 @@ static const char* HTML_INDEX =
 "        }\n"
 "        \n"
 "        function loadSkylander(filename, slot) {\n"
-"            fetch(`/load?file=${encodeURIComponent(filename)}&slot=${slot}`, { method: 'POST' })\n"
+"            fetch(`${base}/load?file=${encodeURIComponent(filename)}&slot=${slot}`, { method: 'POST' })\n"
 "            .then(response => response.text())\n"
 "            .then(data => {\n"
 "                showStatus(`Loaded ${filename} into slot ${slot + 1}`);\n"
@@ -342,7 +410,7 @@ static const char* HTML_INDEX =
 "        function deleteFile(filename) {\n"
 "            if (!confirm(`Delete ${filename}?`)) return;\n"
 "            \n"
-"            fetch(`/delete?file=${encodeURIComponent(filename)}`, { method: 'POST' })\n"
+"            fetch(`${base}/delete?file=${encodeURIComponent(filename)}`, { method: 'POST' })\n"
 "            .then(response => response.text())\n"
 "            .then(data => {\n"
 "                showStatus('Deleted: ' + filename);\n"
@@ -353,92 +421,121 @@ static const char* HTML_INDEX =
 "            });\n"
 "        }\n"
 "        \n"
+"        let portalState = { state: 'idle', led: { r: 0, g: 0, b: 0 }, slots: [] };\n"
+"        \n"
+"        function renderPortalStatus() {\n"
+"            const container = document.getElementById('slotsContainer');\n"
+"            let html = '';\n"
+"            // Player slots always, the rest (trap, loadouts) when occupied\n"
+"            for (let i = 0; i < Math.max(2, portalState.slots.length); i++) {\n"
+"                const slot = portalState.slots[i];\n"
+"                const active = slot && slot.active;\n"
+"                if (i >= 2 && !active) continue;\n"
+"                html += `\n"
+"                    <div class=\"slot ${active ? 'active' : ''}\" id=\"slot${i}\">\n"
+"                        <div class=\"slot-label\">Slot ${i + 1}</div>\n"
+"                        <div class=\"slot-name\">${active ? slot.filename : 'Empty'}</div>\n"
+"                    </div>\n"
+"                `;\n"
+"            }\n"
+"            container.innerHTML = html;\n"
+"            \n"
+"            const led = portalState.led;\n"
+"            document.getElementById('portalState').textContent =\n"
+"                portalState.state === 'active' ? 'Active' : 'Idle';\n"
+"            document.getElementById('portalLed').style.background =\n"
+"                `rgb(${led.r}, ${led.g}, ${led.b})`;\n"
+"        }\n"
+"        \n"
 "        function updatePortalStatus() {\n"
-"            fetch('/status')\n"
+"            fetch(base + '/status')\n"
 "            .then(response => response.json())\n"
 "            .then(data => {\n"
-"                const container = document.getElementById('slotsContainer');\n"
-"                let html = '';\n"
-"                for (let i = 0; i < 2; i++) {\n"
-"                    const slot = data.slots[i];\n"
-"                    const active = slot && slot.active;\n"
-"                    html += `\n"
-"                        <div class=\"slot ${active ? 'active' : ''}\">\n"
-"                            <div class=\"slot-label\">Slot ${i + 1}</div>\n"
-"                            <div class=\"slot-name\">${active ? slot.filename : 'Empty'}</div>\n"
-"                        </div>\n"
-"                    `;\n"
-"                }\n"
-"                container.innerHTML = html;\n"
+"                portalState = data;\n"
+"                renderPortalStatus();\n"
 "            })\n"
 "            .catch(error => console.error('Status update failed:', error));\n"
 "        }\n"
 "        \n"
+"        function subscribeEvents() {\n"
+"            const events = new EventSource(base + '/events');\n"
+"            events.addEventListener('status', (e) => {\n"
+"                portalState = JSON.parse(e.data);\n"
+"                renderPortalStatus();\n"
+"            });\n"
+"            events.addEventListener('slot', (e) => {\n"
+"                const slot = JSON.parse(e.data);\n"
+"                portalState.slots[slot.slot] = slot;\n"
+"                renderPortalStatus();\n"
+"            });\n"
+"            events.addEventListener('portal', (e) => {\n"
+"                portalState.state = JSON.parse(e.data).state;\n"
+"                renderPortalStatus();\n"
+"            });\n"
+"            events.addEventListener('color', (e) => {\n"
+"                portalState.led = JSON.parse(e.data);\n"
+"                renderPortalStatus();\n"
+"            });\n"
+"            events.addEventListener('write', (e) => {\n"
+"                const el = document.getElementById('slot' + JSON.parse(e.data).slot);\n"
+"                if (!el) return;\n"
+"                el.classList.add('writing');\n"
+"                setTimeout(() => el.classList.remove('writing'), 300);\n"
+"            });\n"
+"        }\n"
+"        \n"
 "        // Initial load\n"
 "        loadFileList();\n"
-"        updatePortalStatus();\n"
-"        setInterval(updatePortalStatus, 5000);\n"
+"        if (window.EventSource) {\n"
+"            subscribeEvents();\n"
+"        } else {\n"
+"            updatePortalStatus();\n"
+"            setInterval(updatePortalStatus, 5000);\n"
+"        }\n"
 "    </script>\n"
 "</body>\n"
 "</html>";
 
 /**
- * URL decode helper
- */
-static void url_decode(char* dst, const char* src) {
-    char a, b;
-    while (*src) {
-        if ((*src == '%') && ((a = src[1]) && (b = src[2])) && (isxdigit(a) && isxdigit(b))) {
-            if (a >= 'a') a -= 'a' - 'A';
-            if (a >= 'A') a -= ('A' - 10);
-            else a -= '0';
-            if (b >= 'a') b -= 'a' - 'A';
-            if (b >= 'A') b -= ('A' - 10);
-            else b -= '0';
-            *dst++ = 16 * a + b;
-            src += 3;
-        } else if (*src == '+') {
-            *dst++ = ' ';
-            src++;
-        } else {
-            *dst++ = *src++;
+ * Get monotonic time in milliseconds
+ */
+static int64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Read from a socket, giving up at an absolute deadline
+ * Returns bytes read, 0 on EOF, -1 on error, READ_TIMEOUT on timeout
+ */
+static ssize_t read_deadline(int fd, char* buf, size_t len, int64_t deadline_ms) {
+    for (;;) {
+        int64_t remaining = deadline_ms - monotonic_ms();
+        if (remaining <= 0) return READ_TIMEOUT;
+        
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int rc = poll(&pfd, 1, (int)remaining);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            return -1;
         }
+        if (rc == 0) return READ_TIMEOUT;
+        
+        ssize_t bytes = read(fd, buf, len);
+        if (bytes < 0 && errno == EINTR) continue;
+        return bytes;
     }
-    *dst = '\0';
 }
 
 /**
- * Get query parameter value
+ * Count a request timeout
  */
-static char* get_query_param(const char* query, const char* param) {
-    if (!query || !param) return NULL;
-    
-    char search[256];
-    snprintf(search, sizeof(search), "%s=", param);
-    
-    const char* pos = strstr(query, search);
-    if (!pos) return NULL;
-    
-    pos += strlen(search);
-    const char* end = strchr(pos, '&');
-    size_t len = end ? (size_t)(end - pos) : strlen(pos);
-    
-    char* value = malloc(len + 1);
-    if (!value) return NULL;
-    
-    strncpy(value, pos, len);
-    value[len] = '\0';
-    
-    char* decoded = malloc(len + 1);
-    if (!decoded) {
-        free(value);
-        return NULL;
-    }
-    
-    url_decode(decoded, value);
-    free(value);
-    
-    return decoded;
+static void count_timeout(web_server_t* server, bool in_body) {
+    pthread_mutex_lock(&server->lock);
+    if (in_body) server->stats.body_timeouts++;
+    else server->stats.header_timeouts++;
+    pthread_mutex_unlock(&server->lock);
 }
 
 /**
@@ -449,6 +546,8 @@ static void send_response(int client_fd, int status_code, const char* status_tex
     char header[2048];
     size_t body_len = body ? strlen(body) : 0;
     
+    metrics_http_response(current_route, status_code);
+    
     snprintf(header, sizeof(header),
         "HTTP/1.1 %d %s\r\n"
         "Content-Type: %s\r\n"
@@ -464,21 +563,154 @@ static void send_response(int client_fd, int status_code, const char* status_tex
     }
 }
 
+/**
+ * Send HTTP headers for a chunked response
+ * The body follows as chunks written by a streaming json_writer_t
+ */
+static void send_chunked_headers(int client_fd, int status_code, const char* status_text,
+                                 const char* content_type) {
+    char header[512];
+    
+    metrics_http_response(current_route, status_code);
+    
+    snprintf(header, sizeof(header),
+        "HTTP/1.1 %d %s\r\n"
+        "Content-Type: %s\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "Connection: close\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "\r\n",
+        status_code, status_text, content_type);
+    
+    write(client_fd, header, strlen(header));
+}
+
+/**
+ * Parse a slot parameter; every slot of the portal is valid, not only the players'
+ * Returns the slot, or -1 if value is not one
+ */
+static int parse_slot(const char* value) {
+    if (!value) return -1;
+    
+    char* end;
+    long slot = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || slot < 0 || slot >= MAX_SKYLANDERS) {
+        return -1;
+    }
+    return (int)slot;
+}
+
+/**
+ * Hand a management action to the portal thread and wait until it is applied,
+ * so the response and a following /status reflect it
+ * Returns 0 once applied, 1 if queued but not applied within the flush
+ * timeout (it still will be), -1 if the queue is full
+ */
+static int post_to_portal(web_server_t* server, int portal, const portal_msg_t* msg) {
+    portal_queue_t* queue = &server->queues[portal];
+    if (portal_queue_post(queue, msg) != 0) {
+        return -1;
+    }
+    return portal_queue_flush(queue) == 0 ? 0 : 1;
+}
+
+/**
+ * Answer a management request from the result of post_to_portal()
+ */
+static void send_posted(int client_fd, int posted, const char* message) {
+    if (posted == 0) {
+        send_response(client_fd, 200, "OK", "text/plain", message);
+    } else if (posted > 0) {
+        send_response(client_fd, 202, "Accepted", "text/plain", "Queued");
+    } else {
+        send_response(client_fd, 503, "Service Unavailable", "text/plain", "Portal busy");
+    }
+}
+
+// /list sort keys
+typedef enum {
+    LIST_SORT_NAME,
+    LIST_SORT_SIZE,
+    LIST_SORT_MTIME
+} list_sort_t;
+
+// /list fields
+#define LIST_FIELD_NAME     0x01
+#define LIST_FIELD_SIZE     0x02
+#define LIST_FIELD_MTIME    0x04
+
+// Sorted library listing shared by /list pages, rebuilt when the library changes
+static struct {
+    pthread_mutex_t lock;
+    bool valid;
+    list_sort_t sort;
+    bool with_stat;                                 // Entries carry size and mtime
+    uint64_t token;                                 // figure_cache_token() when listed
+    struct timespec dir_mtime;                      // Library directory mtime when listed
+    skylander_file_t* files;                        // Ascending
+    int count;
+} list_index = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * Drop the /list index (after the web server changed the library itself)
+ */
+static void list_index_invalidate(void) {
+    pthread_mutex_lock(&list_index.lock);
+    list_index.valid = false;
+    pthread_mutex_unlock(&list_index.lock);
+}
+
+/**
+ * Put an uploaded figure straight on a slot from the request buffer
+ * The library copy is written by the persist thread afterwards
+ */
+static void upload_to_slot(web_server_t* server, int portal, int client_fd, int slot,
+                           const char* filename, const uint8_t* data) {
+    if (slot < 0) {
+        send_response(client_fd, 400, "Bad Request", "text/plain", "Invalid slot");
+        return;
+    }
+    if (!portal_is_valid_extension(filename)) {
+        send_response(client_fd, 400, "Bad Request", "text/plain", "Invalid file extension");
+        return;
+    }
+    if (!portal_is_valid_figure(data)) {
+        send_response(client_fd, 400, "Bad Request", "text/plain", "Not a figure dump");
+        return;
+    }
+    
+    char filepath[512];
+    snprintf(filepath, sizeof(filepath), "%s/%s", PORTAL_LIBRARY_DIR, filename);
+    if (persist_write(filepath, data, SKYLANDER_DATA_SIZE) != 0) {
+        send_response(client_fd, 503, "Service Unavailable", "text/plain", "Storage busy");
+        return;
+    }
+    
+    portal_msg_t msg = { .type = PORTAL_MSG_LOAD, .slot = slot };
+    memcpy(msg.data, data, SKYLANDER_DATA_SIZE);
+    snprintf(msg.name, sizeof(msg.name), "%s", filename);
+    int posted = post_to_portal(server, portal, &msg);
+    if (posted >= 0) {
+        printf("SUCCESS: Uploaded %s into slot %d (saving in the background)\n", filename, slot);
+    }
+    send_posted(client_fd, posted, "Uploaded and loaded");
+}
+
 /**
  * Handle file upload
  */
-static void handle_upload(web_server_t* server, int client_fd, const char* headers, size_t total_len) {
-    printf("Upload request received, total length: %zu\n", total_len);
+static void handle_upload(web_server_t* server, int portal, int client_fd, const http_request_t* req,
+                          const char* body, size_t body_len) {
+    printf("Upload request received, body length: %zu\n", body_len);
     
-    // Find Content-Type header to get boundary
-    const char* content_type = strstr(headers, "Content-Type:");
-    if (!content_type) {
+    // Get boundary from Content-Type header
+    if (req->content_type.len == 0) {
         printf("ERROR: No Content-Type header found\n");
         send_response(client_fd, 400, "Bad Request", "text/plain", "No Content-Type");
         return;
     }
     
-    const char* boundary_start = strstr(content_type, "boundary=");
+    const char* boundary_start = memmem(req->content_type.ptr, req->content_type.len, "boundary=", 9);
     if (!boundary_start) {
         printf("ERROR: No boundary found in Content-Type\n");
         send_response(client_fd, 400, "Bad Request", "text/plain", "No boundary in Content-Type");
@@ -487,10 +719,10 @@ static void handle_upload(web_server_t* server, int client_fd, const char* heade
     
     // Extract boundary (skip "boundary=")
     boundary_start += 9;
+    const char* content_type_end = req->content_type.ptr + req->content_type.len;
     char boundary[128];
     size_t i = 0;
-    while (i < sizeof(boundary) - 1 && boundary_start[i] && 
-           boundary_start[i] != '\r' && boundary_start[i] != '\n' && 
+    while (i < sizeof(boundary) - 1 && boundary_start + i < content_type_end &&
            boundary_start[i] != ';' && boundary_start[i] != ' ') {
         boundary[i] = boundary_start[i];
         i++;
@@ -498,17 +730,10 @@ static void handle_upload(web_server_t* server, int client_fd, const char* heade
     boundary[i] = '\0';
     printf("Boundary: [%s]\n", boundary);
     
-    // Find the body (after headers)
-    const char* body = strstr(headers, "\r\n\r\n");
-    if (!body) {
-        printf("ERROR: No body separator found\n");
-        send_response(client_fd, 400, "Bad Request", "text/plain", "No body separator");
-        return;
-    }
-    body += 4;
+    const char* body_end = body + body_len;
     
     // Find filename in body
-    const char* filename_start = strstr(body, "filename=\"");
+    const char* filename_start = memmem(body, body_len, "filename=\"", 10);
     if (!filename_start) {
         printf("ERROR: No filename found in body\n");
         send_response(client_fd, 400, "Bad Request", "text/plain", "No filename in upload");
@@ -516,7 +741,7 @@ static void handle_upload(web_server_t* server, int client_fd, const char* heade
     }
     
     filename_start += 10;
-    const char* filename_end = strchr(filename_start, '"');
+    const char* filename_end = memchr(filename_start, '"', body_end - filename_start);
     if (!filename_end) {
         send_response(client_fd, 400, "Bad Request", "text/plain", "Invalid filename format");
         return;
@@ -525,12 +750,12 @@ static void handle_upload(web_server_t* server, int client_fd, const char* heade
     char filename[256];
     size_t name_len = filename_end - filename_start;
     if (name_len >= sizeof(filename)) name_len = sizeof(filename) - 1;
-    strncpy(filename, filename_start, name_len);
+    memcpy(filename, filename_start, name_len);
     filename[name_len] = '\0';
     printf("Filename: [%s]\n", filename);
     
     // Find file data (after Content-Type line and blank line in the part)
-    const char* data_start = strstr(filename_end, "\r\n\r\n");
+    const char* data_start = memmem(filename_end, body_end - filename_end, "\r\n\r\n", 4);
     if (!data_start) {
         printf("ERROR: No data separator found after filename\n");
         send_response(client_fd, 400, "Bad Request", "text/plain", "No data separator");
@@ -538,32 +763,14 @@ static void handle_upload(web_server_t* server, int client_fd, const char* heade
     }
     data_start += 4;
     
-    // Find end boundary - try multiple formats
-    const char* data_end = NULL;
+    // Find end boundary (file data is binary, so search by length)
     char boundary_end[256];
-    
-    // Try format: \r\n--boundary--
-    snprintf(boundary_end, sizeof(boundary_end), "\r\n--%s--", boundary);
-    data_end = strstr(data_start, boundary_end);
-    
-    // Try format: \r\n--boundary
-    if (!data_end) {
-        snprintf(boundary_end, sizeof(boundary_end), "\r\n--%s", boundary);
-        data_end = strstr(data_start, boundary_end);
-    }
-    
-    // Try format: --boundary (without \r\n)
-    if (!data_end) {
-        snprintf(boundary_end, sizeof(boundary_end), "--%s", boundary);
-        data_end = strstr(data_start, boundary_end);
-    }
+    int boundary_end_len = snprintf(boundary_end, sizeof(boundary_end), "\r\n--%s", boundary);
+    const char* data_end = memmem(data_start, body_end - data_start, boundary_end, boundary_end_len);
     
     if (!data_end) {
         printf("ERROR: No end boundary found\n");
         printf("Looking for boundary: [%s]\n", boundary);
-        printf("Data starts at offset: %ld\n", data_start - headers);
-        printf("First 200 chars of data:\n%.200s\n", data_start);
-        printf("Last 200 chars of request:\n%.200s\n", headers + total_len - 200);
         send_response(client_fd, 400, "Bad Request", "text/plain", "No end boundary");
         return;
     }
@@ -580,9 +787,23 @@ static void handle_upload(web_server_t* server, int client_fd, const char* heade
         return;
     }
     
-    // Save file to /var/lib/kaos-pi/skylanders/
+    // Files live directly in the library
+    if (filename[0] == '\0' || strchr(filename, '/') || strcmp(filename, "..") == 0) {
+        send_response(client_fd, 400, "Bad Request", "text/plain", "Invalid filename");
+        return;
+    }
+    
+    char* slot_str = http_query_param(req->query, "slot");
+    if (slot_str) {
+        int slot = parse_slot(slot_str);
+        free(slot_str);
+        upload_to_slot(server, portal, client_fd, slot, filename, (const uint8_t*)data_start);
+        return;
+    }
+    
+    // Save file to the library shared by all portals
     char filepath[512];
-    snprintf(filepath, sizeof(filepath), "/var/lib/kaos-pi/skylanders/%s", filename);
+    snprintf(filepath, sizeof(filepath), "%s/%s", PORTAL_LIBRARY_DIR, filename);
     
     printf("Saving to: %s\n", filepath);
     FILE* fp = fopen(filepath, "wb");
@@ -602,38 +823,217 @@ static void handle_upload(web_server_t* server, int client_fd, const char* heade
         return;
     }
     
+    list_index_invalidate();
     printf("SUCCESS: Uploaded file: %s (%zu bytes)\n", filename, data_len);
     send_response(client_fd, 200, "OK", "text/plain", "Upload successful");
 }
 
+static int compare_file_name(const void* a, const void* b) {
+    const skylander_file_t* fa = a;
+    const skylander_file_t* fb = b;
+    return strcmp(fa->name, fb->name);
+}
+
+static int compare_file_size(const void* a, const void* b) {
+    const skylander_file_t* fa = a;
+    const skylander_file_t* fb = b;
+    if (fa->size != fb->size) return fa->size < fb->size ? -1 : 1;
+    return strcmp(fa->name, fb->name);
+}
+
+static int compare_file_mtime(const void* a, const void* b) {
+    const skylander_file_t* fa = a;
+    const skylander_file_t* fb = b;
+    if (fa->mtime != fb->mtime) return fa->mtime < fb->mtime ? -1 : 1;
+    return strcmp(fa->name, fb->name);
+}
+
+/**
+ * Parse the /list fields parameter (comma separated)
+ */
+static int parse_list_fields(const char* fields) {
+    if (!fields) return LIST_FIELD_NAME;
+    
+    int mask = 0;
+    const char* p = fields;
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        if (len == 4 && strncmp(p, "name", 4) == 0) mask |= LIST_FIELD_NAME;
+        else if (len == 4 && strncmp(p, "size", 4) == 0) mask |= LIST_FIELD_SIZE;
+        else if (len == 5 && strncmp(p, "mtime", 5) == 0) mask |= LIST_FIELD_MTIME;
+        p += len;
+        if (*p == ',') p++;
+    }
+    
+    return mask ? mask : LIST_FIELD_NAME;
+}
+
+/**
+ * Parse a non-negative count parameter
+ * Returns the value, or -1 if value is not a number in [min, max]
+ */
+static long parse_count(const char* value, long min, long max) {
+    char* end;
+    errno = 0;
+    long n = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || errno == ERANGE || n < min || n > max) {
+        return -1;
+    }
+    return n;
+}
+
+/**
+ * Copy a page of the sorted library listing, rebuilding the index first if
+ * the library changed: a new directory mtime catches files added, removed
+ * or renamed into place, the figure cache token any change it watched
+ * Returns the page (free with portal_free_skylander_files), count = library size
+ */
+static skylander_file_t* list_index_page(list_sort_t sort, bool with_stat, bool descending,
+                                         long cursor, long limit, int* count, long* page_len) {
+    struct stat dir_st;
+    memset(&dir_st, 0, sizeof(dir_st));
+    stat(PORTAL_LIBRARY_DIR, &dir_st);
+    uint64_t token = figure_cache_token();
+    
+    pthread_mutex_lock(&list_index.lock);
+    if (!list_index.valid || list_index.sort != sort || (with_stat && !list_index.with_stat) ||
+        list_index.token != token ||
+        list_index.dir_mtime.tv_sec != dir_st.st_mtim.tv_sec ||
+        list_index.dir_mtime.tv_nsec != dir_st.st_mtim.tv_nsec) {
+        portal_free_skylander_files(list_index.files, list_index.count);
+        list_index.files = portal_list_skylander_files(NULL, with_stat, &list_index.count);
+        
+        int (*compare)(const void*, const void*) = compare_file_name;
+        if (sort == LIST_SORT_SIZE) compare = compare_file_size;
+        else if (sort == LIST_SORT_MTIME) compare = compare_file_mtime;
+        if (list_index.count > 1) {
+            qsort(list_index.files, list_index.count, sizeof(skylander_file_t), compare);
+        }
+        
+        list_index.sort = sort;
+        list_index.with_stat = with_stat;
+        list_index.token = token;
+        list_index.dir_mtime = dir_st.st_mtim;
+        list_index.valid = true;
+    }
+    
+    // Clamped first so cursor + limit cannot overflow
+    *count = list_index.count;
+    if (cursor > *count) cursor = *count;
+    long n = *count - cursor < limit ? *count - cursor : limit;
+    
+    skylander_file_t* page = n > 0 ? calloc(n, sizeof(skylander_file_t)) : NULL;
+    *page_len = 0;
+    for (long i = 0; page && i < n; i++) {
+        long at = descending ? *count - 1 - (cursor + i) : cursor + i;
+        page[i] = list_index.files[at];
+        page[i].name = strdup(list_index.files[at].name);
+        if (!page[i].name) break;
+        (*page_len)++;
+    }
+    pthread_mutex_unlock(&list_index.lock);
+    return page;
+}
+
 /**
  * Handle file list request
+ * Query: cursor=N, limit=N, sort=name|size|mtime, order=asc|desc,
+ *        fields=name,size,mtime
  */
-static void handle_list(web_server_t* server, int client_fd) {
+static void handle_list(web_server_t* server, int client_fd, http_slice_t query) {
+    (void)server;
+    
+    char* sort_str = http_query_param(query, "sort");
+    char* order_str = http_query_param(query, "order");
+    char* fields_str = http_query_param(query, "fields");
+    char* limit_str = http_query_param(query, "limit");
+    char* cursor_str = http_query_param(query, "cursor");
+    
+    list_sort_t sort = LIST_SORT_NAME;
+    if (sort_str && strcmp(sort_str, "size") == 0) sort = LIST_SORT_SIZE;
+    else if (sort_str && strcmp(sort_str, "mtime") == 0) sort = LIST_SORT_MTIME;
+    
+    bool descending = order_str && strcmp(order_str, "desc") == 0;
+    int fields = parse_list_fields(fields_str);
+    
+    long limit = limit_str ? parse_count(limit_str, 1, LONG_MAX) : WEB_SERVER_LIST_DEFAULT_LIMIT;
+    if (limit > WEB_SERVER_LIST_MAX_LIMIT) limit = WEB_SERVER_LIST_MAX_LIMIT;
+    long cursor = cursor_str ? parse_count(cursor_str, 0, LONG_MAX) : 0;
+    
+    free(sort_str);
+    free(order_str);
+    free(fields_str);
+    free(limit_str);
+    free(cursor_str);
+    
+    if (limit < 0 || cursor < 0) {
+        send_response(client_fd, 400, "Bad Request", "text/plain",
+                      limit < 0 ? "Invalid limit" : "Invalid cursor");
+        return;
+    }
+    
+    // Only stat the directory entries when the result needs it
+    bool with_stat = sort != LIST_SORT_NAME || (fields & (LIST_FIELD_SIZE | LIST_FIELD_MTIME));
+    
+    // Copy the page out of the index so the client is streamed to unlocked
     int count = 0;
-    char** files = portal_list_skylanders(&count);
+    long page_len = 0;
+    skylander_file_t* page = list_index_page(sort, with_stat, descending, cursor, limit,
+                                             &count, &page_len);
+    if (cursor > count) cursor = count;
+    long end = cursor + page_len;
+    
+    send_chunked_headers(client_fd, 200, "OK", "application/json");
+    
+    json_writer_t w;
+    json_writer_init(&w, client_fd);
+    json_begin_object(&w);
+    
+    json_key(&w, "files");
+    json_begin_array(&w);
+    for (long i = 0; i < page_len; i++) {
+        json_begin_object(&w);
+        if (fields & LIST_FIELD_NAME) {
+            json_key(&w, "name");
+            json_string(&w, page[i].name);
+        }
+        if (fields & LIST_FIELD_SIZE) {
+            json_key(&w, "size");
+            json_int(&w, page[i].size);
+        }
+        if (fields & LIST_FIELD_MTIME) {
+            json_key(&w, "mtime");
+            json_int(&w, (long long)page[i].mtime);
+        }
+        json_end_object(&w);
+    }
+    json_end_array(&w);
     
-    char json[4096] = "[";
-    for (int i = 0; i < count; i++) {
-        if (i > 0) strcat(json, ",");
-        strcat(json, "\"");
-        strcat(json, files[i]);
-        strcat(json, "\"");
-        free(files[i]);
+    json_key(&w, "total");
+    json_int(&w, count);
+    
+    json_key(&w, "next_cursor");
+    if (end < count) {
+        char next[24];
+        snprintf(next, sizeof(next), "%ld", end);
+        json_string(&w, next);
+    } else {
+        json_null(&w);
     }
-    strcat(json, "]");
     
-    if (files) free(files);
+    json_end_object(&w);
+    json_writer_finish(&w);
+    json_writer_free(&w);
     
-    send_response(client_fd, 200, "OK", "application/json", json);
+    portal_free_skylander_files(page, (int)page_len);
 }
 
 /**
  * Handle Skylander load request
  */
-static void handle_load(web_server_t* server, int client_fd, const char* query) {
-    char* filename = get_query_param(query, "file");
-    char* slot_str = get_query_param(query, "slot");
+static void handle_load(web_server_t* server, int portal, int client_fd, http_slice_t query) {
+    char* filename = http_query_param(query, "file");
+    char* slot_str = http_query_param(query, "slot");
     
     if (!filename || !slot_str) {
         send_response(client_fd, 400, "Bad Request", "text/plain", "Missing parameters");
@@ -642,29 +1042,223 @@ static void handle_load(web_server_t* server, int client_fd, const char* query)
         return;
     }
     
-    int slot = atoi(slot_str);
+    int slot = parse_slot(slot_str);
     free(slot_str);
     
-    if (slot < 0 || slot >= 2) {
+    if (slot < 0) {
         send_response(client_fd, 400, "Bad Request", "text/plain", "Invalid slot");
         free(filename);
         return;
     }
     
-    if (portal_load_skylander(server->portal, slot, filename) == 0) {
-        send_response(client_fd, 200, "OK", "text/plain", "Loaded successfully");
-    } else {
+    // File I/O happens here; the portal thread only gets the data
+    portal_msg_t msg = { .type = PORTAL_MSG_LOAD, .slot = slot };
+    if (portal_read_skylander_file(&server->portals[portal], filename, msg.data) != 0) {
         send_response(client_fd, 500, "Internal Server Error", "text/plain", "Load failed");
+    } else {
+        strncpy(msg.name, filename, sizeof(msg.name) - 1);
+        send_posted(client_fd, post_to_portal(server, portal, &msg), "Loaded successfully");
     }
     
     free(filename);
 }
 
+/**
+ * Handle Skylander unload request
+ */
+static void handle_unload(web_server_t* server, int portal, int client_fd, http_slice_t query) {
+    char* slot_str = http_query_param(query, "slot");
+    if (!slot_str) {
+        send_response(client_fd, 400, "Bad Request", "text/plain", "Missing slot");
+        return;
+    }
+    
+    int slot = parse_slot(slot_str);
+    free(slot_str);
+    if (slot < 0) {
+        send_response(client_fd, 400, "Bad Request", "text/plain", "Invalid slot");
+        return;
+    }
+    
+    portal_msg_t msg = { .type = PORTAL_MSG_UNLOAD, .slot = slot };
+    send_posted(client_fd, post_to_portal(server, portal, &msg), "Unloaded successfully");
+}
+
+/**
+ * Handle LED color override request
+ */
+static void handle_color(web_server_t* server, int portal, int client_fd, http_slice_t query) {
+    portal_msg_t msg = { .type = PORTAL_MSG_COLOR };
+    const char* keys[3] = { "r", "g", "b" };
+    
+    for (int i = 0; i < 3; i++) {
+        char* value = http_query_param(query, keys[i]);
+        int component = value ? atoi(value) : -1;
+        free(value);
+        if (component < 0 || component > 255) {
+            send_response(client_fd, 400, "Bad Request", "text/plain", "Invalid color");
+            return;
+        }
+        msg.color[i] = component;
+    }
+    
+    send_posted(client_fd, post_to_portal(server, portal, &msg), "Color set");
+}
+
+/**
+ * Handle loadout listing
+ */
+static void handle_loadouts(int client_fd) {
+    int count = 0;
+    char** names = loadout_list(&count);
+    
+    json_writer_t w;
+    json_writer_init(&w, -1);
+    json_begin_object(&w);
+    json_key(&w, "loadouts");
+    json_begin_array(&w);
+    for (int i = 0; i < count; i++) {
+        json_string(&w, names[i]);
+        free(names[i]);
+    }
+    json_end_array(&w);
+    json_end_object(&w);
+    free(names);
+    
+    send_response(client_fd, 200, "OK", "application/json", json_writer_data(&w));
+    json_writer_free(&w);
+}
+
+/**
+ * Handle loadout save: the body's "<slot> <file>" lines, or the figures
+ * on the portal now if the body is empty
+ */
+static void handle_loadout_save(web_server_t* server, int portal, int client_fd, http_slice_t query,
+                                const char* body, size_t body_len) {
+    char* name = http_query_param(query, "name");
+    if (!loadout_valid_name(name)) {
+        send_response(client_fd, 400, "Bad Request", "text/plain", "Invalid loadout name");
+        free(name);
+        return;
+    }
+    
+    portal_loadout_t* loadout = malloc(sizeof(*loadout));
+    if (!loadout) {
+        send_response(client_fd, 500, "Internal Server Error", "text/plain", "Out of memory");
+        free(name);
+        return;
+    }
+    
+    if (body_len > 0) {
+        if (loadout_parse(body, body_len, loadout) != 0) {
+            send_response(client_fd, 400, "Bad Request", "text/plain", "Invalid loadout");
+            free(loadout);
+            free(name);
+            return;
+        }
+    } else {
+        portal_t* p = &server->portals[portal];
+        loadout->mask = 0;
+        pthread_mutex_lock(&server->queues[portal].state_lock);
+        for (int i = 0; i < MAX_SKYLANDERS; i++) {
+            skylander_slot_t* slot = portal_get_skylander(p, i);
+            if (slot) {
+                snprintf(loadout->names[i], sizeof(loadout->names[i]), "%s", slot->filename);
+                loadout->mask |= 1u << i;
+            }
+        }
+        pthread_mutex_unlock(&server->queues[portal].state_lock);
+    }
+    
+    char path[512];
+    struct stat st;
+    if (stat(LOADOUT_DIR, &st) != 0) {
+        mkdir(LOADOUT_DIR, 0755);
+    }
+    loadout_path(name, path, sizeof(path));
+    if (loadout_write_file(path, loadout) != 0) {
+        send_response(client_fd, 500, "Internal Server Error", "text/plain", "Failed to save loadout");
+    } else {
+        printf("Saved loadout '%s' (%d figures)\n", name, __builtin_popcount(loadout->mask));
+        send_response(client_fd, 200, "OK", "text/plain", "Loadout saved");
+    }
+    free(loadout);
+    free(name);
+}
+
+/**
+ * Handle loadout apply: read every figure here, then have the portal
+ * thread publish them all in one transition
+ */
+static void handle_loadout_apply(web_server_t* server, int portal, int client_fd, http_slice_t query) {
+    uint64_t start_us = metrics_now_us();
+    
+    char* name = http_query_param(query, "name");
+    if (!loadout_valid_name(name)) {
+        send_response(client_fd, 400, "Bad Request", "text/plain", "Invalid loadout name");
+        free(name);
+        return;
+    }
+    
+    portal_loadout_t* loadout = malloc(sizeof(*loadout));
+    if (!loadout) {
+        send_response(client_fd, 500, "Internal Server Error", "text/plain", "Out of memory");
+        free(name);
+        return;
+    }
+    
+    char path[512];
+    int failed_slot = -1;
+    loadout_path(name, path, sizeof(path));
+    if (loadout_read_file(path, loadout) != 0) {
+        send_response(client_fd, 404, "Not Found", "text/plain", "No such loadout");
+        free(loadout);
+        free(name);
+        return;
+    }
+    if (loadout_read_figures(&server->portals[portal], loadout, &failed_slot) != 0) {
+        char err_msg[320];
+        snprintf(err_msg, sizeof(err_msg), "Load failed: %s", loadout->names[failed_slot]);
+        send_response(client_fd, 500, "Internal Server Error", "text/plain", err_msg);
+        free(loadout);
+        free(name);
+        return;
+    }
+    int figures = __builtin_popcount(loadout->mask);
+    
+    // The queue owns the loadout once posted
+    portal_msg_t msg = { .type = PORTAL_MSG_LOADOUT, .loadout = loadout };
+    int posted = post_to_portal(server, portal, &msg);
+    if (posted != 0) {
+        if (posted < 0) free(loadout);
+        send_posted(client_fd, posted, NULL);
+        free(name);
+        return;
+    }
+    
+    uint64_t latency_us = metrics_now_us() - start_us;
+    metric_observe_us(&kaos_metrics.loadout_latency, latency_us);
+    
+    json_writer_t w;
+    json_writer_init(&w, -1);
+    json_begin_object(&w);
+    json_key(&w, "loadout");
+    json_string(&w, name);
+    json_key(&w, "figures");
+    json_int(&w, figures);
+    json_key(&w, "latency_us");
+    json_int(&w, (long long)latency_us);
+    json_end_object(&w);
+    send_response(client_fd, 200, "OK", "application/json", json_writer_data(&w));
+    json_writer_free(&w);
+    free(name);
+}
+
 /**
  * Handle file delete request
  */
-static void handle_delete(web_server_t* server, int client_fd, const char* query) {
-    char* filename = get_query_param(query, "file");
+static void handle_delete(web_server_t* server, int client_fd, http_slice_t query) {
+    char* filename = http_query_param(query, "file");
     
     if (!filename) {
         send_response(client_fd, 400, "Bad Request", "text/plain", "Missing filename");
@@ -672,9 +1266,10 @@ static void handle_delete(web_server_t* server, int client_fd, const char* query
     }
     
     char filepath[512];
-    snprintf(filepath, sizeof(filepath), "/var/lib/kaos-pi/skylanders/%s", filename);
+    snprintf(filepath, sizeof(filepath), "%s/%s", PORTAL_LIBRARY_DIR, filename);
     
     if (unlink(filepath) == 0) {
+        list_index_invalidate();
         send_response(client_fd, 200, "OK", "text/plain", "Deleted successfully");
     } else {
         send_response(client_fd, 500, "Internal Server Error", "text/plain", "Delete failed");
@@ -684,112 +1279,431 @@ static void handle_delete(web_server_t* server, int client_fd, const char* query
 }
 
 /**
- * Handle status request
+ * Build portal status JSON
  */
-static void handle_status(web_server_t* server, int client_fd) {
-    char json[4096];
-    snprintf(json, sizeof(json), "{\"state\":\"active\",\"slots\":[");
-    
-    for (int i = 0; i < 2; i++) {
-        if (i > 0) strcat(json, ",");
+static void build_status_json(web_server_t* server, int index, json_writer_t* w) {
+    portal_t* portal = &server->portals[index];
+    
+    // The portal thread changes portal state only with this held
+    pthread_mutex_lock(&server->queues[index].state_lock);
+    json_begin_object(w);
+    
+    json_key(w, "portal");
+    json_int(w, index);
+    
+    json_key(w, "state");
+    json_string(w, portal->state == PORTAL_STATE_IDLE ? "idle" : "active");
+    
+    json_key(w, "led");
+    json_begin_object(w);
+    json_key(w, "r");
+    json_int(w, portal->led_color[0]);
+    json_key(w, "g");
+    json_int(w, portal->led_color[1]);
+    json_key(w, "b");
+    json_int(w, portal->led_color[2]);
+    json_end_object(w);
+    
+    // Every slot, indexed by slot number: loadouts fill more than the players'
+    json_key(w, "slots");
+    json_begin_array(w);
+    for (int i = 0; i < MAX_SKYLANDERS; i++) {
+        skylander_slot_t* slot = portal_get_skylander(portal, i);
         
-        skylander_slot_t* slot = portal_get_skylander(server->portal, i);
-        if (slot && slot->active) {
-            char slot_json[256];
-            snprintf(slot_json, sizeof(slot_json), 
-                "{\"active\":true,\"filename\":\"%s\"}", slot->filename);
-            strcat(json, slot_json);
-        } else {
-            strcat(json, "{\"active\":false}");
+        json_begin_object(w);
+        json_key(w, "slot");
+        json_int(w, i);
+        json_key(w, "active");
+        json_bool(w, slot != NULL);
+        if (slot) {
+            json_key(w, "filename");
+            json_string(w, slot->filename);
         }
+        json_end_object(w);
+    }
+    json_end_array(w);
+    
+    json_end_object(w);
+    pthread_mutex_unlock(&server->queues[index].state_lock);
+}
+
+/**
+ * Handle status request
+ */
+static void handle_status(web_server_t* server, int portal, int client_fd) {
+    json_writer_t w;
+    json_writer_init(&w, -1);
+    build_status_json(server, portal, &w);
+    send_response(client_fd, 200, "OK", "application/json", json_writer_data(&w));
+    json_writer_free(&w);
+}
+
+/**
+ * Handle server statistics request
+ */
+static void handle_stats(web_server_t* server, int client_fd) {
+    web_server_stats_t stats;
+    web_server_get_stats(server, &stats);
+    
+    json_writer_t w;
+    json_writer_init(&w, -1);
+    json_begin_object(&w);
+    json_key(&w, "accepted");
+    json_int(&w, stats.accepted);
+    json_key(&w, "shed_busy");
+    json_int(&w, stats.shed_busy);
+    json_key(&w, "shed_per_ip");
+    json_int(&w, stats.shed_per_ip);
+    json_key(&w, "rate_limited");
+    json_int(&w, stats.rate_limited);
+    json_key(&w, "header_timeouts");
+    json_int(&w, stats.header_timeouts);
+    json_key(&w, "body_timeouts");
+    json_int(&w, stats.body_timeouts);
+    json_key(&w, "active");
+    json_int(&w, stats.active);
+    json_key(&w, "peak_active");
+    json_int(&w, stats.peak_active);
+    json_key(&w, "event_subscribers");
+    json_int(&w, events_client_count());
+    json_end_object(&w);
+    
+    send_response(client_fd, 200, "OK", "application/json", json_writer_data(&w));
+    json_writer_free(&w);
+}
+
+/**
+ * Handle command latency request
+ * Reports per-opcode percentiles in microseconds
+ */
+static void handle_latency(int client_fd) {
+    json_writer_t w;
+    json_writer_init(&w, -1);
+    json_begin_object(&w);
+    json_key(&w, "unit");
+    json_string(&w, "us");
+    json_key(&w, "commands");
+    json_begin_object(&w);
+    
+    for (int i = 0; i < LATENCY_OPCODE_COUNT; i++) {
+        char opcode[2] = { LATENCY_OPCODES[i], '\0' };
+        latency_summary_t s;
+        if (latency_summarize((uint8_t)opcode[0], &s) < 0) continue;
+        
+        json_key(&w, opcode);
+        json_begin_object(&w);
+        json_key(&w, "count");
+        json_int(&w, s.count);
+        json_key(&w, "min");
+        json_int(&w, s.min / 1000);
+        json_key(&w, "mean");
+        json_int(&w, s.mean / 1000);
+        json_key(&w, "p50");
+        json_int(&w, s.p50 / 1000);
+        json_key(&w, "p99");
+        json_int(&w, s.p99 / 1000);
+        json_key(&w, "p999");
+        json_int(&w, s.p999 / 1000);
+        json_key(&w, "max");
+        json_int(&w, s.max / 1000);
+        json_end_object(&w);
+    }
+    
+    json_end_object(&w);
+    json_end_object(&w);
+    
+    send_response(client_fd, 200, "OK", "application/json", json_writer_data(&w));
+    json_writer_free(&w);
+}
+
+/**
+ * Handle Prometheus metrics request
+ */
+static void handle_metrics(web_server_t* server, int client_fd) {
+    char* text = NULL;
+    size_t text_len = 0;
+    FILE* out = open_memstream(&text, &text_len);
+    if (!out) {
+        send_response(client_fd, 500, "Internal Server Error", "text/plain", "Out of memory");
+        return;
+    }
+    
+    metrics_render(out);
+    
+    // Admission control counters live in the server state
+    web_server_stats_t stats;
+    web_server_get_stats(server, &stats);
+    
+    fprintf(out, "# HELP kaos_http_connections_total Connections by admission result\n");
+    fprintf(out, "# TYPE kaos_http_connections_total counter\n");
+    fprintf(out, "kaos_http_connections_total{result=\"accepted\"} %llu\n", (unsigned long long)stats.accepted);
+    fprintf(out, "kaos_http_connections_total{result=\"shed_busy\"} %llu\n", (unsigned long long)stats.shed_busy);
+    fprintf(out, "kaos_http_connections_total{result=\"shed_per_ip\"} %llu\n", (unsigned long long)stats.shed_per_ip);
+    fprintf(out, "kaos_http_connections_total{result=\"rate_limited\"} %llu\n", (unsigned long long)stats.rate_limited);
+    fprintf(out, "# HELP kaos_http_timeouts_total Requests dropped for missing a deadline\n");
+    fprintf(out, "# TYPE kaos_http_timeouts_total counter\n");
+    fprintf(out, "kaos_http_timeouts_total{phase=\"header\"} %llu\n", (unsigned long long)stats.header_timeouts);
+    fprintf(out, "kaos_http_timeouts_total{phase=\"body\"} %llu\n", (unsigned long long)stats.body_timeouts);
+    fprintf(out, "# HELP kaos_http_active_requests Requests in flight\n");
+    fprintf(out, "# TYPE kaos_http_active_requests gauge\n");
+    fprintf(out, "kaos_http_active_requests %d\n", stats.active);
+    fprintf(out, "# HELP kaos_http_event_subscribers Connected /events clients\n");
+    fprintf(out, "# TYPE kaos_http_event_subscribers gauge\n");
+    fprintf(out, "kaos_http_event_subscribers %d\n", events_client_count());
+    
+    fclose(out);
+    
+    send_response(client_fd, 200, "OK", "text/plain; version=0.0.4", text);
+    free(text);
+}
+
+/**
+ * Map a request path to its metrics route
+ */
+static metric_route_t route_for_path(http_slice_t path) {
+    static const struct {
+        const char* path;
+        metric_route_t route;
+    } routes[] = {
+        { "/", METRIC_ROUTE_INDEX },
+        { "/upload", METRIC_ROUTE_UPLOAD },
+        { "/list", METRIC_ROUTE_LIST },
+        { "/load", METRIC_ROUTE_LOAD },
+        { "/unload", METRIC_ROUTE_UNLOAD },
+        { "/color", METRIC_ROUTE_COLOR },
+        { "/loadouts", METRIC_ROUTE_LOADOUT },
+        { "/loadout", METRIC_ROUTE_LOADOUT },
+        { "/loadout/apply", METRIC_ROUTE_LOADOUT },
+        { "/delete", METRIC_ROUTE_DELETE },
+        { "/status", METRIC_ROUTE_STATUS },
+        { "/events", METRIC_ROUTE_EVENTS },
+        { "/stats", METRIC_ROUTE_STATS },
+        { "/metrics", METRIC_ROUTE_METRICS },
+        { "/latency", METRIC_ROUTE_LATENCY },
+        { "/latency/reset", METRIC_ROUTE_LATENCY },
+    };
+    
+    for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+        if (http_slice_eq(path, routes[i].path)) return routes[i].route;
+    }
+    return METRIC_ROUTE_OTHER;
+}
+
+/**
+ * Strip a "/portal/{n}" prefix from the path
+ * Returns the portal number (0 outside the namespace), -1 if there is no such portal
+ */
+static int portal_for_path(web_server_t* server, http_slice_t* path) {
+    static const char prefix[] = "/portal/";
+    size_t prefix_len = sizeof(prefix) - 1;
+    
+    if (path->len <= prefix_len || memcmp(path->ptr, prefix, prefix_len) != 0) {
+        return 0;
+    }
+    
+    int index = 0;
+    size_t i = prefix_len;
+    while (i < path->len && path->ptr[i] >= '0' && path->ptr[i] <= '9' && index < MAX_PORTALS) {
+        index = index * 10 + (path->ptr[i] - '0');
+        i++;
+    }
+    if (i == prefix_len || (i < path->len && path->ptr[i] != '/') || index >= server->portal_count) {
+        return -1;
+    }
+    
+    // "/portal/1" and "/portal/1/" both serve the index page
+    path->ptr += i;
+    path->len -= i;
+    if (path->len == 0) {
+        path->ptr = "/";
+        path->len = 1;
+    }
+    return index;
+}
+
+/**
+ * Handle event stream request
+ * Returns 0 if the socket was handed to the event stream, -1 otherwise
+ */
+static int handle_events(web_server_t* server, int portal, int client_fd) {
+    json_writer_t w;
+    json_writer_init(&w, -1);
+    build_status_json(server, portal, &w);
+    
+    size_t snapshot_size = w.len + 32;
+    char* snapshot = malloc(snapshot_size);
+    if (snapshot) {
+        snprintf(snapshot, snapshot_size, "event: status\ndata: %s\n\n", json_writer_data(&w));
+    }
+    json_writer_free(&w);
+    
+    int rc = events_add_client(client_fd, snapshot, portal);
+    free(snapshot);
+    
+    if (rc < 0) {
+        send_response(client_fd, 503, "Service Unavailable", "text/plain", "Too many event subscribers");
+        return -1;
     }
     
-    strcat(json, "]}");
-    send_response(client_fd, 200, "OK", "application/json", json);
+    metrics_http_response(METRIC_ROUTE_EVENTS, 200);
+    return 0;
 }
 
 /**
  * Handle a client connection
  */
 void web_server_handle_client(web_server_t* server, int client_fd) {
-    char* buffer = malloc(65536);  // 64KB buffer for file uploads
+    char* buffer = malloc(WEB_SERVER_REQUEST_BUFFER_SIZE);  // Headers + upload body
     if (!buffer) {
         close(client_fd);
         return;
     }
     
-    ssize_t bytes = 0;
-    ssize_t total_bytes = 0;
-    
-    // Read initial chunk to get headers
-    bytes = read(client_fd, buffer, 4096);
-    if (bytes <= 0) {
-        free(buffer);
-        close(client_fd);
-        return;
+    http_request_t req;
+    size_t total_bytes = 0;
+    size_t last_len = 0;
+    int header_len;
+    
+    current_route = METRIC_ROUTE_OTHER;
+    
+    // Bound every write so a client that stops reading cannot pin this thread
+    struct timeval send_timeout = {
+        .tv_sec = WEB_SERVER_WRITE_TIMEOUT_MS / 1000,
+        .tv_usec = (WEB_SERVER_WRITE_TIMEOUT_MS % 1000) * 1000
+    };
+    setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+    
+    // Read until the request line and headers are complete
+    int64_t deadline = monotonic_ms() + WEB_SERVER_HEADER_TIMEOUT_MS;
+    for (;;) {
+        ssize_t bytes = read_deadline(client_fd, buffer + total_bytes,
+                                      HTTP_MAX_HEADER_SIZE - total_bytes, deadline);
+        if (bytes == READ_TIMEOUT) {
+            count_timeout(server, false);
+            send_response(client_fd, 408, "Request Timeout", "text/plain", "Request timeout");
+        }
+        if (bytes <= 0) {
+            free(buffer);
+            close(client_fd);
+            return;
+        }
+        total_bytes += bytes;
+        
+        header_len = http_parse_request(buffer, total_bytes, last_len, &req);
+        if (header_len >= 0) break;
+        
+        if (header_len == HTTP_PARSE_ERROR) {
+            if (total_bytes >= HTTP_MAX_HEADER_SIZE) {
+                send_response(client_fd, 431, "Request Header Fields Too Large", "text/plain", "Headers too large");
+            } else {
+                send_response(client_fd, 400, "Bad Request", "text/plain", "Malformed request");
+            }
+            free(buffer);
+            close(client_fd);
+            return;
+        }
+        last_len = total_bytes;
     }
-    total_bytes = bytes;
-    buffer[total_bytes] = '\0';
     
-    // Parse request line
-    char method[16], path[256], version[16];
-    sscanf(buffer, "%s %s %s", method, path, version);
+    printf("Request: %.*s %.*s\n", (int)req.method.len, req.method.ptr,
+           (int)req.path.len, req.path.ptr);
     
-    printf("Request: %s %s\n", method, path);
+    int portal = portal_for_path(server, &req.path);
+    current_route = route_for_path(req.path);
     
-    // For POST requests, check Content-Length and read full body
-    if (strcmp(method, "POST") == 0) {
-        const char* content_length_str = strstr(buffer, "Content-Length:");
-        if (content_length_str) {
-            int content_length = 0;
-            sscanf(content_length_str, "Content-Length: %d", &content_length);
-            
-            // Find end of headers
-            const char* body_start = strstr(buffer, "\r\n\r\n");
-            if (body_start) {
-                body_start += 4;
-                int headers_len = body_start - buffer;
-                int body_received = total_bytes - headers_len;
-                int body_remaining = content_length - body_received;
-                
-                // Read remaining body data
-                while (body_remaining > 0 && total_bytes < 65535) {
-                    bytes = read(client_fd, buffer + total_bytes, 
-                                body_remaining < (65536 - total_bytes - 1) ? body_remaining : (65536 - total_bytes - 1));
-                    if (bytes <= 0) break;
-                    total_bytes += bytes;
-                    body_remaining -= bytes;
-                }
-                buffer[total_bytes] = '\0';
+    bool is_post = http_slice_eq(req.method, "POST");
+    
+    // Read the rest of the body announced by Content-Length
+    const char* body = buffer + header_len;
+    size_t body_len = total_bytes - header_len;
+    
+    if (req.content_length >= 0) {
+        if ((size_t)req.content_length > WEB_SERVER_REQUEST_BUFFER_SIZE - (size_t)header_len) {
+            send_response(client_fd, 413, "Payload Too Large", "text/plain", "Request body too large");
+            free(buffer);
+            close(client_fd);
+            return;
+        }
+        
+        deadline = monotonic_ms() + WEB_SERVER_BODY_TIMEOUT_MS;
+        while (body_len < (size_t)req.content_length) {
+            ssize_t bytes = read_deadline(client_fd, buffer + total_bytes,
+                                          req.content_length - body_len, deadline);
+            if (bytes == READ_TIMEOUT) {
+                count_timeout(server, true);
+                send_response(client_fd, 408, "Request Timeout", "text/plain", "Request timeout");
+                free(buffer);
+                close(client_fd);
+                return;
             }
+            if (bytes <= 0) break;
+            total_bytes += bytes;
+            body_len += bytes;
         }
-    }
-    
-    // Extract query string
-    char* query = strchr(path, '?');
-    if (query) {
-        *query = '\0';
-        query++;
+        
+        if (body_len > (size_t)req.content_length) {
+            body_len = req.content_length;
+        }
+    } else {
+        body_len = 0;
     }
     
     // Route requests
-    if (strcmp(path, "/") == 0) {
+    if (portal < 0) {
+        send_response(client_fd, 404, "Not Found", "text/plain", "No such portal");
+    }
+    else if (http_slice_eq(req.path, "/")) {
         send_response(client_fd, 200, "OK", "text/html", HTML_INDEX);
     }
-    else if (strcmp(path, "/upload") == 0 && strcmp(method, "POST") == 0) {
-        handle_upload(server, client_fd, buffer, total_bytes);
+    else if (http_slice_eq(req.path, "/upload") && is_post) {
+        handle_upload(server, portal, client_fd, &req, body, body_len);
+    }
+    else if (http_slice_eq(req.path, "/list")) {
+        handle_list(server, client_fd, req.query);
+    }
+    else if (http_slice_eq(req.path, "/load") && is_post) {
+        handle_load(server, portal, client_fd, req.query);
+    }
+    else if (http_slice_eq(req.path, "/unload") && is_post) {
+        handle_unload(server, portal, client_fd, req.query);
+    }
+    else if (http_slice_eq(req.path, "/color") && is_post) {
+        handle_color(server, portal, client_fd, req.query);
     }
-    else if (strcmp(path, "/list") == 0) {
-        handle_list(server, client_fd);
+    else if (http_slice_eq(req.path, "/loadouts")) {
+        handle_loadouts(client_fd);
     }
-    else if (strcmp(path, "/load") == 0 && strcmp(method, "POST") == 0) {
-        handle_load(server, client_fd, query);
+    else if (http_slice_eq(req.path, "/loadout") && is_post) {
+        handle_loadout_save(server, portal, client_fd, req.query, body, body_len);
     }
-    else if (strcmp(path, "/delete") == 0 && strcmp(method, "POST") == 0) {
-        handle_delete(server, client_fd, query);
+    else if (http_slice_eq(req.path, "/loadout/apply") && is_post) {
+        handle_loadout_apply(server, portal, client_fd, req.query);
     }
-    else if (strcmp(path, "/status") == 0) {
-        handle_status(server, client_fd);
+    else if (http_slice_eq(req.path, "/delete") && is_post) {
+        handle_delete(server, client_fd, req.query);
+    }
+    else if (http_slice_eq(req.path, "/status")) {
+        handle_status(server, portal, client_fd);
+    }
+    else if (http_slice_eq(req.path, "/latency")) {
+        handle_latency(client_fd);
+    }
+    else if (http_slice_eq(req.path, "/latency/reset") && is_post) {
+        latency_reset();
+        send_response(client_fd, 200, "OK", "text/plain", "Latency histograms reset");
+    }
+    else if (http_slice_eq(req.path, "/metrics")) {
+        handle_metrics(server, client_fd);
+    }
+    else if (http_slice_eq(req.path, "/stats")) {
+        handle_stats(server, client_fd);
+    }
+    else if (http_slice_eq(req.path, "/events")) {
+        if (handle_events(server, portal, client_fd) == 0) {
+            // Socket is now owned by the event stream
+            free(buffer);
+            return;
+        }
     }
     else {
         send_response(client_fd, 404, "Not Found", "text/plain", "Not found");
@@ -799,12 +1713,132 @@ void web_server_handle_client(web_server_t* server, int client_fd) {
     close(client_fd);
 }
 
+/**
+ * Find or claim the admission bucket for a client address
+ * Caller must hold server->lock. Returns NULL if the table is full.
+ */
+static web_client_bucket_t* find_bucket(web_server_t* server, in_addr_t addr, double now) {
+    uint32_t hash = (uint32_t)addr * 2654435761u;
+    web_client_bucket_t* candidate = NULL;
+    
+    for (int probe = 0; probe < 8; probe++) {
+        web_client_bucket_t* b = &server->clients[(hash + probe) % WEB_SERVER_RATE_TABLE_SIZE];
+        if (b->addr == addr) return b;
+        
+        // Reuse empty entries, or idle ones whose bucket has refilled
+        bool idle = b->active == 0 &&
+                    now - b->last_refill > (double)WEB_SERVER_RATE_BURST / WEB_SERVER_RATE_PER_SEC;
+        if (!candidate && (b->addr == 0 || idle)) {
+            candidate = b;
+        }
+    }
+    
+    if (candidate) {
+        candidate->addr = addr;
+        candidate->tokens = WEB_SERVER_RATE_BURST;
+        candidate->last_refill = now;
+        candidate->active = 0;
+    }
+    
+    return candidate;
+}
+
+/**
+ * Decide whether to serve a new connection
+ */
+static admit_result_t admit_client(web_server_t* server, in_addr_t addr,
+                                   web_client_bucket_t** bucket_out) {
+    double now = monotonic_ms() / 1000.0;
+    admit_result_t result = ADMIT_OK;
+    
+    pthread_mutex_lock(&server->lock);
+    
+    web_client_bucket_t* bucket = find_bucket(server, addr, now);
+    if (bucket) {
+        bucket->tokens += (now - bucket->last_refill) * WEB_SERVER_RATE_PER_SEC;
+        if (bucket->tokens > WEB_SERVER_RATE_BURST) bucket->tokens = WEB_SERVER_RATE_BURST;
+        bucket->last_refill = now;
+    }
+    
+    if (bucket && bucket->tokens < 1.0) {
+        result = ADMIT_RATE_LIMITED;
+        server->stats.rate_limited++;
+    } else if (server->stats.active >= WEB_SERVER_MAX_CONNECTIONS) {
+        result = ADMIT_BUSY;
+        server->stats.shed_busy++;
+    } else if (bucket && bucket->active >= WEB_SERVER_MAX_CONNECTIONS_PER_IP) {
+        result = ADMIT_PER_IP;
+        server->stats.shed_per_ip++;
+    } else {
+        if (bucket) {
+            bucket->tokens -= 1.0;
+            bucket->active++;
+        }
+        server->stats.accepted++;
+        server->stats.active++;
+        if (server->stats.active > server->stats.peak_active) {
+            server->stats.peak_active = server->stats.active;
+        }
+    }
+    
+    pthread_mutex_unlock(&server->lock);
+    
+    *bucket_out = bucket;
+    return result;
+}
+
+/**
+ * Reject a connection without blocking the accept loop
+ */
+static void reject_client(int client_fd, int status_code, const char* status_text) {
+    char response[256];
+    
+    metrics_http_response(METRIC_ROUTE_OTHER, status_code);
+    
+    int len = snprintf(response, sizeof(response),
+        "HTTP/1.1 %d %s\r\n"
+        "Content-Length: 0\r\n"
+        "Retry-After: 1\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        status_code, status_text);
+    
+    send(client_fd, response, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client_fd);
+}
+
+/**
+ * Request thread
+ */
+static void* client_thread(void* arg) {
+    client_job_t* job = (client_job_t*)arg;
+    web_server_t* server = job->server;
+    
+    web_server_handle_client(server, job->client_fd);
+    
+    pthread_mutex_lock(&server->lock);
+    server->stats.active--;
+    if (job->bucket) job->bucket->active--;
+    pthread_mutex_unlock(&server->lock);
+    
+    free(job);
+    return NULL;
+}
+
 /**
  * Main server thread
+ * Admits connections and hands each one to a request thread
  */
 void* web_server_thread(void* arg) {
     web_server_t* server = (web_server_t*)arg;
     
+    metrics_register_thread("web");
+    
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, WEB_SERVER_HANDLER_STACK_SIZE);
+    
     while (server->running) {
         struct sockaddr_in client_addr;
         socklen_t addr_len = sizeof(client_addr);
@@ -817,23 +1851,59 @@ void* web_server_thread(void* arg) {
             continue;
         }
         
-        web_server_handle_client(server, client_fd);
+        web_client_bucket_t* bucket = NULL;
+        switch (admit_client(server, client_addr.sin_addr.s_addr, &bucket)) {
+            case ADMIT_RATE_LIMITED:
+                reject_client(client_fd, 429, "Too Many Requests");
+                continue;
+            case ADMIT_BUSY:
+            case ADMIT_PER_IP:
+                reject_client(client_fd, 503, "Service Unavailable");
+                continue;
+            case ADMIT_OK:
+                break;
+        }
+        
+        client_job_t* job = malloc(sizeof(client_job_t));
+        pthread_t tid;
+        if (job) {
+            job->server = server;
+            job->client_fd = client_fd;
+            job->bucket = bucket;
+        }
+        
+        if (!job || pthread_create(&tid, &attr, client_thread, job) != 0) {
+            perror("Failed to create request thread");
+            free(job);
+            reject_client(client_fd, 503, "Service Unavailable");
+            
+            pthread_mutex_lock(&server->lock);
+            server->stats.active--;
+            if (bucket) bucket->active--;
+            pthread_mutex_unlock(&server->lock);
+        }
     }
     
+    pthread_attr_destroy(&attr);
+    metrics_unregister_thread();
     return NULL;
 }
 
 /**
  * Initialize the web server
  */
-int web_server_init(web_server_t* server, portal_t* portal, int port) {
-    if (!server || !portal) return -1;
+int web_server_init(web_server_t* server, portal_t* portals, portal_queue_t* queues,
+                    int portal_count, int port) {
+    if (!server || !portals || !queues || portal_count < 1 || portal_count > MAX_PORTALS) return -1;
     
     memset(server, 0, sizeof(web_server_t));
-    server->portal = portal;
+    server->portals = portals;
+    server->queues = queues;
+    server->portal_count = portal_count;
     server->port = port;
     server->socket_fd = -1;
     server->running = 0;
+    pthread_mutex_init(&server->lock, NULL);
     
     // Create socket
     server->socket_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -864,7 +1934,7 @@ int web_server_init(web_server_t* server, portal_t* portal, int port) {
     }
     
     // Listen
-    if (listen(server->socket_fd, WEB_SERVER_MAX_CONNECTIONS) < 0) {
+    if (listen(server->socket_fd, WEB_SERVER_LISTEN_BACKLOG) < 0) {
         perror("Listen failed");
         close(server->socket_fd);
         return -1;
@@ -923,9 +1993,34 @@ void web_server_cleanup(web_server_t* server) {
         server->socket_fd = -1;
     }
     
+    // Give in-flight requests a moment to finish
+    for (int i = 0; i < 100; i++) {
+        pthread_mutex_lock(&server->lock);
+        int active = server->stats.active;
+        pthread_mutex_unlock(&server->lock);
+        if (active == 0) break;
+        usleep(10000);
+    }
+    
+    pthread_mutex_lock(&list_index.lock);
+    portal_free_skylander_files(list_index.files, list_index.count);
+    list_index.files = NULL;
+    list_index.count = 0;
+    list_index.valid = false;
+    pthread_mutex_unlock(&list_index.lock);
+    
     printf("Web server cleaned up\n");
 }
 
+/**
+ * Get a snapshot of the admission and timeout counters
+ */
+void web_server_get_stats(web_server_t* server, web_server_stats_t* stats) {
+    pthread_mutex_lock(&server->lock);
+    *stats = server->stats;
+    pthread_mutex_unlock(&server->lock);
+}
+
 /**
  * Check if server is running
  */
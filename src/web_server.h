@@ -2,7 +2,10 @@
 #define WEB_SERVER_H
 
 #include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
 #include "portal.h"
+#include "portal_queue.h"
 
 /**
  * Web Server for Skylander File Management
@@ -11,24 +14,63 @@
 
 // Web server configuration
 #define WEB_SERVER_PORT 8080
-#define WEB_SERVER_MAX_CONNECTIONS 10
+#define WEB_SERVER_MAX_CONNECTIONS 10                   // Concurrent requests in flight
+#define WEB_SERVER_MAX_CONNECTIONS_PER_IP 4             // Concurrent requests per client
+#define WEB_SERVER_LISTEN_BACKLOG 64                    // Kernel accept queue
+#define WEB_SERVER_HEADER_TIMEOUT_MS 5000               // Request line + headers deadline
+#define WEB_SERVER_BODY_TIMEOUT_MS 30000                // Request body deadline
+#define WEB_SERVER_WRITE_TIMEOUT_MS 10000               // Per-write send timeout
+#define WEB_SERVER_RATE_PER_SEC 20                      // Token bucket refill per client
+#define WEB_SERVER_RATE_BURST 40                        // Token bucket size per client
+#define WEB_SERVER_RATE_TABLE_SIZE 64                   // Tracked client addresses
+#define WEB_SERVER_HANDLER_STACK_SIZE (256 * 1024)      // Request thread stack
 #define WEB_SERVER_UPLOAD_MAX_SIZE (2 * 1024 * 1024)  // 2MB max upload
+#define WEB_SERVER_REQUEST_BUFFER_SIZE 65536            // Headers + body per request
+#define WEB_SERVER_LIST_DEFAULT_LIMIT 100               // /list page size
+#define WEB_SERVER_LIST_MAX_LIMIT 1000                  // /list max page size
+
+// Per-client admission state
+typedef struct {
+    in_addr_t addr;                                 // Client IPv4 address (0 = unused)
+    double tokens;                                  // Rate limit tokens available
+    double last_refill;                             // Monotonic seconds
+    int active;                                     // Requests in flight
+} web_client_bucket_t;
+
+// Admission and timeout counters
+typedef struct {
+    uint64_t accepted;                              // Connections admitted
+    uint64_t shed_busy;                             // 503: connection cap reached
+    uint64_t shed_per_ip;                           // 503: per-client cap reached
+    uint64_t rate_limited;                          // 429: token bucket empty
+    uint64_t header_timeouts;                       // 408: headers too slow
+    uint64_t body_timeouts;                         // 408: body too slow
+    int active;                                     // Requests in flight
+    int peak_active;                                // High-water mark
+} web_server_stats_t;
 
 // Web server state
 typedef struct {
     int socket_fd;
     int port;
     int running;
-    portal_t* portal;
+    portal_t* portals;                              // Served under /portal/{n}/ (0 also at /)
+    int portal_count;
+    pthread_mutex_t lock;                           // Guards admission state and stats
+    portal_queue_t* queues;                         // Management actions, one queue per portal
+    web_client_bucket_t clients[WEB_SERVER_RATE_TABLE_SIZE];
+    web_server_stats_t stats;
 } web_server_t;
 
 // Function Prototypes
 
 /**
- * Initialize the web server
+ * Initialize the web server for an array of portals
+ * Changes to portal n are posted to queues[n] and applied by its portal thread
  * Returns 0 on success, -1 on error
  */
-int web_server_init(web_server_t* server, portal_t* portal, int port);
+int web_server_init(web_server_t* server, portal_t* portals, portal_queue_t* queues,
+                    int portal_count, int port);
 
 /**
  * Start the web server in a separate thread
@@ -56,6 +98,11 @@ void* web_server_thread(void* arg);
  */
 void web_server_handle_client(web_server_t* server, int client_fd);
 
+/**
+ * Get a snapshot of the admission and timeout counters
+ */
+void web_server_get_stats(web_server_t* server, web_server_stats_t* stats);
+
 /**
  * Get server status (for monitoring)
  */
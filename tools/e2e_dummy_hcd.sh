@@ -0,0 +1,101 @@
+#!/bin/bash
+
+# End-to-end USB latency test on dummy_hcd
+# Runs kaos-pi on the dummy_hcd virtual UDC and times real HID round trips
+# from the host side of the same kernel with kaos-hidraw-rtt.
+#
+# Usage: sudo tools/e2e_dummy_hcd.sh [BUILD_DIR] [INTERVAL...]
+#   BUILD_DIR   Directory with kaos-pi and kaos-hidraw-rtt (default: build)
+#   INTERVAL    bInterval values to compare (default: kernel default only)
+#
+# Extra kaos-hidraw-rtt options can be passed in RTT_ARGS, e.g.
+#   RTT_ARGS="-n 5000 -c Q" sudo -E tools/e2e_dummy_hcd.sh build 1 4 8
+# and extra kaos-pi options in KAOS_ARGS, e.g. the FunctionFS backend:
+#   KAOS_ARGS="-b ffs" sudo -E tools/e2e_dummy_hcd.sh build
+#
+# PROFILES selects the command paths to compare (default: interrupt), e.g.
+# interrupt OUT against SET_REPORT on the control endpoint:
+#   PROFILES="interrupt control" sudo -E tools/e2e_dummy_hcd.sh build
+
+BUILD_DIR="${1:-build}"
+shift
+INTERVALS=("$@")
+[ ${#INTERVALS[@]} -eq 0 ] && INTERVALS=(0)
+PROFILES="${PROFILES:-interrupt}"
+
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+NC='\033[0m' # No Color
+
+fail() {
+    echo -e "${RED}✗${NC} $1"
+    exit 1
+}
+
+[ "$(id -u)" -eq 0 ] || fail "Must run as root"
+[ -x "$BUILD_DIR/kaos-pi" ] || fail "$BUILD_DIR/kaos-pi not found"
+[ -x "$BUILD_DIR/kaos-hidraw-rtt" ] || fail "$BUILD_DIR/kaos-hidraw-rtt not found"
+
+# Virtual host + device controller pair, and the configfs gadget framework
+modprobe dummy_hcd || fail "dummy_hcd module not available (CONFIG_USB_DUMMY_HCD)"
+modprobe libcomposite || fail "libcomposite module not available"
+modprobe usb_f_fs 2>/dev/null   # Only needed for -b ffs
+mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+
+UDC=$(ls /sys/class/udc | grep -m1 dummy_udc)
+[ -n "$UDC" ] || fail "No dummy_udc found in /sys/class/udc"
+echo -e "${GREEN}✓${NC} Using UDC $UDC"
+
+LOG=$(mktemp /tmp/kaos-e2e.XXXXXX)
+RESULT=$(mktemp /tmp/kaos-e2e.XXXXXX)
+KAOS_PID=
+SUMMARY=()
+
+stop_kaos() {
+    if [ -n "$KAOS_PID" ]; then
+        kill -INT "$KAOS_PID" 2>/dev/null
+        wait "$KAOS_PID" 2>/dev/null
+        KAOS_PID=
+    fi
+}
+trap 'stop_kaos; rm -f "$LOG" "$RESULT"' EXIT
+
+for PROFILE in $PROFILES; do
+    for INTERVAL in "${INTERVALS[@]}"; do
+        echo ""
+        echo "========================================="
+        ARGS=(-u "$UDC" -p 18090 -o "$PROFILE")
+        if [ "$INTERVAL" -gt 0 ]; then
+            echo "$PROFILE, bInterval $INTERVAL"
+            ARGS+=(-i "$INTERVAL")
+        else
+            echo "$PROFILE, default bInterval"
+        fi
+        "$BUILD_DIR/kaos-pi" "${ARGS[@]}" $KAOS_ARGS > "$LOG" 2>&1 &
+        KAOS_PID=$!
+        echo "========================================="
+
+        # Wait for the host side to enumerate the portal
+        for _ in $(seq 50); do
+            grep -q "KAOS-Pi is running" "$LOG" && ls /dev/hidraw* >/dev/null 2>&1 && break
+            kill -0 "$KAOS_PID" 2>/dev/null || { cat "$LOG"; fail "kaos-pi exited"; }
+            sleep 0.2
+        done
+        sleep 1
+
+        "$BUILD_DIR/kaos-hidraw-rtt" $RTT_ARGS > "$RESULT"
+        RC=$?
+        cat "$RESULT"
+        [ $RC -eq 0 ] || echo -e "${RED}✗${NC} Round trip test failed"
+        SUMMARY+=("$(printf '%-10s %-8s %s' "$PROFILE" "${INTERVAL/#0/default}" \
+                     "$(grep '^RTT us:' "$RESULT" | cut -d: -f2-)")")
+
+        stop_kaos
+    done
+done
+
+echo ""
+echo "========================================="
+echo "Summary (RTT us)"
+echo "========================================="
+printf '%s\n' "${SUMMARY[@]}"
@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+#include "portal.h"
+#include "latency.h"
+#include "usb_gadget.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+
+/**
+ * kaos-hidraw-rtt: host-side round trip test through the real USB stack
+ *
+ * Opens the portal's /dev/hidrawN (as a console would see it), sends
+ * command reports and times each answer. With kaos-pi bound to dummy_hcd
+ * (`kaos-pi -u dummy_udc.0`) both ends run in the same kernel, so this
+ * measures hidraw -> usbhid -> HCD -> UDC -> f_hid -> kaos-pi and back.
+ *
+ * Reports RTT percentiles, jitter, achieved report rate and the bInterval
+ * the host negotiated for the interrupt endpoints.
+ */
+
+#define PORTAL_VID          0x1430
+#define PORTAL_PID          0x0150
+#define RTT_TIMEOUT_MS      1000
+
+// Options
+static const char* opt_device = NULL;
+static long opt_count = 2000;
+static double opt_rate = 0;                         // Reports/s, 0 = back to back
+static char opt_command = 'S';
+
+/**
+ * Find the portal's hidraw node by VID/PID
+ */
+static int find_portal(char* path, size_t size) {
+    DIR* dir = opendir("/dev");
+    if (!dir) return -1;
+
+    struct dirent* entry;
+    int found = -1;
+    while (found < 0 && (entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "hidraw", 6) != 0) continue;
+
+        snprintf(path, size, "/dev/%s", entry->d_name);
+        int fd = open(path, O_RDWR);
+        if (fd < 0) continue;
+
+        struct hidraw_devinfo info;
+        if (ioctl(fd, HIDIOCGRAWINFO, &info) == 0 &&
+            (uint16_t)info.vendor == PORTAL_VID && (uint16_t)info.product == PORTAL_PID) {
+            found = 0;
+        }
+        close(fd);
+    }
+
+    closedir(dir);
+    return found;
+}
+
+/**
+ * Read one sysfs attribute of an endpoint into value
+ */
+static void read_endpoint_attr(const char* dir, const char* endpoint, const char* attr,
+                               char* value, size_t size) {
+    char path[768];
+    value[0] = '\0';
+    snprintf(path, sizeof(path), "%s/%s/%s", dir, endpoint, attr);
+    FILE* fp = fopen(path, "r");
+    if (fp) {
+        if (fgets(value, size, fp)) value[strcspn(value, "\n")] = 0;
+        fclose(fp);
+    }
+}
+
+/**
+ * Print the host's view of the interrupt endpoints and the command path
+ */
+static void print_endpoint_intervals(const char* device) {
+    const char* name = strrchr(device, '/');
+    name = name ? name + 1 : device;
+
+    // hidrawN/device is the HID device; its parent is the USB interface
+    char dir[384];
+    snprintf(dir, sizeof(dir), "/sys/class/hidraw/%s/device/..", name);
+    DIR* d = opendir(dir);
+    if (!d) return;
+
+    bool out_endpoint = false;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strncmp(entry->d_name, "ep_", 3) != 0) continue;
+
+        char direction[16], interval[32], binterval[16];
+        read_endpoint_attr(dir, entry->d_name, "direction", direction, sizeof(direction));
+        read_endpoint_attr(dir, entry->d_name, "interval", interval, sizeof(interval));
+        read_endpoint_attr(dir, entry->d_name, "bInterval", binterval, sizeof(binterval));
+        if (strcmp(direction, "out") == 0) out_endpoint = true;
+        printf("Endpoint %s (%s): bInterval %s (%s)\n", entry->d_name + 3, direction, binterval, interval);
+    }
+    closedir(d);
+
+    // usbhid sends output reports as SET_REPORT when the interface has no OUT endpoint
+    printf("Command path: %s\n", out_endpoint ? "interrupt OUT" : "SET_REPORT on ep0");
+}
+
+/**
+ * Build the command report (report number 0 + 32 data bytes)
+ */
+static size_t build_report(uint8_t* report, long seq) {
+    memset(report, 0, USB_EP_SIZE + 1);
+    uint8_t* cmd = report + 1;
+    cmd[0] = opt_command;
+
+    switch (opt_command) {
+        case CMD_READ:
+            cmd[1] = 0;
+            cmd[2] = seq % SKYLANDER_BLOCKS;
+            break;
+        default:
+            break;
+    }
+    return USB_EP_SIZE + 1;
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [OPTIONS]\n", program);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -d DEVICE   hidraw node (default: find VID 1430 PID 0150)\n");
+    fprintf(stderr, "  -n COUNT    Round trips to time (default: 2000)\n");
+    fprintf(stderr, "  -r RATE     Send at RATE reports/s instead of back to back\n");
+    fprintf(stderr, "  -c CMD      Command to send: S, Q (needs a figure in slot 0) or R (default: S)\n");
+    fprintf(stderr, "  -h          Show this help message\n");
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "d:n:r:c:h")) != -1) {
+        switch (opt) {
+            case 'd': opt_device = optarg; break;
+            case 'n': opt_count = atol(optarg); break;
+            case 'r': opt_rate = atof(optarg); break;
+            case 'c': opt_command = optarg[0]; break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (opt_count <= 0 || opt_rate < 0 || !strchr("SQR", opt_command)) {
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    char path[300];
+    if (opt_device) {
+        snprintf(path, sizeof(path), "%s", opt_device);
+    } else if (find_portal(path, sizeof(path)) < 0) {
+        fprintf(stderr, "No hidraw device with VID %04x PID %04x found\n", PORTAL_VID, PORTAL_PID);
+        return 2;
+    }
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        perror(path);
+        return 2;
+    }
+
+    printf("Device: %s\n", path);
+    print_endpoint_intervals(path);
+
+    uint8_t report[USB_EP_SIZE + 1];
+    uint8_t response[PORTAL_BUFFER_SIZE];
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    // Activate so Q/R are answered, and drain anything queued
+    build_report(report, 0);
+    report[1] = CMD_ACTIVATE;
+    report[2] = 0x01;
+    if (write(fd, report, sizeof(report)) < 0) {
+        perror("write");
+        return 2;
+    }
+    while (poll(&pfd, 1, 100) > 0 && read(fd, response, sizeof(response)) > 0);
+
+    long timeouts = 0, mismatches = 0;
+    double sum = 0, sum_sq = 0;
+    uint64_t period_ns = opt_rate > 0 ? (uint64_t)(1e9 / opt_rate) : 0;
+    uint64_t start = latency_now_ns();
+    uint64_t next_send = start;
+
+    for (long i = 0; i < opt_count; i++) {
+        if (period_ns) {
+            while (latency_now_ns() < next_send) {
+                struct timespec ts = { 0, (long)(next_send - latency_now_ns()) };
+                nanosleep(&ts, NULL);
+            }
+            next_send += period_ns;
+        }
+
+        size_t len = build_report(report, i);
+        uint64_t t0 = latency_now_ns();
+        if (write(fd, report, len) < 0) {
+            perror("write");
+            break;
+        }
+
+        // Skip unsolicited reports until the answer to this command arrives
+        bool answered = false;
+        while (!answered) {
+            int remaining = RTT_TIMEOUT_MS - (int)((latency_now_ns() - t0) / 1000000);
+            if (remaining <= 0 || poll(&pfd, 1, remaining) <= 0) break;
+            ssize_t n = read(fd, response, sizeof(response));
+            if (n <= 0) break;
+            if (response[0] == opt_command) answered = true;
+            else mismatches++;
+        }
+
+        if (!answered) {
+            timeouts++;
+            continue;
+        }
+
+        uint64_t rtt = latency_now_ns() - t0;
+        latency_record(opt_command, rtt);
+        sum += rtt;
+        sum_sq += (double)rtt * rtt;
+    }
+
+    double wall = (latency_now_ns() - start) / 1e9;
+    close(fd);
+
+    latency_summary_t s;
+    latency_summarize(opt_command, &s);
+    double mean = s.count ? sum / s.count : 0;
+    double stddev = s.count ? sqrt(fmax(0, sum_sq / s.count - mean * mean)) : 0;
+
+    printf("Command '%c': %llu round trips in %.3f s (%.0f reports/s)%s\n", opt_command,
+           (unsigned long long)s.count, wall, s.count / wall,
+           period_ns ? "" : ", back to back");
+    printf("RTT us: min %.1f  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+           s.min / 1e3, s.p50 / 1e3, s.p99 / 1e3, s.p999 / 1e3, s.max / 1e3);
+    printf("Jitter us: stddev %.1f  p99-p50 %.1f\n", stddev / 1e3, (s.p99 - s.p50) / 1e3);
+    if (timeouts || mismatches) {
+        printf("Timeouts: %ld, unexpected reports: %ld\n", timeouts, mismatches);
+    }
+
+    return timeouts ? 1 : 0;
+}
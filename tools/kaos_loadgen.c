@@ -0,0 +1,392 @@
+#define _GNU_SOURCE
+#include "portal.h"
+#include "portal_queue.h"
+#include "latency.h"
+#include "usb_gadget.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+/**
+ * kaos-loadgen: synthetic console workload against the portal core
+ *
+ * A console thread drives portal_process_command the way a game does:
+ * activate, poll status at a fixed interval, read all 64 blocks of every
+ * figure that arrives, write save bursts periodically and spam LED colors.
+ * Player threads concurrently lift figures off the portal and put new ones
+ * on, or swap them in place. Reports sustained commands/s, per-opcode tail
+ * latency, CPU use and how long the console took to recognize each figure.
+ *
+ * Players post their swaps to a portal queue, as the web server does, and
+ * the console thread applies them between commands like the portal thread.
+ */
+
+#define LOADGEN_MAX_PLAYERS     4       // Slots 0..3
+#define LOADGEN_MAX_SAMPLES     65536   // Swap-to-recognized samples kept
+
+// Options (intervals in microseconds, 0 = back to back)
+static double opt_duration = 10.0;
+static uint64_t opt_status_us = 20000;
+static int opt_read_burst = SKYLANDER_BLOCKS;
+static uint64_t opt_save_us = 5000000;
+static int opt_write_burst = 8;
+static uint64_t opt_led_us = 100000;
+static int opt_players = 2;
+static uint64_t opt_swap_us = 3000000;
+static uint64_t opt_swap_gap_us = 200000;
+static bool opt_verbose = false;
+
+static portal_t portal;
+static portal_queue_t queue;
+static atomic_bool running = true;
+
+// Counters
+static uint64_t commands = 0;
+static uint64_t failed = 0;
+static atomic_uint_fast64_t swaps = 0;
+
+// Swap to recognized: player stamps the load, console sees the arrival
+static _Atomic uint64_t placed_at[LOADGEN_MAX_PLAYERS];
+static uint64_t recognized_us[LOADGEN_MAX_SAMPLES];
+static int recognized_count = 0;
+
+static uint64_t now_us(void) {
+    return latency_now_ns() / 1000;
+}
+
+static void sleep_until_us(uint64_t target_us) {
+    struct timespec ts = {
+        .tv_sec = target_us / 1000000,
+        .tv_nsec = (target_us % 1000000) * 1000
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0);
+}
+
+/**
+ * Send one command and record its latency
+ * Returns response length, 0 for no response, -1 on error
+ */
+static int send_command(const uint8_t* cmd, uint8_t* response) {
+    uint8_t report[PORTAL_BUFFER_SIZE] = {0};
+    memcpy(report, cmd, 19);    // Reports are fixed size; longest command is W
+
+    // Swaps land between commands, outside the measured latency
+    portal_queue_apply(&queue, &portal);
+
+    size_t response_len = 0;
+    uint64_t t0 = latency_now_ns();
+
+    pthread_mutex_lock(&queue.state_lock);
+    int rc = portal_process_command(&portal, report, USB_EP_SIZE, response, &response_len);
+    pthread_mutex_unlock(&queue.state_lock);
+
+    commands++;
+    if (rc < 0) {
+        failed++;
+        return -1;
+    }
+    if (rc > 0 && response_len > 0) {
+        latency_record(cmd[0], latency_now_ns() - t0);
+        if ((cmd[0] == CMD_READ || cmd[0] == CMD_WRITE) && response[1] == RESP_RESULT_ERROR) {
+            failed++;
+            return -1;
+        }
+        return (int)response_len;
+    }
+    return 0;
+}
+
+/**
+ * Console: the game's side of the USB connection
+ */
+static void* console_thread(void* arg) {
+    (void)arg;
+    uint8_t cmd[19];
+    uint8_t response[PORTAL_BUFFER_SIZE];
+    uint16_t present = 0;
+
+    // Pending bursts, one per slot
+    int read_next[MAX_SKYLANDERS];
+    int write_left[MAX_SKYLANDERS];
+    for (int i = 0; i < MAX_SKYLANDERS; i++) {
+        read_next[i] = -1;
+        write_left[i] = 0;
+    }
+
+    memset(cmd, 0, sizeof(cmd));
+    cmd[0] = CMD_ACTIVATE;
+    cmd[1] = 0x01;
+    send_command(cmd, response);
+
+    uint64_t now = now_us();
+    uint64_t next_status = now;
+    uint64_t next_save = now + opt_save_us;
+    uint64_t next_led = now;
+    uint8_t led = 0;
+
+    while (atomic_load(&running)) {
+        // Bursts run back to back, as games do after an arrival or save
+        int slot = -1;
+        for (int i = 0; i < MAX_SKYLANDERS && slot < 0; i++) {
+            if (read_next[i] >= 0 || write_left[i] > 0) slot = i;
+        }
+
+        if (slot >= 0) {
+            memset(cmd, 0, sizeof(cmd));
+            cmd[1] = slot;
+            if (read_next[slot] >= 0) {
+                cmd[0] = CMD_READ;
+                cmd[2] = read_next[slot]++;
+                if (read_next[slot] >= opt_read_burst) read_next[slot] = -1;
+            } else {
+                cmd[0] = CMD_WRITE;
+                cmd[2] = 8 + --write_left[slot];
+                memset(cmd + 3, led, SKYLANDER_BLOCK_SIZE);
+            }
+
+            // A figure lifted mid-burst ends the burst
+            if (send_command(cmd, response) < 0) {
+                read_next[slot] = -1;
+                write_left[slot] = 0;
+            }
+            continue;
+        }
+
+        // Otherwise wait for the earliest periodic command
+        uint64_t next = next_status;
+        if (opt_led_us && next_led < next) next = next_led;
+        if (next_save < next) next = next_save;
+        if (next > now_us()) sleep_until_us(next);
+        now = now_us();
+
+        // Saves and LED changes take priority so a zero poll interval cannot starve them
+        memset(cmd, 0, sizeof(cmd));
+        if (now >= next_save) {
+            for (int i = 0; i < MAX_SKYLANDERS; i++) {
+                if (present & (1 << i)) write_left[i] = opt_write_burst;
+            }
+            next_save += opt_save_us;
+        } else if (opt_led_us && now >= next_led) {
+            cmd[0] = CMD_COLOR;
+            cmd[1] = led;
+            cmd[2] = 255 - led;
+            cmd[3] = led / 2;
+            led += 8;
+            send_command(cmd, response);
+            next_led += opt_led_us;
+            if (next_led < now) next_led = now;
+        } else if (now >= next_status) {
+            cmd[0] = CMD_STATUS;
+            if (send_command(cmd, response) >= PORTAL_STATUS_REPORT_SIZE) {
+                uint32_t status = response[1] | response[2] << 8 | response[3] << 16 |
+                                  (uint32_t)response[4] << 24;
+                uint16_t known = present;
+                present = 0;
+                for (int i = 0; i < MAX_SKYLANDERS; i++) {
+                    uint8_t slot_status = (status >> (i * 2)) & 0x3;
+                    
+                    // Arrivals, and figures already on the portal when it was activated
+                    if (slot_status == SLOT_STATUS_ADDED ||
+                        (slot_status == SLOT_STATUS_PRESENT && !(known & (1 << i)))) {
+                        read_next[i] = 0;
+                        uint64_t placed = i < LOADGEN_MAX_PLAYERS ? atomic_exchange(&placed_at[i], 0) : 0;
+                        if (placed && recognized_count < LOADGEN_MAX_SAMPLES) {
+                            recognized_us[recognized_count++] = now_us() - placed;
+                        }
+                    }
+                    if (slot_status == SLOT_STATUS_ADDED || slot_status == SLOT_STATUS_PRESENT) {
+                        present |= 1 << i;
+                    }
+                }
+            }
+            next_status = opt_status_us ? next_status + opt_status_us : now;
+            if (next_status < now) next_status = now;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Player: swaps the figure in one slot
+ */
+static void* player_thread(void* arg) {
+    int slot = (int)(intptr_t)arg;
+    unsigned int seed = 0x5EED + slot;
+    portal_msg_t msg = { .type = PORTAL_MSG_LOAD, .slot = slot };
+    int generation = 0;
+
+    while (atomic_load(&running)) {
+        for (int i = 0; i < SKYLANDER_DATA_SIZE; i++) {
+            msg.data[i] = rand_r(&seed);
+        }
+        snprintf(msg.name, sizeof(msg.name), "loadgen-p%d-%d.bin", slot, generation++);
+
+        atomic_store(&placed_at[slot], now_us());
+        while (portal_queue_post(&queue, &msg) != 0 && atomic_load(&running)) {
+            usleep(1000);
+        }
+
+        // Leave it on the portal for a jittered interval
+        uint64_t stay = opt_swap_us / 2 + (opt_swap_us ? rand_r(&seed) % opt_swap_us : 0);
+        uint64_t until = now_us() + stay;
+        while (atomic_load(&running) && now_us() < until) usleep(10000);
+        if (!atomic_load(&running)) break;
+
+        // Without a gap the next figure is swapped in over this one
+        if (opt_swap_gap_us) {
+            portal_msg_t unload = { .type = PORTAL_MSG_UNLOAD, .slot = slot };
+            while (portal_queue_post(&queue, &unload) != 0 && atomic_load(&running)) {
+                usleep(1000);
+            }
+            usleep(opt_swap_gap_us);
+        }
+        atomic_fetch_add(&swaps, 1);
+    }
+
+    return NULL;
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [OPTIONS]\n", program);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options (intervals in ms, 0 = back to back):\n");
+    fprintf(stderr, "  -d SECONDS  Run time (default: 10)\n");
+    fprintf(stderr, "  -i MS       Status poll interval (default: 20)\n");
+    fprintf(stderr, "  -q N        Blocks read per figure arrival (default: 64)\n");
+    fprintf(stderr, "  -w MS       Save burst interval (default: 5000)\n");
+    fprintf(stderr, "  -b N        Blocks written per save burst (default: 8)\n");
+    fprintf(stderr, "  -c MS       LED color interval, 0 disables (default: 100)\n");
+    fprintf(stderr, "  -p N        Players swapping figures, 0-%d (default: 2)\n", LOADGEN_MAX_PLAYERS);
+    fprintf(stderr, "  -s MS       Mean time a figure stays on the portal (default: 3000)\n");
+    fprintf(stderr, "  -g MS       Empty slot time between figures, 0 swaps in place (default: 200)\n");
+    fprintf(stderr, "  -v          Show portal log output\n");
+    fprintf(stderr, "  -h          Show this help message\n");
+}
+
+static uint64_t ms_arg(const char* arg) {
+    return (uint64_t)(atof(arg) * 1000);
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "d:i:q:w:b:c:p:s:g:vh")) != -1) {
+        switch (opt) {
+            case 'd': opt_duration = atof(optarg); break;
+            case 'i': opt_status_us = ms_arg(optarg); break;
+            case 'q': opt_read_burst = atoi(optarg); break;
+            case 'w': opt_save_us = ms_arg(optarg); break;
+            case 'b': opt_write_burst = atoi(optarg); break;
+            case 'c': opt_led_us = ms_arg(optarg); break;
+            case 'p': opt_players = atoi(optarg); break;
+            case 's': opt_swap_us = ms_arg(optarg); break;
+            case 'g': opt_swap_gap_us = ms_arg(optarg); break;
+            case 'v': opt_verbose = true; break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (opt_duration <= 0 || opt_players < 0 || opt_players > LOADGEN_MAX_PLAYERS ||
+        opt_read_burst < 0 || opt_read_burst > SKYLANDER_BLOCKS ||
+        opt_write_burst < 0 || opt_write_burst > SKYLANDER_BLOCKS - 8 || opt_save_us == 0) {
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    // The portal logs to stdout; keep the report readable
+    int saved_stdout = -1;
+    if (!opt_verbose) {
+        fflush(stdout);
+        saved_stdout = dup(STDOUT_FILENO);
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) {
+            dup2(devnull, STDOUT_FILENO);
+            close(devnull);
+        }
+    }
+
+    portal_init(&portal);
+    if (portal_queue_init(&queue) < 0) {
+        return 1;
+    }
+
+    struct rusage usage_start, usage_end;
+    getrusage(RUSAGE_SELF, &usage_start);
+    uint64_t start = now_us();
+
+    pthread_t console_tid;
+    pthread_t player_tids[LOADGEN_MAX_PLAYERS];
+    for (int i = 0; i < opt_players; i++) {
+        pthread_create(&player_tids[i], NULL, player_thread, (void*)(intptr_t)i);
+    }
+    pthread_create(&console_tid, NULL, console_thread, NULL);
+
+    sleep_until_us(start + (uint64_t)(opt_duration * 1e6));
+    atomic_store(&running, false);
+
+    pthread_join(console_tid, NULL);
+    for (int i = 0; i < opt_players; i++) {
+        pthread_join(player_tids[i], NULL);
+    }
+    portal_queue_cleanup(&queue);
+
+    double wall = (now_us() - start) / 1e6;
+    getrusage(RUSAGE_SELF, &usage_end);
+    double cpu = (usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec) +
+                 (usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec) / 1e6 +
+                 (usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) +
+                 (usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec) / 1e6;
+
+    if (saved_stdout >= 0) {
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+
+    printf("Workload: status every %.1f ms, %d-block reads on arrival, %d-block saves every %.1f s,\n",
+           opt_status_us / 1e3, opt_read_burst, opt_write_burst, opt_save_us / 1e6);
+    printf("          LED every %.1f ms, %d players swapping every ~%.1f s (%s)\n",
+           opt_led_us / 1e3, opt_players, opt_swap_us / 1e6,
+           opt_swap_gap_us ? "lift, then place" : "in place");
+    printf("Ran %.2f s: %llu commands (%.0f cmds/s), %llu failed, %llu swaps\n", wall,
+           (unsigned long long)commands, commands / wall, (unsigned long long)failed,
+           (unsigned long long)atomic_load(&swaps));
+    printf("CPU: %.3f s (%.1f%% of one core)\n", cpu, 100.0 * cpu / wall);
+
+    // Load to the console seeing the arrival: bounded below by the status poll interval
+    if (recognized_count > 0) {
+        qsort(recognized_us, recognized_count, sizeof(recognized_us[0]), compare_u64);
+        printf("Swap to recognized: %d figures, p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+               recognized_count, recognized_us[recognized_count / 2] / 1e3,
+               recognized_us[(int)(recognized_count * 0.99)] / 1e3,
+               recognized_us[recognized_count - 1] / 1e3);
+    }
+
+    printf("\n%-4s %10s %10s %10s %10s %10s\n", "cmd", "count", "p50 us", "p99 us", "p999 us", "max us");
+    for (int i = 0; i < LATENCY_OPCODE_COUNT; i++) {
+        latency_summary_t s;
+        if (latency_summarize((uint8_t)LATENCY_OPCODES[i], &s) < 0 || s.count == 0) continue;
+        printf("%-4c %10llu %10.2f %10.2f %10.2f %10.2f\n", LATENCY_OPCODES[i],
+               (unsigned long long)s.count, s.p50 / 1e3, s.p99 / 1e3, s.p999 / 1e3, s.max / 1e3);
+    }
+
+    return 0;
+}
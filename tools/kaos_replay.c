@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+#include "portal.h"
+#include "trace.h"
+#include "latency.h"
+#include "usb_gadget.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+/**
+ * kaos-replay: replay a portal trace captured with `kaos-pi -t FILE`
+ *
+ * Feeds every OUT report of the trace to portal_process_command, either
+ * directly (in-process) or through a socketpair to a portal thread
+ * (loopback), at the original pace or as fast as possible. Responses are
+ * compared with the recorded IN reports and latency percentiles per
+ * opcode are reported.
+ *
+ * Exit status: 0 = no divergence, 1 = divergence, 2 = error
+ */
+
+#define LOOPBACK_TIMEOUT_MS     1000    // Wait for an expected response
+
+// Trace record held in memory
+typedef struct {
+    uint64_t time_us;
+    uint8_t type;
+    uint8_t slot;
+    uint16_t length;
+    uint8_t* data;
+} replay_record_t;
+
+// Options
+static bool opt_loopback = false;
+static bool opt_max_speed = false;
+static double opt_speed = 1.0;
+static bool opt_verbose = false;
+static int opt_max_diffs = 10;
+
+static portal_t portal;
+
+/**
+ * Load the whole trace into memory
+ */
+static replay_record_t* load_trace(const char* path, size_t* count) {
+    trace_reader_t reader;
+    if (trace_reader_open(&reader, path) < 0) return NULL;
+
+    size_t cap = 4096;
+    size_t n = 0;
+    replay_record_t* records = malloc(cap * sizeof(replay_record_t));
+    trace_record_t rec;
+    int rc = 0;
+
+    while (records && (rc = trace_reader_next(&reader, &rec)) == 1) {
+        if (n == cap) {
+            cap *= 2;
+            replay_record_t* grown = realloc(records, cap * sizeof(replay_record_t));
+            if (!grown) break;
+            records = grown;
+        }
+
+        replay_record_t* r = &records[n];
+        r->time_us = rec.time_us;
+        r->type = rec.type;
+        r->slot = rec.slot;
+        r->length = rec.length;
+        r->data = malloc(rec.length ? rec.length : 1);
+        if (!r->data) break;
+        memcpy(r->data, rec.data, rec.length);
+        n++;
+    }
+
+    if (rc < 0) {
+        fprintf(stderr, "%s: truncated or corrupt after %zu records\n", path, n);
+    }
+
+    trace_reader_close(&reader);
+    *count = n;
+    return records;
+}
+
+static void free_trace(replay_record_t* records, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(records[i].data);
+    }
+    free(records);
+}
+
+/**
+ * Apply a figure load or unload from the trace
+ */
+static void apply_slot_change(const replay_record_t* r) {
+    if (r->slot >= MAX_SKYLANDERS) return;
+
+    if (r->type == TRACE_UNLOAD) {
+        portal_unload_skylander(&portal, r->slot);
+        return;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "trace-slot%d", r->slot);
+    portal_load_skylander_from_buffer(&portal, r->slot, r->data, r->length, name);
+}
+
+/**
+ * Sleep until an absolute CLOCK_MONOTONIC time in nanoseconds
+ */
+static void sleep_until_ns(uint64_t target_ns) {
+    struct timespec ts = {
+        .tv_sec = target_ns / 1000000000ULL,
+        .tv_nsec = target_ns % 1000000000ULL
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0);
+}
+
+/**
+ * Loopback device side: behaves like portal_thread over a socket
+ */
+static void* loopback_device(void* arg) {
+    int fd = *(int*)arg;
+    uint8_t buffer[PORTAL_BUFFER_SIZE];
+    uint8_t response[PORTAL_BUFFER_SIZE];
+
+    for (;;) {
+        ssize_t bytes = recv(fd, buffer, sizeof(buffer), 0);
+        if (bytes <= 0) break;
+
+        size_t response_len = 0;
+        if (portal_process_command(&portal, buffer, bytes, response, &response_len) > 0 &&
+            response_len > 0) {
+            send(fd, response, response_len, MSG_NOSIGNAL);
+        }
+    }
+
+    return NULL;
+}
+
+static void print_hex(FILE* out, const uint8_t* data, size_t len) {
+    if (len == 0) {
+        fprintf(out, "(none)");
+        return;
+    }
+    for (size_t i = 0; i < len && i < 24; i++) {
+        fprintf(out, "%02X", data[i]);
+    }
+    if (len > 24) fprintf(out, "...");
+}
+
+/**
+ * Report a response that differs from the trace
+ */
+static void report_diff(int* diffs, size_t index, const replay_record_t* out,
+                        const uint8_t* expected, size_t expected_len,
+                        const uint8_t* actual, size_t actual_len) {
+    (*diffs)++;
+    if (*diffs > opt_max_diffs) return;
+
+    fprintf(stderr, "DIVERGENCE at record %zu (t=%.3fs) cmd ", index, out->time_us / 1e6);
+    print_hex(stderr, out->data, out->length);
+    fprintf(stderr, "\n  expected ");
+    print_hex(stderr, expected, expected_len);
+    fprintf(stderr, "\n  actual   ");
+    print_hex(stderr, actual, actual_len);
+    fprintf(stderr, "\n");
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [OPTIONS] TRACE\n", program);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -l          Replay over a loopback socket instead of in-process\n");
+    fprintf(stderr, "  -m          Replay as fast as possible\n");
+    fprintf(stderr, "  -s FACTOR   Replay speed relative to the capture (default: 1.0)\n");
+    fprintf(stderr, "  -d N        Print at most N divergences (default: 10)\n");
+    fprintf(stderr, "  -v          Show portal log output\n");
+    fprintf(stderr, "  -h          Show this help message\n");
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "lms:d:vh")) != -1) {
+        switch (opt) {
+            case 'l': opt_loopback = true; break;
+            case 'm': opt_max_speed = true; break;
+            case 's':
+                opt_speed = atof(optarg);
+                if (opt_speed <= 0) {
+                    fprintf(stderr, "Invalid speed: %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'd': opt_max_diffs = atoi(optarg); break;
+            case 'v': opt_verbose = true; break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (optind >= argc) {
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    size_t count = 0;
+    replay_record_t* records = load_trace(argv[optind], &count);
+    if (!records) return 2;
+
+    // The portal logs to stdout; keep the report readable
+    int saved_stdout = -1;
+    if (!opt_verbose) {
+        fflush(stdout);
+        saved_stdout = dup(STDOUT_FILENO);
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) {
+            dup2(devnull, STDOUT_FILENO);
+            close(devnull);
+        }
+    }
+
+    portal_init(&portal);
+
+    int fds[2] = { -1, -1 };
+    pthread_t device_tid;
+    if (opt_loopback) {
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0 ||
+            pthread_create(&device_tid, NULL, loopback_device, &fds[1]) != 0) {
+            perror("Failed to start loopback device");
+            free_trace(records, count);
+            return 2;
+        }
+    }
+
+    uint8_t response[PORTAL_BUFFER_SIZE];
+    size_t commands = 0;
+    int diffs = 0;
+    uint64_t start_ns = latency_now_ns();
+    uint64_t first_us = count > 0 ? records[0].time_us : 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const replay_record_t* r = &records[i];
+
+        if (r->type == TRACE_LOAD || r->type == TRACE_UNLOAD) {
+            apply_slot_change(r);
+            continue;
+        }
+        if (r->type != TRACE_OUT) continue;
+
+        if (!opt_max_speed) {
+            sleep_until_ns(start_ns + (uint64_t)((r->time_us - first_us) * 1000.0 / opt_speed));
+        }
+
+        // The recorded response, if any, directly follows its command
+        const replay_record_t* expected = NULL;
+        if (i + 1 < count && records[i + 1].type == TRACE_IN) {
+            expected = &records[i + 1];
+        }
+
+        size_t response_len = 0;
+        bool responded = false;
+        uint64_t t0 = latency_now_ns();
+
+        if (opt_loopback) {
+            // Anything still queued answers an earlier command that expected none
+            struct pollfd pfd = { .fd = fds[0], .events = POLLIN };
+            while (poll(&pfd, 1, 0) > 0) {
+                ssize_t n = recv(fds[0], response, sizeof(response), 0);
+                if (n <= 0) break;
+                report_diff(&diffs, i, r, NULL, 0, response, n);
+            }
+
+            t0 = latency_now_ns();
+            send(fds[0], r->data, r->length, MSG_NOSIGNAL);
+            if (expected && poll(&pfd, 1, LOOPBACK_TIMEOUT_MS) > 0) {
+                ssize_t n = recv(fds[0], response, sizeof(response), 0);
+                if (n > 0) {
+                    response_len = n;
+                    responded = true;
+                }
+            }
+        } else {
+            responded = portal_process_command(&portal, r->data, r->length,
+                                               response, &response_len) > 0 &&
+                        response_len > 0;
+        }
+
+        uint64_t elapsed = latency_now_ns() - t0;
+        commands++;
+        if (responded) {
+            latency_record(r->data[0], elapsed);
+        }
+
+        if (!responded) response_len = 0;
+        if (expected) {
+            if (response_len != expected->length ||
+                memcmp(response, expected->data, response_len) != 0) {
+                report_diff(&diffs, i, r, expected->data, expected->length, response, response_len);
+            }
+        } else if (responded) {
+            report_diff(&diffs, i, r, NULL, 0, response, response_len);
+        }
+    }
+
+    double wall = (latency_now_ns() - start_ns) / 1e9;
+
+    if (opt_loopback) {
+        // Late answers to the final commands
+        struct pollfd pfd = { .fd = fds[0], .events = POLLIN };
+        while (count > 0 && poll(&pfd, 1, 10) > 0) {
+            ssize_t n = recv(fds[0], response, sizeof(response), 0);
+            if (n <= 0) break;
+            report_diff(&diffs, count - 1, &records[count - 1], NULL, 0, response, n);
+        }
+        
+        shutdown(fds[0], SHUT_RDWR);
+        pthread_join(device_tid, NULL);
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    if (saved_stdout >= 0) {
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+
+    // Report
+    double captured = count > 0 ? (records[count - 1].time_us - first_us) / 1e6 : 0;
+    printf("Trace: %s, %zu records, %.3f s captured\n", argv[optind], count, captured);
+    printf("Replay: %s, %s\n", opt_loopback ? "loopback" : "in-process",
+           opt_max_speed ? "max speed" : "original pace");
+    printf("  %zu commands in %.3f s (%.0f cmds/s)\n", commands, wall,
+           wall > 0 ? commands / wall : 0);
+    printf("\n%-4s %10s %10s %10s %10s %10s\n", "cmd", "count", "p50 us", "p99 us", "p999 us", "max us");
+    for (int i = 0; i < LATENCY_OPCODE_COUNT; i++) {
+        latency_summary_t s;
+        if (latency_summarize((uint8_t)LATENCY_OPCODES[i], &s) < 0 || s.count == 0) continue;
+        printf("%-4c %10llu %10.2f %10.2f %10.2f %10.2f\n", LATENCY_OPCODES[i],
+               (unsigned long long)s.count, s.p50 / 1e3, s.p99 / 1e3, s.p999 / 1e3, s.max / 1e3);
+    }
+    printf("\nDivergences: %d\n", diffs);
+
+    free_trace(records, count);
+    return diffs > 0 ? 1 : 0;
+}